@@ -0,0 +1,425 @@
+// -*- LSST-C++ -*-
+/*
+ * LSST Data Management System
+ * Copyright 2008-2015 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+/*
+ * Check that the fast paths through the Kron measurement agree with the reference implementation
+ *
+ * Usage:
+ *     kronAccuracy [--quick] [--threads N] [--config NAME] [OUTPUT.json]
+ *
+ * We draw a corpus of fields of random galaxies, and measure every source with KronAperture::measureBatch
+ * twice for each configuration: with the reference settings (full-resolution images, a fixed number of
+ * iterations, one thread), and with a fast path enabled.  For the sources that both succeed we report
+ * the median, 90th and 99th percentile and maximum of the relative difference in Kron radius, and of the
+ * difference in flux in units of the reference flux error; and the fraction of sources that succeed in
+ * only one of the runs.
+ *
+ * The kernel variant is chosen when the library's loaded, so the "kernelVariant" configuration measures
+ * its reference in a copy of this program run with LSST_KRON_KERNEL_VARIANT=default (and the hidden
+ * option --dumpReference), and requires the variant that this CPU uses to reproduce it exactly.
+ *
+ * The results are written as JSON to OUTPUT.json (or stdout) and as a table to stderr; the exit status
+ * is 1 if any configuration exceeds its declared tolerances.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lsst/geom.h"
+#include "lsst/afw/image/Exposure.h"
+#include "lsst/afw/detection/GaussianPsf.h"
+#include "lsst/meas/extensions/photometryKron.h"
+
+namespace geom = lsst::geom;
+namespace afwImage = lsst::afw::image;
+namespace afwDetection = lsst::afw::detection;
+namespace photometryKron = lsst::meas::extensions::photometryKron;
+
+using photometryKron::KronAperture;
+using photometryKron::KronBatchResult;
+using photometryKron::KronFluxControl;
+using photometryKron::KronStatus;
+
+namespace {
+
+struct Options {
+    bool quick = false;                 // use a smaller corpus
+    int nThreads = 0;                   // threads for the "threads" configuration; all cores if <= 0
+    std::string config;                 // only run this configuration, if set
+    std::string output;                 // file to write; stdout if empty
+    bool dumpReference = false;         // write --config's reference measurements to stdout, and exit
+    std::string argv0;                  // how we were run
+};
+
+/*
+ * The largest acceptable 99th percentile and maximum of a difference
+ */
+struct Tolerance {
+    double p99;
+    double max;
+};
+
+/*
+ * A fast path, and how closely it must agree with the reference
+ */
+struct Configuration {
+    std::string name;
+    KronFluxControl reference;          // the reference settings
+    KronFluxControl fast;               // the settings that enable the fast path
+    int nThreads;                       // threads for the fast run; the reference uses one
+    bool pixelView;                     // measure a KronMaskedPixelView rather than the MaskedImage
+    bool defaultVariant;                // measure the reference with the default kernel variant
+    Tolerance radius;                   // relative difference in Kron radius
+    Tolerance flux;                     // difference in flux, in units of the reference flux error
+    double maxMismatch;                 // largest fraction of sources that succeed in only one run
+};
+
+/*
+ * The distribution of a difference
+ */
+struct Summary {
+    double p50 = 0, p90 = 0, p99 = 0, max = 0;
+
+    explicit Summary(std::vector<double> values) {
+        if (values.empty()) {
+            return;
+        }
+        std::sort(values.begin(), values.end());
+        auto percentile = [&values](double p) {
+            return values[std::min(values.size() - 1, static_cast<std::size_t>(p*values.size()))];
+        };
+        p50 = percentile(0.50);
+        p90 = percentile(0.90);
+        p99 = percentile(0.99);
+        max = values.back();
+    }
+
+    bool passes(Tolerance const& tol) const { return p99 <= tol.p99 && max <= tol.max; }
+};
+
+struct Result {
+    Configuration const* config;
+    int nSource;
+    int nCompared;                      // sources measured successfully in both runs
+    int nMismatch;                      // sources measured successfully in only one run
+    Summary radius;
+    Summary flux;
+
+    double getMismatchFraction() const { return (nSource > 0) ? static_cast<double>(nMismatch)/nSource : 0; }
+
+    bool passes() const {
+        return radius.passes(config->radius) && flux.passes(config->flux) &&
+            getMismatchFraction() <= config->maxMismatch;
+    }
+};
+
+/*
+ * A field of random galaxies, and their true positions and (unconvolved) shapes
+ */
+struct Field {
+    Field(int size, int nSource, unsigned int seed) {
+        geom::Box2I const bbox(geom::Point2I(0, 0), geom::Extent2I(size, size));
+        galaxies = photometryKron::makeRandomGalaxies(bbox, nSource, 500.0, 1e5, seed);
+        exposure = photometryKron::makeSyntheticExposure(
+            bbox, galaxies, std::make_shared<afwDetection::GaussianPsf>(21, 21, 2.0), 1.0, nullptr, seed);
+    }
+
+    std::vector<photometryKron::SyntheticGalaxy> galaxies;
+    std::shared_ptr<afwImage::Exposure<float>> exposure;
+};
+
+std::vector<Configuration> makeConfigurations(Options const& opts) {
+    KronFluxControl reference;
+    reference.nIterForRadius = 3;
+    reference.momentShapeTolerance = 0;
+
+    std::vector<Configuration> configs;
+    // Paths that should reproduce the reference exactly
+    configs.push_back({"threads", reference, reference, opts.nThreads, false, false, {0, 0}, {0, 0}, 0});
+    configs.push_back({"pixelView", reference, reference, 1, true, false, {0, 0}, {0, 0}, 0});
+    configs.push_back({"kernelVariant", reference, reference, 1, false, true, {0, 0}, {0, 0}, 0});
+
+    for (int binFactor : {2, 4}) {
+        KronFluxControl fast = reference;
+        fast.binFactorForRadius = binFactor;
+        double const scale = binFactor/2.0;
+        configs.push_back({"binFactorForRadius" + std::to_string(binFactor), reference, fast, 1, false, false,
+                           {1e-2*scale, 5e-2*scale}, {0.1*scale, 1.0*scale}, 1e-2});
+    }
+
+    KronFluxControl converged = reference;
+    converged.nIterForRadius = 10;
+    converged.radiusTolerance = 1e-2;
+    configs.push_back({"radiusTolerance", reference, converged, 1, false, false, {1e-2, 5e-2}, {0.1, 1.0},
+                       1e-2});
+
+    // Every pixel's radius is within momentShapeTolerance, so <r> (and hence R_K) is too for bright sources
+    KronFluxControl cheapShapes = reference;
+    cheapShapes.momentShapeTolerance = KronFluxControl().momentShapeTolerance;
+    configs.push_back({"momentShapeTolerance", reference, cheapShapes, 1, false, false,
+                       {cheapShapes.momentShapeTolerance, 3*cheapShapes.momentShapeTolerance}, {0.05, 0.5},
+                       1e-2});
+
+    return configs;
+}
+
+/*
+ * Measure every galaxy in field
+ */
+std::vector<KronBatchResult> measureField(Field const& field, KronFluxControl const& ctrl, int nThreads,
+                                          bool pixelView) {
+    std::size_t const num = field.galaxies.size();
+    ndarray::Array<double, 1, 1> x = ndarray::allocate(num), y = ndarray::allocate(num);
+    ndarray::Array<double, 1, 1> a = ndarray::allocate(num), b = ndarray::allocate(num);
+    ndarray::Array<double, 1, 1> theta = ndarray::allocate(num);
+    for (std::size_t i = 0; i < num; ++i) {
+        auto const& galaxy = field.galaxies[i];
+        x[i] = galaxy.x;
+        y[i] = galaxy.y;
+        a[i] = galaxy.a;
+        b[i] = galaxy.b;
+        theta[i] = galaxy.theta;
+    }
+
+    afwImage::MaskedImage<float> const& mimage = field.exposure->getMaskedImage();
+    if (pixelView) {
+        photometryKron::KronMaskedPixelView<float> const view(mimage);
+        return KronAperture::measureBatch(view, x, y, a, b, theta, ctrl, nThreads);
+    }
+    return KronAperture::measureBatch(mimage, x, y, a, b, theta, ctrl, nThreads);
+}
+
+/*
+ * Write the reference measurements of every field in the corpus, exactly, for measureDefaultVariant
+ */
+void dumpReference(Configuration const& config, std::vector<Field> const& corpus) {
+    for (auto const& field : corpus) {
+        for (auto const& result : measureField(field, config.reference, 1, false)) {
+            std::printf("%d %a %a %a\n", result.status, static_cast<double>(result.radius), result.instFlux,
+                        result.instFluxErr);
+        }
+    }
+}
+
+/*
+ * Measure every field in the corpus with the reference settings and the default kernel variant, by
+ * running this program with --dumpReference in a child process
+ */
+std::vector<std::vector<KronBatchResult>> measureDefaultVariant(Configuration const& config,
+                                                                std::vector<Field> const& corpus,
+                                                                Options const& opts) {
+    std::string const command = "LSST_KRON_KERNEL_VARIANT=default '" + opts.argv0 + "' --dumpReference" +
+        " --config " + config.name + (opts.quick ? " --quick" : "");
+    FILE* pipe = popen(command.c_str(), "r");
+    if (!pipe) {
+        throw std::runtime_error("Unable to run " + command);
+    }
+    std::vector<std::vector<KronBatchResult>> results;
+    bool ok = true;
+    for (auto const& field : corpus) {
+        std::vector<KronBatchResult> fieldResults(field.galaxies.size());
+        for (auto & result : fieldResults) {
+            double radius;
+            if (std::fscanf(pipe, "%d %lf %lf %lf", &result.status, &radius, &result.instFlux,
+                            &result.instFluxErr) != 4) {
+                ok = false;
+                break;
+            }
+            result.radius = radius;
+        }
+        results.push_back(fieldResults);
+    }
+    if (pclose(pipe) != 0 || !ok) {
+        throw std::runtime_error("Failed to read the reference measurements from " + command);
+    }
+    return results;
+}
+
+/*
+ * Compare the reference and fast measurements of every field in the corpus
+ */
+Result compare(Configuration const& config, std::vector<Field> const& corpus, Options const& opts) {
+    Result result = {&config, 0, 0, 0, Summary({}), Summary({})};
+    std::vector<double> dRadius, dFlux;
+    std::vector<std::vector<KronBatchResult>> defaultVariant;
+    if (config.defaultVariant) {
+        defaultVariant = measureDefaultVariant(config, corpus, opts);
+    }
+    for (std::size_t j = 0; j < corpus.size(); ++j) {
+        Field const& field = corpus[j];
+        auto const reference = config.defaultVariant ? defaultVariant[j] :
+            measureField(field, config.reference, 1, false);
+        auto const fast = measureField(field, config.fast, config.nThreads, config.pixelView);
+        for (std::size_t i = 0; i < reference.size(); ++i) {
+            KronBatchResult const& ref = reference[i];
+            KronBatchResult const& test = fast[i];
+            bool const refOk = (ref.status == static_cast<int>(KronStatus::OK));
+            bool const testOk = (test.status == static_cast<int>(KronStatus::OK));
+            ++result.nSource;
+            if (refOk != testOk) {
+                ++result.nMismatch;
+                continue;
+            } else if (!refOk) {
+                continue;
+            }
+            ++result.nCompared;
+            dRadius.push_back(std::fabs(test.radius - ref.radius)/ref.radius);
+            dFlux.push_back((ref.instFluxErr > 0) ? std::fabs(test.instFlux - ref.instFlux)/ref.instFluxErr :
+                            std::fabs(test.instFlux - ref.instFlux));
+        }
+    }
+    result.radius = Summary(dRadius);
+    result.flux = Summary(dFlux);
+    return result;
+}
+
+/*
+ * Write the results as JSON
+ */
+void writeJson(std::ostream& os, std::vector<Result> const& results, Options const& opts) {
+    auto number = [](double value) {
+        std::ostringstream str;
+        str.precision(10);
+        if (std::isfinite(value)) {
+            str << value;
+        } else {
+            str << "null";
+        }
+        return str.str();
+    };
+    auto summary = [&number](Summary const& summary, Tolerance const& tol) {
+        return "{\"p50\": " + number(summary.p50) + ", \"p90\": " + number(summary.p90) +
+            ", \"p99\": " + number(summary.p99) + ", \"max\": " + number(summary.max) +
+            ", \"tolP99\": " + number(tol.p99) + ", \"tolMax\": " + number(tol.max) + "}";
+    };
+
+    os << "{\n";
+    os << "  \"package\": \"meas_extensions_photometryKron\",\n";
+    os << "  \"quick\": " << (opts.quick ? "true" : "false") << ",\n";
+    os << "  \"kernelVariant\": \"" << photometryKron::getKronKernelVariant() << "\",\n";
+    os << "  \"configurations\": [";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        Result const& result = results[i];
+        os << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << result.config->name << "\""
+           << ", \"nSource\": " << result.nSource << ", \"nCompared\": " << result.nCompared
+           << ", \"nMismatch\": " << result.nMismatch
+           << ", \"maxMismatch\": " << number(result.config->maxMismatch)
+           << ", \"radius\": " << summary(result.radius, result.config->radius)
+           << ", \"flux\": " << summary(result.flux, result.config->flux)
+           << ", \"pass\": " << (result.passes() ? "true" : "false") << "}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+/*
+ * Write the results as a table
+ */
+void writeTable(std::ostream& os, std::vector<Result> const& results) {
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-20s %8s %8s %10s %10s %10s %10s %10s %s\n", "configuration",
+                  "sources", "mismatch", "dR/R p50", "dR/R p99", "dR/R max", "dF/err p99", "dF/err max",
+                  "result");
+    os << line;
+    for (auto const& result : results) {
+        std::snprintf(line, sizeof(line), "%-20s %8d %8d %10.2e %10.2e %10.2e %10.2e %10.2e %s\n",
+                      result.config->name.c_str(), result.nSource, result.nMismatch, result.radius.p50,
+                      result.radius.p99, result.radius.max, result.flux.p99, result.flux.max,
+                      result.passes() ? "ok" : "FAIL");
+        os << line;
+    }
+}
+
+void usage(char const* argv0) {
+    std::cerr << "Usage: " << argv0 << " [--quick] [--threads N] [--config NAME] [OUTPUT.json]"
+              << std::endl;
+    std::exit(1);
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv) {
+    Options opts;
+    opts.argv0 = argv[0];
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        if (arg == "--quick") {
+            opts.quick = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            opts.nThreads = std::atoi(argv[++i]);
+        } else if (arg == "--config" && i + 1 < argc) {
+            opts.config = argv[++i];
+        } else if (arg == "--dumpReference") {
+            opts.dumpReference = true;
+        } else if (arg[0] == '-' || !opts.output.empty()) {
+            usage(argv[0]);
+        } else {
+            opts.output = arg;
+        }
+    }
+
+    // A sparse and a crowded field, each with one source per 40x40 or 20x20 pixels
+    std::vector<Field> corpus;
+    int const size = opts.quick ? 512 : 2048;
+    corpus.emplace_back(size, size*size/1600, 1);
+    corpus.emplace_back(size, size*size/400, 2);
+
+    std::vector<Configuration> const configs = makeConfigurations(opts);
+    std::vector<Result> results;
+    for (auto const& config : configs) {
+        if (opts.config.empty() || opts.config == config.name) {
+            if (opts.dumpReference) {
+                dumpReference(config, corpus);
+                return 0;
+            }
+            try {
+                results.push_back(compare(config, corpus, opts));
+            } catch (std::exception const& e) {
+                std::cerr << config.name << ": " << e.what() << std::endl;
+                return 1;
+            }
+        }
+    }
+    if (results.empty()) {
+        std::cerr << "Unknown configuration " << opts.config << std::endl;
+        return 1;
+    }
+
+    if (opts.output.empty()) {
+        writeJson(std::cout, results, opts);
+    } else {
+        std::ofstream os(opts.output);
+        writeJson(os, results, opts);
+    }
+    writeTable(std::cerr, results);
+    bool const pass = std::all_of(results.begin(), results.end(),
+                                  [](Result const& result) { return result.passes(); });
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,902 @@
+// -*- LSST-C++ -*-
+/*
+ * LSST Data Management System
+ * Copyright 2008-2015 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+/*
+ * Time the Kron measurement: its kernels (KronAperture::determineRadius with and without smoothing,
+ * KronAperture::measureFlux on the sinc and summed paths, on float, double, int and uint16 images, and
+ * calculatePsfKronRadius), and the complete KronFluxAlgorithm::measure and measureForced, over a grid of
+ * Kron radii, axis ratios, nIterForRadius and source densities; measure on sources near the image's
+ * border, with and without clipEdgeApertures and the analytic edge classification; measureN against
+ * measure on fields of blended sources; determineRadius for round, axis-aligned and rotated apertures;
+ * and drawing crowded fields of synthetic galaxies with makeSyntheticExposure.
+ *
+ * Usage:
+ *     kronBenchmark [--quick] [--minTime SECONDS] [--repeat N] [OUTPUT.json]
+ *     kronBenchmark --scaling [--quick] [--maxThreads N] [--repeat N] [OUTPUT.json]
+ *
+ * The results are written as JSON to OUTPUT.json (or stdout): each benchmark lists its parameters, the
+ * number of calls per timed batch, and the median and minimum time per call (in ns) over the batches.
+ *
+ * With --scaling, we instead measure whole fields of random galaxies with KronAperture::measureBatch on
+ * 1, 2, 4 ... maxThreads threads (default: all cores): strong scaling over fields of increasing size and
+ * source count, and weak scaling with the field growing in proportion to the number of threads.  Each
+ * run reports its median time, throughput (sources/s), parallel efficiency (throughput relative to
+ * nThread times the single-threaded throughput), the process's peak RSS so far, and the number of calls
+ * to operator new per source; these are written as JSON, and as a table to stderr.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "lsst/pex/exceptions.h"
+#include "lsst/geom.h"
+#include "lsst/daf/base/PropertyList.h"
+#include "lsst/afw/geom/SkyWcs.h"
+#include "lsst/afw/geom/ellipses.h"
+#include "lsst/afw/image/Exposure.h"
+#include "lsst/afw/detection/GaussianPsf.h"
+#include "lsst/afw/table/Source.h"
+#include "lsst/afw/table/aggregates.h"
+#include "lsst/meas/base/exceptions.h"
+#include "lsst/meas/extensions/photometryKron.h"
+
+/*
+ * Count the allocations made by the whole process, so we can report allocations per source
+ */
+namespace {
+std::atomic<long> nAllocation(0);
+} // anonymous namespace
+
+void* operator new(std::size_t size) {
+    nAllocation.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace geom = lsst::geom;
+namespace afwGeom = lsst::afw::geom;
+namespace afwImage = lsst::afw::image;
+namespace afwTable = lsst::afw::table;
+namespace afwDetection = lsst::afw::detection;
+namespace photometryKron = lsst::meas::extensions::photometryKron;
+
+using photometryKron::KronAperture;
+using photometryKron::KronFluxAlgorithm;
+using photometryKron::KronFluxControl;
+
+namespace {
+
+double sink = 0;                        // results are accumulated here so they can't be optimised away
+
+struct Options {
+    bool quick = false;                 // run a reduced grid of parameters
+    double minTime = 0.1;               // minimum duration of a timed batch (s)
+    int nRepeat = 5;                    // number of timed batches
+    bool scaling = false;               // run the thread- and memory-scaling benchmark instead
+    int maxThreads = 0;                 // largest number of threads to scale to; all cores if <= 0
+    std::string output;                 // file to write; stdout if empty
+};
+
+/*
+ * One benchmark's parameters and timings
+ */
+struct Result {
+    std::string name;
+    std::vector<std::pair<std::string, double>> params;
+    long nCall;                         // calls per timed batch
+    double nsPerCall;                   // median over batches
+    double minNsPerCall;                // minimum over batches
+    std::string error;                  // set if the benchmark couldn't be run
+    std::string pixelType;              // type of the measured image's pixels, if it's a parameter
+};
+
+/*
+ * Time func, in batches of calls long enough to take at least opts.minTime
+ *
+ * Func is called once before timing starts; if it throws, the error is recorded instead of a timing.
+ */
+Result timeIt(std::string const& name, std::vector<std::pair<std::string, double>> const& params,
+              std::function<void()> const& func, Options const& opts) {
+    typedef std::chrono::steady_clock Clock;
+    Result result = {name, params, 0, std::nan(""), std::nan(""), ""};
+    try {
+        func();
+    } catch (std::exception const& e) {
+        result.error = e.what();
+        return result;
+    }
+
+    auto timeBatch = [&func](long nCall) {
+        auto const start = Clock::now();
+        for (long i = 0; i < nCall; ++i) {
+            func();
+        }
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    long nCall = 1;
+    for (double elapsed = timeBatch(nCall); elapsed < opts.minTime; elapsed = timeBatch(nCall)) {
+        long const scaled = (elapsed > 0) ? static_cast<long>(1.2*nCall*opts.minTime/elapsed) : 0;
+        nCall = std::max(2*nCall, scaled);
+    }
+
+    std::vector<double> nsPerCall;
+    for (int i = 0; i < opts.nRepeat; ++i) {
+        nsPerCall.push_back(1e9*timeBatch(nCall)/nCall);
+    }
+    std::sort(nsPerCall.begin(), nsPerCall.end());
+    result.nCall = nCall;
+    result.nsPerCall = nsPerCall[nsPerCall.size()/2];
+    result.minNsPerCall = nsPerCall.front();
+    return result;
+}
+
+/*
+ * Write the results as JSON
+ */
+void writeJson(std::ostream& os, std::vector<Result> const& results, Options const& opts) {
+    auto number = [](double value) {
+        std::ostringstream str;
+        str.precision(10);
+        if (std::isfinite(value)) {
+            str << value;
+        } else {
+            str << "null";
+        }
+        return str.str();
+    };
+    auto quote = [](std::string const& str) {
+        std::string quoted = "\"";
+        for (char c : str) {
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+            }
+            quoted += (c == '\n') ? ' ' : c;
+        }
+        return quoted + "\"";
+    };
+
+    os << "{\n";
+    os << "  \"package\": \"meas_extensions_photometryKron\",\n";
+    os << "  \"quick\": " << (opts.quick ? "true" : "false") << ",\n";
+    os << "  \"kernelVariant\": \"" << photometryKron::getKronKernelVariant() << "\",\n";
+    os << "  \"minTime\": " << number(opts.minTime) << ",\n";
+    os << "  \"nRepeat\": " << opts.nRepeat << ",\n";
+    os << "  \"benchmarks\": [";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        Result const& result = results[i];
+        os << (i == 0 ? "\n" : ",\n") << "    {\"name\": " << quote(result.name) << ", \"params\": {";
+        for (std::size_t j = 0; j < result.params.size(); ++j) {
+            os << (j == 0 ? "" : ", ") << quote(result.params[j].first) << ": "
+               << number(result.params[j].second);
+        }
+        os << "}";
+        if (!result.pixelType.empty()) {
+            os << ", \"pixelType\": " << quote(result.pixelType);
+        }
+        if (result.error.empty()) {
+            os << ", \"nCall\": " << result.nCall << ", \"nsPerCall\": " << number(result.nsPerCall)
+               << ", \"minNsPerCall\": " << number(result.minNsPerCall);
+        } else {
+            os << ", \"error\": " << quote(result.error);
+        }
+        os << "}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+/*
+ * Make an exposure of (unconvolved) Gaussian galaxies of total flux 1e5, with a Gaussian PSF, a WCS and
+ * unit variance
+ */
+std::shared_ptr<afwImage::Exposure<float>> makeExposure(int width, int height,
+                                                        std::vector<geom::Point2D> const& centers = {},
+                                                        afwGeom::ellipses::Axes const& axes = {}) {
+    auto wcs = afwGeom::makeSkyWcs(geom::Point2D(0.5*width, 0.5*height),
+                                   geom::SpherePoint(0.0, 0.0, geom::degrees),
+                                   afwGeom::makeCdMatrix(0.2*geom::arcseconds));
+    std::vector<photometryKron::SyntheticGalaxy> galaxies;
+    for (auto const& center : centers) {
+        galaxies.push_back({center.getX(), center.getY(), 1e5, axes.getA(), axes.getB(), axes.getTheta(), 0});
+    }
+    auto exposure = photometryKron::makeSyntheticExposure(
+        geom::Box2I(geom::Point2I(0, 0), geom::Extent2I(width, height)), galaxies, nullptr, 0.0, wcs);
+    exposure->setPsf(std::make_shared<afwDetection::GaussianPsf>(21, 21, 2.0));
+    return exposure;
+}
+
+/*
+ * A catalog with a true centroid and shape in the centroid and shape slots, as measure expects
+ */
+struct TruthCatalog {
+    TruthCatalog() : schema(afwTable::SourceTable::makeMinimalSchema()) {
+        centroidKey = afwTable::PointKey<double>::addFields(schema, "truth", "true centroid", "pixel");
+        shapeKey = afwTable::QuadrupoleKey::addFields(schema, "truth", "true shape",
+                                                      afwTable::CoordinateType::PIXEL);
+        flagKey = schema.addField<afwTable::Flag>("truth_flag", "truth is bad (never set)");
+        schema.getAliasMap()->set("slot_Centroid", "truth");
+        schema.getAliasMap()->set("slot_Shape", "truth");
+    }
+
+    /// Construct the catalog; call after the measurement algorithm has added its fields to the schema
+    afwTable::SourceCatalog makeCatalog(std::vector<geom::Point2D> const& centers,
+                                        afwGeom::ellipses::Axes const& axes) const {
+        afwTable::SourceCatalog catalog(schema);
+        for (auto const& center : centers) {
+            auto record = catalog.addNew();
+            record->set(centroidKey, center);
+            record->set(shapeKey, afwGeom::ellipses::Quadrupole(axes));
+        }
+        return catalog;
+    }
+
+    afwTable::Schema schema;
+    afwTable::PointKey<double> centroidKey;
+    afwTable::QuadrupoleKey shapeKey;
+    afwTable::Key<afwTable::Flag> flagKey;
+};
+
+/*
+ * Measure every source in a catalog, as the measurement framework would; measure(record, i) measures
+ * the i-th record
+ */
+template <typename MeasureT>
+void measureAll(KronFluxAlgorithm const& algorithm, afwTable::SourceCatalog& catalog,
+                MeasureT const& measure) {
+    for (std::size_t i = 0; i < catalog.size(); ++i) {
+        afwTable::SourceRecord& record = catalog[i];
+        try {
+            measure(record, i);
+        } catch (lsst::meas::base::MeasurementError& e) {
+            algorithm.fail(record, &e);
+        } catch (lsst::pex::exceptions::Exception&) {
+            algorithm.fail(record);
+        }
+    }
+}
+
+/*
+ * The name of a pixel type, for the output
+ */
+template <typename PixelT>
+std::string getPixelTypeName();
+template <> std::string getPixelTypeName<float>() { return "float"; }
+template <> std::string getPixelTypeName<double>() { return "double"; }
+template <> std::string getPixelTypeName<int>() { return "int"; }
+template <> std::string getPixelTypeName<std::uint16_t>() { return "uint16"; }
+
+/*
+ * Benchmark the Kron kernels on a single galaxy, drawn in an image of PixelT
+ */
+template <typename PixelT>
+void benchmarkKernels(std::vector<Result>& results, Options const& opts) {
+    std::vector<double> const radii = opts.quick ? std::vector<double>{5} : std::vector<double>{2, 5, 10};
+    std::vector<double> const axisRatios = opts.quick ? std::vector<double>{0.5} :
+        std::vector<double>{1.0, 0.5, 0.2};
+    std::vector<int> const nIters = opts.quick ? std::vector<int>{1} : std::vector<int>{1, 3};
+    std::vector<double> const smoothingSigmas = opts.quick ? std::vector<double>{2} :
+        std::vector<double>{1, 2};
+    double const theta = 0.5;           // position angle (radians)
+    double const nRadiusForFlux = 2.5;
+
+    int const size = 256;
+    geom::Point2D const center(0.5*size + 0.3, 0.5*size - 0.4);
+    std::size_t const nResult = results.size();
+    for (double a : radii) {
+        for (double q : axisRatios) {
+            afwGeom::ellipses::Axes const axes(a, q*a, theta);
+            auto exposure = makeExposure(size, size, {center}, axes);
+            afwImage::MaskedImage<PixelT> const mimage(exposure->getMaskedImage(), true);
+
+            for (int nIter : nIters) {
+                KronFluxControl ctrl;
+                ctrl.nIterForRadius = nIter;
+                auto determine = [&]() {
+                    sink += KronAperture::determineRadius(mimage, axes, center, ctrl)->getAxes().getA();
+                };
+                results.push_back(timeIt("determineRadius", {{"a", a}, {"q", q}, {"nIterForRadius", nIter}},
+                                         determine, opts));
+            }
+            for (double sigma : smoothingSigmas) {
+                KronFluxControl ctrl;
+                ctrl.smoothingSigma = sigma;
+                auto determine = [&]() {
+                    sink += KronAperture::determineRadius(mimage, axes, center, ctrl)->getAxes().getA();
+                };
+                results.push_back(timeIt("determineRadiusSmoothed", {{"a", a}, {"q", q}, {"sigma", sigma}},
+                                         determine, opts));
+            }
+
+            KronAperture const aperture(center, axes);
+            // The sinc path is used if the semi-minor axis of the flux aperture is <= maxSincRadius
+            double const sincRadius = nRadiusForFlux*q*a + 1;
+            auto measureSinc = [&]() {
+                sink += aperture.measureFlux(mimage, nRadiusForFlux, sincRadius).first;
+            };
+            results.push_back(timeIt("measureFluxSinc", {{"a", a}, {"q", q}}, measureSinc, opts));
+            auto measureSum = [&]() {
+                sink += aperture.measureFlux(mimage, nRadiusForFlux, 0.0).first;
+            };
+            results.push_back(timeIt("measureFluxSum", {{"a", a}, {"q", q}}, measureSum, opts));
+        }
+    }
+    for (std::size_t i = nResult; i < results.size(); ++i) {
+        results[i].pixelType = getPixelTypeName<PixelT>();
+    }
+}
+
+/*
+ * Benchmark the Kron kernels on a single galaxy, for each supported pixel type, and calculatePsfKronRadius
+ */
+void benchmarkKernels(std::vector<Result>& results, Options const& opts) {
+    benchmarkKernels<float>(results, opts);
+    benchmarkKernels<double>(results, opts);
+    benchmarkKernels<int>(results, opts);
+    benchmarkKernels<std::uint16_t>(results, opts);
+
+    int const size = 256;
+    geom::Point2D const center(0.5*size + 0.3, 0.5*size - 0.4);
+    auto exposure = makeExposure(size, size);
+    for (double sigma : {0.0, 2.0}) {
+        auto calculate = [&]() {
+            sink += photometryKron::calculatePsfKronRadius(exposure->getPsf(), center, sigma);
+        };
+        results.push_back(timeIt("calculatePsfKronRadius", {{"sigma", sigma}}, calculate, opts));
+    }
+}
+
+/*
+ * Benchmark determineRadius on each specialisation of the moment functor: round (PSF-like) sources, and
+ * ellipses along the x axis or rotated; centred on a pixel (which needs the central-pixel correction) or
+ * on a pixel corner (which doesn't).
+ *
+ * Measured shapes are never exactly round or aligned, so the "Measured" shapes are slightly perturbed;
+ * with momentShapeTolerance == 0 they all use the general functor, and with the default they only
+ * use the cheaper ones if they're within the tolerance (NearlyRound and NearlyAligned are; Roundish isn't)
+ */
+void benchmarkMomentPolicies(std::vector<Result>& results, Options const& opts) {
+    std::vector<double> const radii = opts.quick ? std::vector<double>{2} : std::vector<double>{2, 5};
+    struct Shape {
+        std::string name;
+        double q;                       // axis ratio
+        double theta;                   // position angle (radians)
+    };
+    std::vector<Shape> const shapes = {{"Round", 1.0, 0.0}, {"Aligned", 0.5, 0.0}, {"Rotated", 0.5, 0.5},
+                                       {"MeasuredNearlyRound", 0.9995, 0.7},
+                                       {"MeasuredNearlyAligned", 0.5, 2e-4},
+                                       {"MeasuredRoundish", 0.98, 0.7}};
+
+    int const size = 256;
+    double const defaultTolerance = KronFluxControl().momentShapeTolerance;
+    for (double tolerance : {0.0, defaultTolerance}) {
+        KronFluxControl ctrl;
+        ctrl.nIterForRadius = 3;
+        ctrl.momentShapeTolerance = tolerance;
+        for (double a : radii) {
+            for (auto const& shape : shapes) {
+                afwGeom::ellipses::Axes const axes(a, shape.q*a, shape.theta);
+                for (double offset : {0.0, 0.5}) {
+                    geom::Point2D const center(0.5*size + offset, 0.5*size + offset);
+                    auto exposure = makeExposure(size, size, {center}, axes);
+                    afwImage::MaskedImage<float> const& mimage = exposure->getMaskedImage();
+                    auto determine = [&]() {
+                        sink += KronAperture::determineRadius(mimage, axes, center, ctrl)->getAxes().getA();
+                    };
+                    results.push_back(timeIt("determineRadius" + shape.name,
+                                             {{"a", a}, {"centred", offset == 0.0},
+                                              {"momentShapeTolerance", tolerance}}, determine, opts));
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Benchmark measure and measureForced on a field of galaxies; the times are per source
+ */
+void benchmarkMeasure(std::vector<Result>& results, Options const& opts) {
+    std::vector<double> const radii = opts.quick ? std::vector<double>{3} : std::vector<double>{2, 3, 5};
+    std::vector<double> const axisRatios = opts.quick ? std::vector<double>{0.5} :
+        std::vector<double>{1.0, 0.5, 0.2};
+    std::vector<int> const nIters = opts.quick ? std::vector<int>{1} : std::vector<int>{1, 3};
+    std::vector<int> const densities = opts.quick ? std::vector<int>{8} : std::vector<int>{4, 8, 16};
+    double const theta = 0.5;           // position angle (radians)
+
+    int const size = 1024;
+    for (int nPerSide : densities) {
+        std::vector<geom::Point2D> centers;
+        double const spacing = static_cast<double>(size)/nPerSide;
+        for (int i = 0; i < nPerSide; ++i) {
+            for (int j = 0; j < nPerSide; ++j) {
+                centers.emplace_back((i + 0.5)*spacing + 0.3, (j + 0.5)*spacing - 0.2);
+            }
+        }
+        int const nSource = centers.size();
+        for (double a : radii) {
+            for (double q : axisRatios) {
+                afwGeom::ellipses::Axes const axes(a, q*a, theta);
+                auto exposure = makeExposure(size, size, centers, axes);
+
+                for (int nIter : nIters) {
+                    std::vector<std::pair<std::string, double>> const params = {
+                        {"a", a}, {"q", q}, {"nIterForRadius", nIter}, {"nSource", nSource}};
+                    KronFluxControl ctrl;
+                    ctrl.nIterForRadius = nIter;
+
+                    TruthCatalog truth;
+                    lsst::daf::base::PropertyList metadata;
+                    KronFluxAlgorithm const algorithm(ctrl, "ext_photometryKron_KronFlux", truth.schema,
+                                                      metadata);
+                    afwTable::SourceCatalog catalog = truth.makeCatalog(centers, axes);
+                    Result result = timeIt("measure", params, [&]() {
+                        measureAll(algorithm, catalog, [&](afwTable::SourceRecord& record, std::size_t) {
+                            algorithm.measure(record, *exposure);
+                        });
+                    }, opts);
+                    result.nsPerCall /= nSource;
+                    result.minNsPerCall /= nSource;
+                    results.push_back(result);
+
+                    // Use the measurements we just made as the reference catalog
+                    TruthCatalog forcedTruth;
+                    KronFluxAlgorithm const forced(ctrl, "ext_photometryKron_KronFlux", forcedTruth.schema,
+                                                   metadata);
+                    afwTable::SourceCatalog forcedCatalog = forcedTruth.makeCatalog(centers, axes);
+                    afwGeom::SkyWcs const& refWcs = *exposure->getWcs();
+                    result = timeIt("measureForced", params, [&]() {
+                        measureAll(forced, forcedCatalog, [&](afwTable::SourceRecord& record, std::size_t i) {
+                            forced.measureForced(record, *exposure, catalog[i], refWcs);
+                        });
+                    }, opts);
+                    result.nsPerCall /= nSource;
+                    result.minNsPerCall /= nSource;
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Benchmark measure on a field whose sources all lie within a few aperture radii of the border, with and
+ * without clipEdgeApertures, to time the rejection of apertures that leave the image; the times are per
+ * source.  The baseline (edgeClassification == 0) rasterises every aperture to find whether it fits, as
+ * was done before apertures were classified analytically; the saving is written to stderr
+ */
+void benchmarkEdge(std::vector<Result>& results, Options const& opts) {
+    std::vector<double> const radii = opts.quick ? std::vector<double>{3} : std::vector<double>{2, 3, 5};
+    std::vector<double> const distances = {2, 5, 10, 20, 40}; // from the border, in pixels
+    double const q = 0.5, theta = 0.5;
+
+    int const size = 1024;
+    int const spacing = 64;             // between sources along each edge
+    std::vector<geom::Point2D> centers;
+    for (double d : distances) {
+        for (int i = spacing/2; i < size; i += spacing) {
+            centers.emplace_back(i + 0.3, d);
+            centers.emplace_back(i - 0.2, size - 1 - d);
+            centers.emplace_back(d, i + 0.4);
+            centers.emplace_back(size - 1 - d, i - 0.1);
+        }
+    }
+    int const nSource = centers.size();
+    for (double a : radii) {
+        afwGeom::ellipses::Axes const axes(a, q*a, theta);
+        auto exposure = makeExposure(size, size, centers, axes);
+        for (bool clip : {false, true}) {
+            KronFluxControl ctrl;
+            ctrl.clipEdgeApertures = clip;
+
+            TruthCatalog truth;
+            lsst::daf::base::PropertyList metadata;
+            KronFluxAlgorithm const algorithm(ctrl, "ext_photometryKron_KronFlux", truth.schema, metadata);
+            afwTable::SourceCatalog catalog = truth.makeCatalog(centers, axes);
+            double nsPerSource[2] = {};  // indexed by edgeClassification
+            for (bool classify : {false, true}) {
+                std::vector<std::pair<std::string, double>> const params = {
+                    {"a", a}, {"clipEdgeApertures", clip}, {"edgeClassification", classify},
+                    {"nSource", nSource}};
+                bool const wasClassifying = photometryKron::setKronEdgeClassification(classify);
+                Result result = timeIt("measureEdge", params, [&]() {
+                    measureAll(algorithm, catalog, [&](afwTable::SourceRecord& record, std::size_t) {
+                        algorithm.measure(record, *exposure);
+                    });
+                }, opts);
+                photometryKron::setKronEdgeClassification(wasClassifying);
+                result.nsPerCall /= nSource;
+                result.minNsPerCall /= nSource;
+                results.push_back(result);
+                nsPerSource[classify] = result.nsPerCall;
+            }
+            std::cerr << "measureEdge a=" << a << " clipEdgeApertures=" << clip << ": " << nsPerSource[0]
+                      << " ns/source rasterising every aperture, " << nsPerSource[1]
+                      << " classifying them (saves " << 100*(1 - nsPerSource[1]/nsPerSource[0]) << "%)"
+                      << std::endl;
+        }
+    }
+}
+
+/*
+ * Benchmark measureN, which measures a blend's sources together, against measuring them one by one with
+ * measure, on a field of blends of nMember overlapping galaxies; the times are per source
+ */
+void benchmarkBlend(std::vector<Result>& results, Options const& opts) {
+    std::vector<int> const nMembers = opts.quick ? std::vector<int>{4} : std::vector<int>{2, 4, 8};
+    double const a = 3, q = 0.5, theta = 0.5;
+    double const separation = 1.5*a;    // distance of each member from the blend's centre
+
+    int const size = 1024;
+    int const nPerSide = 8;             // blends along each side of the field
+    double const spacing = static_cast<double>(size)/nPerSide;
+    afwGeom::ellipses::Axes const axes(a, q*a, theta);
+    for (int nMember : nMembers) {
+        std::vector<std::vector<geom::Point2D>> blends;
+        std::vector<geom::Point2D> centers;
+        for (int i = 0; i < nPerSide; ++i) {
+            for (int j = 0; j < nPerSide; ++j) {
+                blends.emplace_back();
+                for (int k = 0; k < nMember; ++k) {
+                    double const phi = 2*geom::PI*k/nMember;
+                    blends.back().emplace_back((i + 0.5)*spacing + separation*std::cos(phi) + 0.3,
+                                               (j + 0.5)*spacing + separation*std::sin(phi) - 0.2);
+                }
+                centers.insert(centers.end(), blends.back().begin(), blends.back().end());
+            }
+        }
+        int const nSource = centers.size();
+        auto exposure = makeExposure(size, size, centers, axes);
+
+        KronFluxControl ctrl;
+        TruthCatalog truth;
+        lsst::daf::base::PropertyList metadata;
+        KronFluxAlgorithm const algorithm(ctrl, "ext_photometryKron_KronFlux", truth.schema, metadata);
+        std::vector<afwTable::SourceCatalog> families;
+        for (auto const& blend : blends) {
+            families.push_back(truth.makeCatalog(blend, axes));
+        }
+        std::vector<std::pair<std::string, double>> const params = {
+            {"a", a}, {"q", q}, {"nMember", nMember}, {"nSource", nSource}};
+
+        Result result = timeIt("measureBlend", params, [&]() {
+            for (auto & family : families) {
+                measureAll(algorithm, family, [&](afwTable::SourceRecord& record, std::size_t) {
+                    algorithm.measure(record, *exposure);
+                });
+            }
+        }, opts);
+        result.nsPerCall /= nSource;
+        result.minNsPerCall /= nSource;
+        results.push_back(result);
+
+        result = timeIt("measureNBlend", params, [&]() {
+            for (auto const& family : families) {
+                algorithm.measureN(family, *exposure);
+            }
+        }, opts);
+        result.nsPerCall /= nSource;
+        result.minNsPerCall /= nSource;
+        results.push_back(result);
+    }
+}
+
+/*
+ * Benchmark drawing crowded fields of random galaxies, convolved with the PSF
+ */
+void benchmarkSynthetic(std::vector<Result>& results, Options const& opts) {
+    std::vector<int> const nGalaxies = opts.quick ? std::vector<int>{10000} :
+        std::vector<int>{1000, 10000, 100000};
+    int const size = 4096;
+    geom::Box2I const bbox(geom::Point2I(0, 0), geom::Extent2I(size, size));
+    auto psf = std::make_shared<afwDetection::GaussianPsf>(21, 21, 2.0);
+    for (int nGalaxy : nGalaxies) {
+        auto const galaxies = photometryKron::makeRandomGalaxies(bbox, nGalaxy);
+        // Gaussians alone are convolved analytically; Sersic profiles need an image convolution
+        std::vector<photometryKron::SyntheticGalaxy> gaussians;
+        std::copy_if(galaxies.begin(), galaxies.end(), std::back_inserter(gaussians),
+                     [](photometryKron::SyntheticGalaxy const& galaxy) { return galaxy.sersicIndex == 0; });
+        auto makeGaussianField = [&]() {
+            sink += photometryKron::makeSyntheticExposure(bbox, gaussians, psf, 1.0)->getWidth();
+        };
+        double const nGaussian = gaussians.size();
+        results.push_back(timeIt("makeSyntheticExposureGaussian", {{"nGalaxy", nGaussian}}, makeGaussianField,
+                                 opts));
+        auto makeField = [&]() {
+            sink += photometryKron::makeSyntheticExposure(bbox, galaxies, psf, 1.0)->getWidth();
+        };
+        results.push_back(timeIt("makeSyntheticExposure", {{"nGalaxy", nGalaxy}}, makeField, opts));
+    }
+}
+
+/*
+ * One run of measureBatch over a whole field, for the scaling benchmark
+ */
+struct ScalingResult {
+    std::string mode;                   // "strong" or "weak"
+    int nThread;
+    int size;                           // width and height of the image
+    int nSource;
+    double seconds;                     // median time to measure every source
+    double sourcesPerSecond;
+    double efficiency;                  // sourcesPerSecond/(nThread*single-threaded sourcesPerSecond)
+    double peakRssMB;                   // peak resident set size of the process, up to the end of the run
+    double allocsPerSource;             // calls to operator new per source
+};
+
+double getPeakRssMB() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return std::nan("");
+    }
+    return usage.ru_maxrss/1024.0;      // ru_maxrss is in kB on Linux
+}
+
+/*
+ * A field of random galaxies, and their true positions and (unconvolved) shapes
+ */
+struct Field {
+    Field(int size_, int nSource) : size(size_) {
+        geom::Box2I const bbox(geom::Point2I(0, 0), geom::Extent2I(size, size));
+        auto const galaxies = photometryKron::makeRandomGalaxies(bbox, nSource);
+        exposure = photometryKron::makeSyntheticExposure(
+            bbox, galaxies, std::make_shared<afwDetection::GaussianPsf>(21, 21, 2.0), 1.0);
+        ndarray::Array<double, 1, 1> xx = ndarray::allocate(nSource), yy = ndarray::allocate(nSource);
+        ndarray::Array<double, 1, 1> aa = ndarray::allocate(nSource), bb = ndarray::allocate(nSource);
+        ndarray::Array<double, 1, 1> tt = ndarray::allocate(nSource);
+        for (int i = 0; i < nSource; ++i) {
+            xx[i] = galaxies[i].x;
+            yy[i] = galaxies[i].y;
+            aa[i] = galaxies[i].a;
+            bb[i] = galaxies[i].b;
+            tt[i] = galaxies[i].theta;
+        }
+        x = xx; y = yy; a = aa; b = bb; theta = tt;
+    }
+
+    int getNSource() const { return x.getSize<0>(); }
+
+    int size;
+    std::shared_ptr<afwImage::Exposure<float>> exposure;
+    ndarray::Array<double const, 1> x, y, a, b, theta;
+};
+
+/*
+ * Measure every source in field on nThread threads, reporting the median over runs
+ */
+ScalingResult timeField(std::string const& mode, Field const& field, int nThread, Options const& opts) {
+    typedef std::chrono::steady_clock Clock;
+    KronFluxControl const ctrl;
+    afwImage::MaskedImage<float> const& mimage = field.exposure->getMaskedImage();
+    int const nSource = field.getNSource();
+    int const nRun = opts.quick ? 1 : opts.nRepeat;
+    std::vector<double> seconds;
+    long nAlloc = 0;
+    for (int i = 0; i < nRun; ++i) {
+        long const before = nAllocation.load();
+        auto const start = Clock::now();
+        auto const results = KronAperture::measureBatch(mimage, field.x, field.y, field.a, field.b,
+                                                        field.theta, ctrl, nThread);
+        seconds.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+        nAlloc = nAllocation.load() - before;
+        for (auto const& result : results) {
+            sink += result.radius;
+        }
+    }
+    std::sort(seconds.begin(), seconds.end());
+    double const median = seconds[seconds.size()/2];
+    return {mode, nThread, field.size, nSource, median, nSource/median, std::nan(""), getPeakRssMB(),
+            static_cast<double>(nAlloc)/std::max(1, nSource)};
+}
+
+/*
+ * Benchmark measureBatch's scaling with the number of threads, and its memory use
+ *
+ * The fields are made in order of increasing size, as the peak RSS can only grow.
+ */
+void benchmarkScaling(std::vector<ScalingResult>& results, Options const& opts) {
+    int const maxThreads = (opts.maxThreads > 0) ? opts.maxThreads :
+        std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> nThreads;
+    for (int n = 1; n < maxThreads; n *= 2) {
+        nThreads.push_back(n);
+    }
+    nThreads.push_back(maxThreads);
+
+    double const pixelsPerSource = 1600;  // one source per 40x40 pixels
+    auto nSourceFor = [pixelsPerSource](int size) {
+        return static_cast<int>(std::lround(size*static_cast<double>(size)/pixelsPerSource));
+    };
+    auto setEfficiency = [](ScalingResult& result, ScalingResult const& serial) {
+        result.efficiency = result.sourcesPerSecond/(result.nThread*serial.sourcesPerSecond);
+    };
+    // Strong scaling: the same field on more threads
+    std::vector<int> const sizes = opts.quick ? std::vector<int>{1024, 2048} :
+        std::vector<int>{1024, 2048, 4096};
+    for (int size : sizes) {
+        Field const field(size, nSourceFor(size));
+        std::size_t const serial = results.size();
+        for (int nThread : nThreads) {
+            results.push_back(timeField("strong", field, nThread, opts));
+            setEfficiency(results.back(), results[serial]);
+        }
+    }
+    // Weak scaling: the area of the field, and thus the number of sources, grows with the threads
+    int const baseSize = opts.quick ? 512 : 1024;
+    std::size_t const serial = results.size();
+    for (int nThread : nThreads) {
+        int const size = std::lround(baseSize*std::sqrt(nThread));
+        Field const field(size, nSourceFor(size));
+        results.push_back(timeField("weak", field, nThread, opts));
+        setEfficiency(results.back(), results[serial]);
+    }
+}
+
+/*
+ * Write the scaling results as JSON
+ */
+void writeScalingJson(std::ostream& os, std::vector<ScalingResult> const& results, Options const& opts) {
+    auto number = [](double value) {
+        std::ostringstream str;
+        str.precision(10);
+        if (std::isfinite(value)) {
+            str << value;
+        } else {
+            str << "null";
+        }
+        return str.str();
+    };
+
+    os << "{\n";
+    os << "  \"package\": \"meas_extensions_photometryKron\",\n";
+    os << "  \"quick\": " << (opts.quick ? "true" : "false") << ",\n";
+    os << "  \"kernelVariant\": \"" << photometryKron::getKronKernelVariant() << "\",\n";
+    os << "  \"nRepeat\": " << (opts.quick ? 1 : opts.nRepeat) << ",\n";
+    os << "  \"hardwareConcurrency\": " << std::thread::hardware_concurrency() << ",\n";
+    os << "  \"scaling\": [";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        ScalingResult const& result = results[i];
+        os << (i == 0 ? "\n" : ",\n") << "    {\"mode\": \"" << result.mode << "\""
+           << ", \"nThread\": " << result.nThread << ", \"size\": " << result.size
+           << ", \"nSource\": " << result.nSource << ", \"seconds\": " << number(result.seconds)
+           << ", \"sourcesPerSecond\": " << number(result.sourcesPerSecond)
+           << ", \"efficiency\": " << number(result.efficiency)
+           << ", \"peakRssMB\": " << number(result.peakRssMB)
+           << ", \"allocsPerSource\": " << number(result.allocsPerSource) << "}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+/*
+ * Write the scaling results as a table
+ */
+void writeScalingTable(std::ostream& os, std::vector<ScalingResult> const& results) {
+    char line[128];
+    std::snprintf(line, sizeof(line), "%-6s %7s %6s %8s %10s %12s %10s %11s %13s\n", "mode", "threads",
+                  "size", "sources", "time (s)", "sources/s", "efficiency", "peak RSS/MB", "allocs/source");
+    os << line;
+    for (auto const& result : results) {
+        std::snprintf(line, sizeof(line), "%-6s %7d %6d %8d %10.4f %12.0f %10.3f %11.1f %13.2f\n",
+                      result.mode.c_str(), result.nThread, result.size, result.nSource, result.seconds,
+                      result.sourcesPerSecond, result.efficiency, result.peakRssMB, result.allocsPerSource);
+        os << line;
+    }
+}
+
+void usage(char const* argv0) {
+    std::cerr << "Usage: " << argv0 << " [--quick] [--minTime SECONDS] [--repeat N] [OUTPUT.json]\n"
+              << "       " << argv0 << " --scaling [--quick] [--maxThreads N] [--repeat N] [OUTPUT.json]"
+              << std::endl;
+    std::exit(1);
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        if (arg == "--quick") {
+            opts.quick = true;
+        } else if (arg == "--minTime" && i + 1 < argc) {
+            opts.minTime = std::atof(argv[++i]);
+        } else if (arg == "--repeat" && i + 1 < argc) {
+            opts.nRepeat = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--scaling") {
+            opts.scaling = true;
+        } else if (arg == "--maxThreads" && i + 1 < argc) {
+            opts.maxThreads = std::atoi(argv[++i]);
+        } else if (arg[0] == '-' || !opts.output.empty()) {
+            usage(argv[0]);
+        } else {
+            opts.output = arg;
+        }
+    }
+
+    if (opts.scaling) {
+        std::vector<ScalingResult> results;
+        benchmarkScaling(results, opts);
+        if (opts.output.empty()) {
+            writeScalingJson(std::cout, results, opts);
+        } else {
+            std::ofstream os(opts.output);
+            writeScalingJson(os, results, opts);
+        }
+        writeScalingTable(std::cerr, results);
+        std::cerr << "(checksum " << sink << ")" << std::endl;
+        return 0;
+    }
+
+    std::vector<Result> results;
+    benchmarkKernels(results, opts);
+    benchmarkMomentPolicies(results, opts);
+    benchmarkMeasure(results, opts);
+    benchmarkEdge(results, opts);
+    benchmarkBlend(results, opts);
+    benchmarkSynthetic(results, opts);
+
+    if (opts.output.empty()) {
+        writeJson(std::cout, results, opts);
+    } else {
+        std::ofstream os(opts.output);
+        writeJson(os, results, opts);
+    }
+    std::cerr << "(checksum " << sink << ")" << std::endl;
+    return 0;
+}
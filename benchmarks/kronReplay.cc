@@ -0,0 +1,97 @@
+// -*- LSST-C++ -*-
+/*
+ * LSST Data Management System
+ * Copyright 2008-2015 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+/*
+ * Replay the measurements of slow sources captured by KronFluxAlgorithm (see KronFluxControl.slowSourceTime)
+ *
+ * Usage:
+ *     kronReplay [--repeat N] FILE.kron...
+ *
+ * Each source is measured N times (default 1), so that it can be run under a profiler, e.g.
+ *     perf record -g kronReplay --repeat 1000 ext_photometryKron_KronFlux_1234.kron
+ * and its captured and replayed times, Kron radius, flux and failure flag are printed.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "lsst/pex/exceptions.h"
+#include "lsst/afw/table/Source.h"
+#include "lsst/meas/extensions/photometryKron.h"
+
+namespace photometryKron = lsst::meas::extensions::photometryKron;
+
+namespace {
+
+void usage(char const* argv0) {
+    std::cerr << "Usage: " << argv0 << " [--repeat N] FILE.kron..." << std::endl;
+    std::exit(1);
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv) {
+    int nRepeat = 1;
+    std::vector<std::string> filenames;
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        if (arg == "--repeat" && i + 1 < argc) {
+            nRepeat = std::max(1, std::atoi(argv[++i]));
+        } else if (arg[0] == '-') {
+            usage(argv[0]);
+        } else {
+            filenames.push_back(arg);
+        }
+    }
+    if (filenames.empty()) {
+        usage(argv[0]);
+    }
+
+    int status = 0;
+    for (auto const& filename : filenames) {
+        try {
+            auto const repro = photometryKron::KronReproduction::readFile(filename);
+            auto const start = std::chrono::steady_clock::now();
+            auto const source = repro.replay(nRepeat);
+            std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+
+            std::string const& name = repro.getName();
+            lsst::afw::table::Schema const schema = source->getSchema();
+            std::cout << filename << ": id " << repro.getId()
+                      << " bbox " << repro.getBBox()
+                      << " captured " << 1e-3*repro.getTime() << " us"
+                      << " replayed " << 1e6*elapsed.count()/nRepeat << " us"
+                      << " radius " << source->get(schema.find<float>(name + "_radius").key)
+                      << " instFlux " << source->get(schema.find<double>(name + "_instFlux").key)
+                      << " flag " << source->get(schema.find<lsst::afw::table::Flag>(name + "_flag").key)
+                      << std::endl;
+        } catch (lsst::pex::exceptions::Exception const& e) {
+            std::cerr << filename << ": " << e.what() << std::endl;
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -25,10 +25,17 @@
 
 #include <memory>
 #include <cmath>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "lsst/pex/config.h"
 #include "lsst/geom.h"
 #include "lsst/afw/image/Exposure.h"
+#include "lsst/afw/detection/Psf.h"
 #include "lsst/afw/geom/SkyWcs.h"
 #include "lsst/meas/base/Algorithm.h"
 #include "lsst/meas/base/FluxUtilities.h"
@@ -39,6 +46,189 @@
 namespace lsst { namespace meas { namespace extensions { namespace photometryKron {
 
 class KronAperture;
+class KronApertureTable;
+class KronStats;
+
+/**
+ *  @brief The outcome of the exception-free core of the Kron measurement
+ *
+ *  The core routines (KronAperture::tryDetermineRadius etc.) report failures using these codes;
+ *  exceptions are only raised at the public API (e.g. KronAperture::determineRadius).
+ */
+enum class KronStatus {
+    OK = 0,                             ///< Success
+    EDGE,                               ///< The aperture doesn't fit in the image
+    BAD_INTEGRAL,                       ///< The integral defining the Kron radius is unreliable
+    RADIUS_TOO_LARGE,                   ///< The Kron radius exceeds KronFluxControl.maxRadius
+    FAILURE                             ///< The underlying libraries reported an error
+};
+
+/**
+ *  @brief The Kron measurement of one source in a batch (see KronAperture::measureBatch)
+ */
+struct KronBatchResult {
+    float radius;                       ///< The Kron radius (NaN on failure)
+    float radiusForRadius;              ///< The radius of the aperture used to estimate the Kron radius
+    int nIterForRadius;                 ///< The number of iterations used to estimate the Kron radius
+    double instFlux;                    ///< The flux within the Kron aperture (NaN on failure)
+    double instFluxErr;                 ///< The error in instFlux
+    int status;                         ///< A KronStatus; OK if both radius and flux were measured
+    int nBadPixels;                     ///< The number of masked pixels in the flux aperture
+};
+
+/**
+ *  @brief A read-only view of a 2-d array of pixels, which need not belong to an afw image
+ *
+ *  The pixel at (x, y) in the PARENT frame of bbox is at data + (y - y0)*rowStride + (x - x0)*colStride,
+ *  where the strides are measured in pixels.  The view doesn't own its pixels.
+ */
+template <typename PixelT>
+class KronPixelView {
+public:
+    typedef PixelT Pixel;
+
+    KronPixelView(PixelT const* data, geom::Box2I const& bbox, std::ptrdiff_t rowStride,
+                  std::ptrdiff_t colStride=1) :
+        _data(data), _bbox(bbox), _rowStride(rowStride), _colStride(colStride)
+        {}
+
+    /// View the pixels of an afw image or mask, which must outlive the view
+    explicit KronPixelView(afw::image::ImageBase<PixelT> const& image) :
+        _data(image.getArray().getData()), _bbox(image.getBBox()),
+        _rowStride(image.getArray().getStrides()[0]), _colStride(1)
+        {}
+
+    PixelT const* getData() const { return _data; }
+    geom::Box2I const& getBBox() const { return _bbox; }
+    std::ptrdiff_t getRowStride() const { return _rowStride; }
+    std::ptrdiff_t getColStride() const { return _colStride; }
+
+    /// Return a pointer to pixel (x, y); successive pixels in the row are getColStride() apart
+    PixelT const* getPixel(int x, int y) const {
+        return _data + (y - _bbox.getMinY())*_rowStride + (x - _bbox.getMinX())*_colStride;
+    }
+
+    PixelT const& operator()(int x, int y) const { return *getPixel(x, y); }
+
+private:
+    PixelT const* _data;
+    geom::Box2I _bbox;
+    std::ptrdiff_t _rowStride;
+    std::ptrdiff_t _colStride;
+};
+
+/**
+ *  @brief A read-only view of the image, variance and mask planes of a masked image
+ *
+ *  The planes must have the same bounding box.  The variance may be omitted if only the
+ *  Kron radius and flux (but not its error) are wanted, and the mask if no pixels are to be rejected.
+ *
+ *  The view may cover only part of a larger image, its domain; apertures are only required to lie within
+ *  the domain, and the pixels that are in the domain but not the view are taken to be zero.
+ */
+template <typename PixelT>
+class KronMaskedPixelView {
+public:
+    typedef PixelT Pixel;
+    typedef afw::image::VariancePixel VariancePixel;
+    typedef afw::image::MaskPixel MaskPixel;
+
+    KronMaskedPixelView(KronPixelView<PixelT> const& image, KronPixelView<VariancePixel> const& variance) :
+        _image(image), _variance(variance), _mask(nullptr, image.getBBox(), 0, 0), _domain(image.getBBox())
+        {}
+
+    KronMaskedPixelView(KronPixelView<PixelT> const& image, KronPixelView<VariancePixel> const& variance,
+                        KronPixelView<MaskPixel> const& mask) :
+        _image(image), _variance(variance), _mask(mask), _domain(image.getBBox())
+        {}
+
+    /// View an image without a variance or mask plane
+    explicit KronMaskedPixelView(KronPixelView<PixelT> const& image) :
+        _image(image), _variance(nullptr, image.getBBox(), 0, 0), _mask(nullptr, image.getBBox(), 0, 0),
+        _domain(image.getBBox())
+        {}
+
+    /// View the pixels of an afw masked image, which must outlive the view
+    ///
+    /// If domain isn't empty the masked image is taken to be the non-zero part of an image with
+    /// that bounding box
+    explicit KronMaskedPixelView(afw::image::MaskedImage<PixelT> const& mimage,
+                                 geom::Box2I const& domain=geom::Box2I()) :
+        _image(*mimage.getImage()), _variance(*mimage.getVariance()), _mask(*mimage.getMask()),
+        _domain(domain.isEmpty() ? mimage.getBBox() : domain)
+        {}
+
+    KronPixelView<PixelT> const& getImage() const { return _image; }
+    KronPixelView<VariancePixel> const& getVariance() const { return _variance; }
+    KronPixelView<MaskPixel> const& getMask() const { return _mask; }
+    bool hasVariance() const { return _variance.getData() != nullptr; }
+    bool hasMask() const { return _mask.getData() != nullptr; }
+    geom::Box2I const& getBBox() const { return _image.getBBox(); }
+    /// The bounding box of the image that the view is part of
+    geom::Box2I const& getDomain() const { return _domain; }
+
+private:
+    KronPixelView<PixelT> _image;
+    KronPixelView<VariancePixel> _variance;
+    KronPixelView<MaskPixel> _mask;
+    geom::Box2I _domain;
+};
+
+/**
+ *  @brief Lazily-built binned copies of an image, shared between the sources measured on it
+ *
+ *  Binned pixel (i, j) of the level with binning factor f holds the mean of the full-resolution pixels
+ *  [x0 + f*i, x0 + f*i + f - 1] x [y0 + f*j, y0 + f*j + f - 1]; partial blocks at the upper edges are
+ *  averaged over the pixels that exist.  The binned images have xy0 == (0, 0).
+ *
+ *  The pyramid is rebuilt whenever it's asked for a level of a different image.  When the pixels of
+ *  the same image change (e.g. as the NoiseReplacer inserts and removes sources) callers must use
+ *  markDirty to say where; the region marked by the previous call is rebinned as well, as that's where
+ *  the previous source was removed again.
+ */
+class KronImagePyramid {
+public:
+    typedef afw::image::Image<float> Level;
+
+    KronImagePyramid() = default;
+    KronImagePyramid(KronImagePyramid const&) = delete;
+    KronImagePyramid& operator=(KronImagePyramid const&) = delete;
+
+    /// Return image binned by binFactor, building or updating it as needed
+    template<typename PixelT>
+    std::shared_ptr<Level const> getLevel(
+        std::shared_ptr<afw::image::Image<PixelT> const> const& image, ///< Full-resolution image
+        int binFactor                                                   ///< Binning factor
+        );
+
+    /// Return image binned by binFactor, building or updating it as needed
+    ///
+    /// Views are identified by their data pointer and bounding box, so call reset() if a different
+    /// image may be placed at the same address
+    template<typename PixelT>
+    std::shared_ptr<Level const> getLevel(
+        KronPixelView<PixelT> const& image,     ///< Full-resolution image
+        int binFactor                           ///< Binning factor
+        );
+
+    /// Note that the pixels within bbox (in the full-resolution image's PARENT frame) have changed
+    void markDirty(geom::Box2I const& bbox);
+
+    /// Discard all levels
+    void reset();
+
+private:
+    template<typename PixelT>
+    std::shared_ptr<Level const> _getLevel(KronPixelView<PixelT> const& image, int binFactor);
+
+    std::mutex _mutex;
+    std::weak_ptr<void const> _source;  // the full-resolution afw image our levels were built from
+    void const* _sourceData = nullptr;  // the pixels our levels were built from
+    geom::Box2I _sourceBBox;            // the bounding box of _sourceData
+    std::map<int, std::shared_ptr<Level>> _levels; // binned images, indexed by binning factor
+    geom::Box2I _pending;               // region which must be rebinned before the next use
+    geom::Box2I _previous;              // region passed to the previous call to markDirty
+};
 
 /**
  *  @brief C++ control object for Kron flux.
@@ -53,6 +243,13 @@ public:
     LSST_CONTROL_FIELD(nSigmaForRadius, double,
                        "Multiplier of rms size for aperture used to initially estimate the Kron radius");
     LSST_CONTROL_FIELD(nIterForRadius, int, "Number of times to iterate when setting the Kron radius");
+    LSST_CONTROL_FIELD(radiusTolerance, double,
+                       "If > 0, iterate (at most nIterForRadius times) until the fractional change in the "
+                       "Kron radius is below this tolerance, using secant-accelerated updates");
+    LSST_CONTROL_FIELD(momentShapeTolerance, double,
+                       "Largest fractional error in any pixel's elliptical radius accepted in order to "
+                       "estimate the Kron radius using the cheaper circular or axis-aligned radius; "
+                       "if 0, only exactly round or aligned apertures use them");
     LSST_CONTROL_FIELD(nRadiusForFlux, double, "Number of Kron radii for Kron flux");
     LSST_CONTROL_FIELD(maxSincRadius, double,
                        "Largest aperture for which to use the slow, accurate, sinc aperture code");
@@ -68,11 +265,58 @@ public:
                        "Name of field specifying reference Kron radius for forced measurement");
     LSST_CONTROL_FIELD(maxRadius, double,
                        "Maximum aperture radius in pixels; used to avoid excess memory consumption for faint objects");
+    LSST_CONTROL_FIELD(binFactorForRadius, int,
+                       "If > 1 (and nIterForRadius > 1), carry out all but the last iteration for R_K on "
+                       "an image binned by this factor");
+    LSST_CONTROL_FIELD(warmStartRadiusName, std::string,
+                       "Name of field holding a previous estimate of the Kron radius (and, with the suffix "
+                       "_for_radius, the radius used to estimate it) used to seed a single confirming "
+                       "iteration; ignored if empty and setWarmStartCatalog hasn't been called");
+    LSST_CONTROL_FIELD(warmStartTolerance, double,
+                       "Maximum fractional change in the seeded Kron radius before falling back to the "
+                       "full iteration");
+    LSST_CONTROL_FIELD(clipEdgeApertures, bool,
+                       "If true, measure the flux in the part of a Kron aperture that lies on the image "
+                       "(setting the edge flag) rather than failing");
+    LSST_CONTROL_FIELD(doMeasureFlux, bool,
+                       "Measure the Kron flux? If false only the Kron radius is measured, and the flux "
+                       "and its error are NaN");
+    LSST_CONTROL_FIELD(doMeasureFluxErr, bool,
+                       "Measure the error in the Kron flux? If false the variance plane isn't read, "
+                       "and the error is NaN");
+    LSST_CONTROL_FIELD(badMaskPlanes, std::vector<std::string>,
+                       "Mask planes that indicate pixels that should be excluded from the Kron radius "
+                       "and flux; planes that aren't defined are ignored");
+    LSST_CONTROL_FIELD(replaceBadPixels, bool,
+                       "If true, replace the pixels in badMaskPlanes by the mean of the good pixels at "
+                       "the same elliptical radius, rather than ignoring them");
+    LSST_CONTROL_FIELD(useHeavyFootprint, bool,
+                       "If true, measure sources with HeavyFootprints (e.g. deblended children) using "
+                       "the pixels in the HeavyFootprint, taking the image to be zero outside it, and "
+                       "never reading the exposure's pixels; the NoiseReplacer is then unnecessary");
+    LSST_CONTROL_FIELD(bandNames, std::vector<std::string>,
+                       "Names of the bands measured together by measureForcedBands; the fields "
+                       "<name>_<band>_instFlux and <name>_<band>_instFluxErr are added for each");
+    LSST_CONTROL_FIELD(doCollectStats, bool,
+                       "Count the calls, iterations, pixels, flux paths, exceptions and flags of the "
+                       "measurement, and time its stages; see KronFluxAlgorithm::writeStats");
+    LSST_CONTROL_FIELD(doRecordCost, bool,
+                       "Add the fields <name>_time_ns, the time taken to measure each source, and "
+                       "<name>_npix_radius and <name>_npix_flux, the approximate numbers of pixels read "
+                       "to estimate its Kron radius and measure its flux (the sources that measureN "
+                       "measures jointly have no time)");
+    LSST_CONTROL_FIELD(slowSourceTime, double,
+                       "If > 0, write a KronReproduction of each source that measure takes longer than "
+                       "this many seconds to measure into slowSourceDir, as <name>_<id>.kron");
+    LSST_CONTROL_FIELD(slowSourceDir, std::string,
+                       "Directory in which to write the reproductions of slow sources (see slowSourceTime)");
 
     KronFluxControl() :
         fixed(false),
         nSigmaForRadius(6.0),
         nIterForRadius(1),
+        radiusTolerance(0.0),
+        momentShapeTolerance(1e-3),
         nRadiusForFlux(2.5),
         maxSincRadius(10.0),
         minimumRadius(0.0),
@@ -80,8 +324,25 @@ public:
         useFootprintRadius(false),
         smoothingSigma(-1.0),
         refRadiusName("ext_photometryKron_KronFlux_radius"),
-        maxRadius(200.0)
+        maxRadius(200.0),
+        binFactorForRadius(1),
+        warmStartRadiusName(""),
+        warmStartTolerance(0.05),
+        clipEdgeApertures(false),
+        doMeasureFlux(true),
+        doMeasureFluxErr(true),
+        badMaskPlanes(),
+        replaceBadPixels(false),
+        useHeavyFootprint(false),
+        bandNames(),
+        doCollectStats(false),
+        doRecordCost(false),
+        slowSourceTime(0.0),
+        slowSourceDir(".")
     {}
+
+    /// Return the bitmask corresponding to badMaskPlanes
+    afw::image::MaskPixel getBadPixelMask() const;
 };
 
 /**
@@ -119,6 +380,19 @@ public:
         afw::image::Exposure<float> const & exposure
     ) const;
 
+    /**
+     *  Measure all the sources in measCat (e.g. the children of a blend) together
+     *
+     *  The Kron radii and fluxes of all the sources are estimated in joint passes over the union of
+     *  their apertures, so each pixel is read once however many sources' apertures contain it.
+     *  Configurations that the joint passes don't support (see KronAperture::tryDetermineRadii)
+     *  measure the sources one by one.
+     */
+    virtual void measureN(
+        afw::table::SourceCatalog const & measCat,
+        afw::image::Exposure<float> const & exposure
+    ) const;
+
     virtual void measureForced(
         afw::table::SourceRecord & measRecord,
         afw::image::Exposure<float> const & exposure,
@@ -126,19 +400,114 @@ public:
         afw::geom::SkyWcs const & refWcs
     ) const;
 
+    /**
+     *  Measure a source's fluxes in several bands, in a single aperture determined from refRecord
+     *
+     *  The exposures, one per KronFluxControl.bandNames, must be pixel-aligned (they share the first
+     *  exposure's bounding box and WCS).  The aperture is constructed and rasterised once, and the
+     *  exposures are read together in a single pass; the fluxes are written to the per-band fields.
+     */
+    void measureForcedBands(
+        afw::table::SourceRecord & measRecord,
+        std::vector<std::shared_ptr<afw::image::Exposure<float> const>> const & exposures,
+        afw::table::SourceRecord const & refRecord,
+        afw::geom::SkyWcs const & refWcs
+    ) const;
+
     virtual void fail(
         afw::table::SourceRecord & measRecord,
         meas::base::MeasurementError * error=NULL
     ) const;
 
+    /**
+     *  Use precomputed reference apertures for forced measurement, matched by the reference's id
+     *
+     *  Forced measurement then only transforms the tabulated aperture to the exposure's frame.
+     *  References missing from the table are measured as usual; pass null to stop using the table.
+     */
+    void setForcedApertureTable(std::shared_ptr<KronApertureTable const> const& table) {
+        _apertureTable = table;
+    }
+
+    /**
+     *  Seed the Kron radius iteration from a previous run's measurements, matched by id.
+     *
+     *  The radii are read from the field KronFluxControl.warmStartRadiusName (if empty,
+     *  from this algorithm's own _radius field) and the corresponding _for_radius field.
+     */
+    void setWarmStartCatalog(afw::table::SourceCatalog const& prior);
+
+    /**
+     *  Estimate Kron radii from an image that's already been smoothed (e.g. by SourceDetectionTask)
+     *
+     *  The image must have the same bounding box as the exposures measured, and has been smoothed by
+     *  a Gaussian of width sigma; KronFluxControl.smoothingSigma is ignored, and the PSF's Kron radius
+     *  is corrected for sigma.  The fluxes are still measured on the exposure.  The image isn't used
+     *  for sources measured from their HeavyFootprints (see KronFluxControl.useHeavyFootprint).
+     *  Pass a null image to go back to using the exposure.
+     */
+    void setSmoothedImage(std::shared_ptr<afw::image::Image<float> const> const& image, double sigma);
+
+    /**
+     *  Set the totals of the statistics collected by all threads (see KronFluxControl.doCollectStats)
+     *  in the metadata passed to the constructor
+     *
+     *  The keys are <NAME>_STATS_<STATISTIC>, e.g. EXT_PHOTOMETRYKRON_KRONFLUX_STATS_SINC_FLUX, with
+     *  one <NAME>_STATS_<FLAG> per flag; times (*_TIME) are in seconds.  The totals are cumulative, so
+     *  may be written as often as wanted, but not while another thread is measuring.  Does nothing
+     *  unless doCollectStats is set.
+     *
+     *  The statistics are only written when this is called (KronFluxPlugin and KronFluxForcedPlugin call
+     *  it as they measure, at most once a second, and provide their own writeStats for the final totals),
+     *  and the metadata must still exist when it is.
+     */
+    void writeStats() const;
+
 private:
 
-    void _applyAperture(
+    typedef std::unordered_map<afw::table::RecordId, std::pair<float, float>> WarmStartMap;
+
+    // A flux that's already been measured (by measureN)
+    struct FluxMeasurement {
+        KronStatus status;
+        std::pair<double, double> result;
+        int nBadPixels;
+    };
+
+    afw::geom::ellipses::Axes _getInitialAxes(
+        afw::table::SourceRecord & source,
+        afw::image::Exposure<float> const& exposure,
+        bool & bad
+        ) const;
+
+    void _enforceMinimumRadius(
         afw::table::SourceRecord & source,
         afw::image::Exposure<float> const& exposure,
-        KronAperture const& aperture
+        KronAperture & aperture,
+        double const R_K_psf
+        ) const;
+
+    void _applyAperture(
+        afw::table::SourceRecord & source,
+        KronMaskedPixelView<float> const& image,
+        KronAperture const& aperture,
+        FluxMeasurement const* flux=nullptr
+        ) const;
+
+    void _setResults(
+        afw::table::SourceRecord & source,
+        KronMaskedPixelView<float> const& image,
+        KronAperture const& aperture,
+        double const R_K_psf,
+        bool const bad,
+        FluxMeasurement const* flux=nullptr
         ) const;
 
+    KronAperture _getForcedAperture(
+        afw::table::SourceRecord const & reference,
+        geom::AffineTransform const & refToMeas
+    ) const;
+
     void _applyForced(
         afw::table::SourceRecord & source,
         afw::image::Exposure<float> const & exposure,
@@ -147,8 +516,17 @@ private:
         geom::AffineTransform const & refToMeas
     ) const;
 
-    std::shared_ptr<KronAperture> _fallbackRadius(afw::table::SourceRecord& source, double const R_K_psf,
-                                      pex::exceptions::Exception& exc) const;
+    std::shared_ptr<KronAperture> _warmStart(
+        afw::table::SourceRecord const& source,
+        KronMaskedPixelView<float> const& image,
+        Control const& ctrl,
+        afw::geom::ellipses::Axes const& axes,
+        geom::Point2D const& center
+    ) const;
+
+    KronMaskedPixelView<float> _getSmoothedView(afw::image::MaskedImage<float> const& mimage) const;
+
+    std::shared_ptr<KronAperture> _fallbackRadius(afw::table::SourceRecord& source, double const R_K_psf) const;
 
     std::string _name;
     Control _ctrl;
@@ -156,36 +534,70 @@ private:
     afw::table::Key<float> _radiusKey;
     afw::table::Key<float> _radiusForRadiusKey;
     afw::table::Key<float> _psfRadiusKey;
+    afw::table::Key<int> _nIterForRadiusKey;
+    afw::table::Key<float> _binnedRadiusKey;
+    afw::table::Key<int> _nBadPixelsKey;
+    afw::table::Key<float> _warmStartRadiusKey;
+    afw::table::Key<float> _warmStartRadiusForRadiusKey;
+    afw::table::Key<std::int64_t> _timeKey;
+    afw::table::Key<int> _nPixRadiusKey;
+    afw::table::Key<int> _nPixFluxKey;
     meas::base::FlagHandler _flagHandler;
     meas::base::SafeCentroidExtractor _centroidExtractor;
+    std::shared_ptr<KronImagePyramid> _pyramid;
+    std::shared_ptr<WarmStartMap const> _warmStartSeeds;
+    std::vector<meas::base::FluxResultKey> _bandFluxResultKeys;
+    std::shared_ptr<KronApertureTable const> _apertureTable;
+    std::shared_ptr<afw::image::Image<float> const> _smoothedImage;
+    Control _smoothedCtrl;              // _ctrl, modified for use with _smoothedImage
+    double _smoothedSigma;              // the Gaussian width with which _smoothedImage was smoothed
+    daf::base::PropertySet * _metadata; // where writeStats puts the statistics
+    std::shared_ptr<KronStats> _stats;  // null unless _ctrl.doCollectStats
 };
 
+/**
+ *  @brief An elliptical Kron aperture
+ *
+ *  The templated methods are instantiated for afw::image::MaskedImage<PixelT>, and for
+ *  KronMaskedPixelView<PixelT> to measure pixels held in external buffers without copying them,
+ *  for PixelT one of float, double, int and std::uint16_t.
+ */
 class KronAperture {
 public:
     KronAperture(geom::Point2D const& center, afw::geom::ellipses::BaseCore const& core,
                  float radiusForRadius=std::nanf("")) :
         _center(center),
         _axes(core),
-        _radiusForRadius(radiusForRadius)
+        _radiusForRadius(radiusForRadius),
+        _binnedRadius(std::nanf("")),
+        _nIterForRadius(0)
         {}
 
     explicit KronAperture(afw::table::SourceRecord const& source, float radiusForRadius=std::nanf("")) :
         _center(geom::Point2D(source.getX(), source.getY())),
         _axes(source.getShape()),
-        _radiusForRadius(radiusForRadius)
+        _radiusForRadius(radiusForRadius),
+        _binnedRadius(std::nanf("")),
+        _nIterForRadius(0)
         {}
 
     KronAperture(afw::table::SourceRecord const& reference, geom::AffineTransform const& refToMeas,
                  double radius, float radiusForRadius=std::nanf("")) :
         _center(refToMeas(reference.getCentroid())),
         _axes(getKronAxes(reference.getShape(), refToMeas.getLinear(), radius)),
-        _radiusForRadius(radiusForRadius)
+        _radiusForRadius(radiusForRadius),
+        _binnedRadius(std::nanf("")),
+        _nIterForRadius(0)
         {}
 
     /// Accessors
     double getX() const { return _center.getX(); }
     double getY() const { return _center.getY(); }
     float getRadiusForRadius() const { return _radiusForRadius; }
+    /// The Kron radius estimated on a binned image before the final iteration (NaN if not binned)
+    float getBinnedRadius() const { return _binnedRadius; }
+    /// The number of iterations used to determine the Kron radius
+    int getNIterForRadius() const { return _nIterForRadius; }
 
     geom::Point2D const& getCenter() const { return _center; }
 
@@ -198,15 +610,142 @@ public:
     ///
     /// Determines the object Kron aperture, using the shape from source.getShape()
     /// (e.g. SDSS's adaptive moments)
+    ///
+    /// Pixels in ctrl.badMaskPlanes are rejected (see tryMeasureFlux) except in the binned image,
+    /// which has no mask; the final iteration is always at full resolution.
+    ///
+    /// If ctrl.binFactorForRadius > 1 and a pyramid is provided, all but the last iteration
+    /// are carried out on the binned image.  Otherwise, if ctrl.radiusTolerance > 0, we iterate
+    /// to convergence (but no more than ctrl.nIterForRadius times)
+    ///
+    /// Sets aperture (or resets it on failure) and returns a status rather than throwing; if the
+    /// aperture hits the edge of the image we use the radius we have, so EDGE is never returned
+    template<typename ImageT>
+    static KronStatus tryDetermineRadius(
+        std::shared_ptr<KronAperture> & aperture, ///< The desired aperture
+        ImageT const& image,  ///< Image to measure
+        afw::geom::ellipses::Axes axes,  ///< Shape of aperture
+        geom::Point2D const& center,   ///< Centre of source
+        KronFluxControl const& ctrl,  ///< control the algorithm
+        KronImagePyramid * pyramid=nullptr ///< binned versions of image
+        );
+
+    /// Determine the Kron Aperture from an image, as tryDetermineRadius
+    ///
+    /// @throws BadKronException if the Kron radius can't be determined
     template<typename ImageT>
     static std::shared_ptr<KronAperture> determineRadius(
         ImageT const& image,  ///< Image to measure
         afw::geom::ellipses::Axes axes,  ///< Shape of aperture
         geom::Point2D const& center,   ///< Centre of source
+        KronFluxControl const& ctrl,  ///< control the algorithm
+        KronImagePyramid * pyramid=nullptr ///< binned versions of image
+        );
+
+    /// Refine an estimate of the Kron aperture with a single iteration
+    ///
+    /// The aperture used to measure the Kron radius is ctrl.nSigmaForRadius times axes.
+    /// Returns EDGE (and a null aperture) if that aperture doesn't fit in the image
+    template<typename ImageT>
+    static KronStatus tryRefineRadius(
+        std::shared_ptr<KronAperture> & aperture, ///< The desired aperture
+        ImageT const& image,  ///< Image to measure
+        afw::geom::ellipses::Axes axes,  ///< Current estimate of the Kron aperture
+        geom::Point2D const& center,   ///< Centre of source
+        KronFluxControl const& ctrl  ///< control the algorithm
+        );
+
+    /// Refine an estimate of the Kron aperture, as tryRefineRadius
+    ///
+    /// Returns nullptr if the aperture doesn't fit in the image
+    /// @throws BadKronException if the Kron radius can't be determined
+    template<typename ImageT>
+    static std::shared_ptr<KronAperture> refineRadius(
+        ImageT const& image,  ///< Image to measure
+        afw::geom::ellipses::Axes axes,  ///< Current estimate of the Kron aperture
+        geom::Point2D const& center,   ///< Centre of source
+        KronFluxControl const& ctrl  ///< control the algorithm
+        );
+
+    /// Iterate the Kron radius to convergence
+    ///
+    /// Iterates until the Kron radius changes by less than ctrl.radiusTolerance (fractionally),
+    /// using secant-accelerated steps, but no more than ctrl.nIterForRadius times
+    template<typename ImageT>
+    static KronStatus tryConvergeRadius(
+        std::shared_ptr<KronAperture> & aperture, ///< The desired aperture
+        ImageT const& image,  ///< Image to measure
+        afw::geom::ellipses::Axes axes,  ///< Shape of aperture
+        geom::Point2D const& center,   ///< Centre of source
+        KronFluxControl const& ctrl  ///< control the algorithm
+        );
+
+    /// Iterate the Kron radius to convergence, as tryConvergeRadius
+    ///
+    /// @throws BadKronException if the Kron radius can't be determined
+    template<typename ImageT>
+    static std::shared_ptr<KronAperture> convergeRadius(
+        ImageT const& image,  ///< Image to measure
+        afw::geom::ellipses::Axes axes,  ///< Shape of aperture
+        geom::Point2D const& center,   ///< Centre of source
+        KronFluxControl const& ctrl  ///< control the algorithm
+        );
+
+    /// Photometer within the Kron Aperture on an image, setting result to the flux and its error
+    ///
+    /// Returns EDGE if the aperture doesn't fit in the image; if clipToImage is true the flux within
+    /// the part of the aperture that lies on the image is returned in result.  If measureFluxErr is
+    /// false (or image has no variance) the variance isn't read, and the error is NaN
+    ///
+    /// Pixels with any of badPixelMask set (if image has a mask) are ignored, or if replaceBadPixels
+    /// is true replaced by the mean of the good pixels at the same elliptical radius; their number is
+    /// returned in *nBadPixels if it isn't null
+    template<typename ImageT>
+    KronStatus tryMeasureFlux(
+        std::pair<double, double> & result, ///< The flux and its error
+        ImageT const& image,  ///< Image to measure
+        double const nRadiusForFlux,  ///< Kron radius multiplier
+        double const maxSincRadius,  ///< largest radius that we use sinc apertyres
+        bool const clipToImage=false,  ///< measure the part of the aperture that's on the image?
+        bool const measureFluxErr=true,  ///< measure the error in the flux?
+        afw::image::MaskPixel const badPixelMask=0,  ///< reject pixels with any of these bits set
+        bool const replaceBadPixels=false,  ///< replace rejected pixels rather than ignoring them?
+        int * nBadPixels=nullptr  ///< the number of rejected pixels
+        ) const;
+
+    /// Determine the Kron apertures of many sources, as tryDetermineRadius
+    ///
+    /// Each iteration makes a single pass over the union of the sources' apertures, reading each pixel
+    /// once however many apertures contain it.  Apertures are set (or reset on failure) for each source.
+    ///
+    /// @throws pex::exceptions::InvalidParameterError if ctrl requests smoothing, binning, convergence
+    /// or replacing bad pixels, which aren't supported
+    template<typename ImageT>
+    static std::vector<KronStatus> tryDetermineRadii(
+        std::vector<std::shared_ptr<KronAperture>> & apertures, ///< The desired apertures
+        ImageT const& image,  ///< Image to measure
+        std::vector<afw::geom::ellipses::Axes> const& axes,  ///< Shapes of the initial apertures
+        std::vector<geom::Point2D> const& centers,   ///< Centres of sources
+        KronFluxControl const& ctrl  ///< control the algorithm
+        );
+
+    /// Photometer within many Kron apertures, as tryMeasureFlux with the options in ctrl
+    ///
+    /// Apertures measured by summing pixels that lie within the image are measured in a single pass
+    /// over the union of the apertures; nBadPixels is set to the number of rejected pixels in each
+    template<typename ImageT>
+    static std::vector<KronStatus> tryMeasureFluxes(
+        std::vector<std::pair<double, double>> & results, ///< The fluxes and their errors
+        std::vector<int> & nBadPixels, ///< The numbers of rejected pixels
+        std::vector<std::shared_ptr<KronAperture const>> const& apertures, ///< The Kron apertures
+        ImageT const& image,  ///< Image to measure
         KronFluxControl const& ctrl  ///< control the algorithm
         );
 
     /// Photometer within the Kron Aperture on an image
+    ///
+    /// @throws pex::exceptions::LengthError (sinc apertures) or pex::exceptions::OutOfRangeError if the
+    /// aperture doesn't fit in the image
     template<typename ImageT>
     std::pair<double, double> measureFlux(
         ImageT const& image,  ///< Image to measure
@@ -214,6 +753,54 @@ public:
         double const maxSincRadius  ///< largest radius that we use sinc apertyres
         ) const;
 
+    /// Photometer within the Kron aperture on several pixel-aligned images (e.g. of different bands)
+    ///
+    /// As tryMeasureFlux, but the aperture (or sinc kernel) is only constructed once and the images
+    /// are read in a single pass; results and nBadPixels are set for each image.  Rejected pixels are
+    /// ignored, never replaced.
+    ///
+    /// @throws pex::exceptions::LengthError if the images have different bounding boxes
+    template<typename ImageT>
+    KronStatus tryMeasureFluxBands(
+        std::vector<std::pair<double, double>> & results, ///< The fluxes and their errors
+        std::vector<int> & nBadPixels, ///< The numbers of rejected pixels
+        std::vector<ImageT> const& images,  ///< Images to measure
+        double const nRadiusForFlux,  ///< Kron radius multiplier
+        double const maxSincRadius,  ///< largest radius that we use sinc apertyres
+        bool const clipToImage=false,  ///< measure the part of the aperture that's on the images?
+        bool const measureFluxErr=true,  ///< measure the errors in the fluxes?
+        afw::image::MaskPixel const badPixelMask=0  ///< reject pixels with any of these bits set
+        ) const;
+
+    /// Photometer within the Kron Aperture on several pixel-aligned images, as measureFlux
+    ///
+    /// @throws pex::exceptions::LengthError (sinc apertures) or pex::exceptions::OutOfRangeError if the
+    /// aperture doesn't fit in the images
+    template<typename ImageT>
+    std::vector<std::pair<double, double>> measureFluxBands(
+        std::vector<ImageT> const& images,  ///< Images to measure
+        double const nRadiusForFlux,  ///< Kron radius multiplier
+        double const maxSincRadius  ///< largest radius that we use sinc apertyres
+        ) const;
+
+    /// Measure the Kron radii and fluxes of many sources on one image, using nThreads threads
+    ///
+    /// The sources are specified by their centres (x, y) and the ellipses (a, b, theta) with which we
+    /// start the estimate of the Kron radius; all arrays must have the same size.  No minimum radius
+    /// is enforced and no fallback aperture is used; sources that can't be measured have a status other
+    /// than KronStatus::OK.  If nThreads <= 0 use one thread per available core.
+    template<typename ImageT>
+    static std::vector<KronBatchResult> measureBatch(
+        ImageT const& image,  ///< Image to measure
+        ndarray::Array<double const, 1> const& x,  ///< Column centres of sources
+        ndarray::Array<double const, 1> const& y,  ///< Row centres of sources
+        ndarray::Array<double const, 1> const& a,  ///< Semi-major axes
+        ndarray::Array<double const, 1> const& b,  ///< Semi-minor axes
+        ndarray::Array<double const, 1> const& theta,  ///< Position angles (radians, +ve from x axis)
+        KronFluxControl const& ctrl,  ///< control the algorithm
+        int nThreads=1  ///< number of threads to use
+        );
+
     /// Transform a Kron Aperture to a different frame
     std::shared_ptr<KronAperture> transform(geom::AffineTransform const& trans) const {
         geom::Point2D const center = trans(getCenter());
@@ -233,8 +820,214 @@ private:
     geom::Point2D const _center;     // Center of aperture
     afw::geom::ellipses::Axes _axes;      // Ellipse defining aperture shape
     float _radiusForRadius;               // Radius used to estimate the Kron radius
+    float _binnedRadius;                  // Kron radius estimated on a binned image
+    int _nIterForRadius;                  // Number of iterations used to estimate the Kron radius
 };
 
+/**
+ *  @brief The Kron aperture of a reference source, in the reference frame (see KronApertureTable)
+ */
+struct KronApertureRecord {
+    std::int64_t id;                    ///< The reference source's id
+    double x;                           ///< Column centre of the aperture
+    double y;                           ///< Row centre of the aperture
+    double a;                           ///< Semi-major axis of the Kron ellipse
+    double b;                           ///< Semi-minor axis of the Kron ellipse
+    double theta;                       ///< Position angle of the Kron ellipse (radians, +ve from x axis)
+    double radius;                      ///< The reference Kron radius
+};
+
+/**
+ *  @brief The Kron apertures of a reference catalog, computed once and reused for many forced measurements
+ *
+ *  The records are held in a flat array sorted by id, so a table may be saved (e.g. as a NumPy structured
+ *  array) and memory-mapped by many processes; a table constructed from such an array doesn't copy it.
+ */
+class KronApertureTable {
+public:
+    /// Compute the apertures of the sources in refCat, whose Kron radii are in ctrl.refRadiusName
+    KronApertureTable(afw::table::SourceCatalog const& refCat, KronFluxControl const& ctrl);
+
+    /**
+     *  Use records that have already been computed, without copying them
+     *
+     *  The data (which must be sorted by id) are kept alive by holding a copy of the pointer.
+     *
+     *  @throws pex::exceptions::InvalidParameterError if the records aren't sorted by id
+     */
+    KronApertureTable(std::shared_ptr<KronApertureRecord const> const& data, std::size_t size);
+
+    std::size_t size() const { return _size; }
+    KronApertureRecord const* begin() const { return _data.get(); }
+    KronApertureRecord const* end() const { return _data.get() + _size; }
+
+    /// Return the record for the source with this id, or null if there isn't one
+    KronApertureRecord const* find(afw::table::RecordId id) const;
+
+    /// Return the Kron aperture of a record, transformed to the measurement frame
+    static KronAperture makeAperture(KronApertureRecord const& record,
+                                     geom::AffineTransform const& refToMeas);
+
+private:
+    std::shared_ptr<KronApertureRecord const> _data;
+    std::size_t _size;
+};
+
+/**
+ *  Return the Kron radius of the PSF at center, after smoothing with a Gaussian of width smoothingSigma
+ *  (if positive); the PSF is taken to be Gaussian, with a Kron radius of sqrt(pi/2)*sigma
+ */
+double calculatePsfKronRadius(
+    std::shared_ptr<afw::detection::Psf const> const& psf,
+    geom::Point2D const& center,
+    double smoothingSigma=0.0
+    );
+
+/**
+ *  Return the instruction set that the vectorised moment and flux kernels use: "default", "avx2" or
+ *  "avx512".  The best that the CPU supports is chosen when the library is loaded, unless the environment
+ *  variable LSST_KRON_KERNEL_VARIANT names another variant that it supports.
+ */
+std::string getKronKernelVariant();
+
+/**
+ *  Enable or disable the analytic classification of apertures against the image, which rejects apertures
+ *  that certainly leave it (and accepts those that certainly don't) without rasterising them, returning
+ *  the previous setting.  It's enabled by default, and the measurements are the same either way; turning
+ *  it off is only useful to time what it saves (see benchmarks/kronBenchmark.cc).
+ */
+bool setKronEdgeClassification(bool enabled);
+
+/**
+ *  @brief A self-contained reproduction of KronFluxAlgorithm::measure for one source
+ *
+ *  KronFluxAlgorithm writes one for each source that's slow to measure (see KronFluxControl.slowSourceTime).
+ *  It holds the configuration, the source's centroid, shape and Footprint, the PSF's shape, and a postage
+ *  stamp of the pixels that the measurement read, so that replay can measure the source again, e.g. under
+ *  a profiler (see benchmarks/kronReplay).  The mask is reduced to whether each pixel is in badMaskPlanes,
+ *  and the PSF is replayed as a Gaussian with the same second moments.  Pre-smoothed images, warm starts
+ *  and HeavyFootprints aren't captured, so sources measured using them are replayed without them.
+ */
+class KronReproduction {
+public:
+    /// Capture the measurement of source (already measured by an algorithm called name) on exposure
+    KronReproduction(
+        KronFluxControl const& ctrl,
+        std::string const& name,
+        afw::table::SourceRecord const& source,
+        afw::image::Exposure<float> const& exposure,
+        std::int64_t timeNs=0
+    );
+
+    /**
+     *  Read a reproduction written by writeFile
+     *
+     *  @throws pex::exceptions::IoError if the file can't be read, or isn't a reproduction
+     */
+    static KronReproduction readFile(std::string const& filename);
+
+    /**
+     *  Write the reproduction to a (native-endian) binary file
+     *
+     *  @throws pex::exceptions::IoError if the file can't be written
+     */
+    void writeFile(std::string const& filename) const;
+
+    /// Measure the source nRepeat times (on fresh records); return the last measurement
+    std::shared_ptr<afw::table::SourceRecord> replay(int nRepeat=1) const;
+
+    KronFluxControl const& getControl() const { return _ctrl; }
+    std::string const& getName() const { return _name; }
+    afw::table::RecordId getId() const { return _id; }
+    /// Return the time that the captured measurement took (ns)
+    std::int64_t getTime() const { return _timeNs; }
+    /// Return the bounding box of the postage stamp
+    geom::Box2I getBBox() const { return _image->getBBox(); }
+
+private:
+    KronReproduction() = default;
+
+    KronFluxControl _ctrl;
+    std::string _name;
+    afw::table::RecordId _id;
+    std::int64_t _timeNs;
+    geom::Point2D _centroid;
+    bool _centroidFlag;
+    afw::geom::ellipses::Quadrupole _shape;
+    bool _shapeFlag;
+    std::shared_ptr<afw::geom::SpanSet> _footprint; // null if the source had no Footprint
+    std::vector<geom::Point2D> _peaks;
+    bool _hasPsf;
+    afw::geom::ellipses::Quadrupole _psfShape;
+    std::shared_ptr<afw::image::MaskedImage<float>> _image; // mask is 1 for pixels in badMaskPlanes
+};
+
+/**
+ *  @brief A galaxy to draw with renderGalaxies
+ *
+ *  If sersicIndex is zero the profile is an elliptical Gaussian with standard deviations a and b along
+ *  its axes; otherwise it's a Sersic profile (1: exponential, 4: de Vaucouleurs) whose half-light
+ *  ellipse has semi-axes a and b.
+ */
+struct SyntheticGalaxy {
+    double x;                           ///< Column centre
+    double y;                           ///< Row centre
+    double flux;                        ///< Total flux
+    double a;                           ///< Semi-major axis
+    double b;                           ///< Semi-minor axis
+    double theta;                       ///< Position angle (radians, +ve from x axis)
+    double sersicIndex;                 ///< Sersic index; 0 for a Gaussian
+};
+
+/**
+ *  Add galaxies to an image
+ *
+ *  Pixels within subsampleRadius (in units of each galaxy's ellipse) of a galaxy's centre are integrated
+ *  on an nSubsample x nSubsample grid; other pixels are sampled at their centres.  Gaussians are drawn
+ *  out to 6 sigma and Sersic profiles to 8 half-light radii, normalised to the total (untruncated) flux.
+ */
+void renderGalaxies(
+    afw::image::Image<float> & image,
+    std::vector<SyntheticGalaxy> const& galaxies,
+    int nSubsample=5,
+    double subsampleRadius=3.0
+    );
+
+/**
+ *  Make an exposure of galaxies, seen through psf (if not null) with Gaussian noise of rms noiseSigma
+ *
+ *  Gaussian galaxies are convolved with a Gaussian with the PSF's second moments at the centre of bbox,
+ *  which is exact for a Gaussian PSF; Sersic galaxies are convolved with the PSF's kernel image there.
+ *  The variance plane is set to noiseSigma^2 (or 1 if there's no noise), and the PSF and wcs are
+ *  attached to the exposure.
+ */
+std::shared_ptr<afw::image::Exposure<float>> makeSyntheticExposure(
+    geom::Box2I const& bbox,
+    std::vector<SyntheticGalaxy> const& galaxies,
+    std::shared_ptr<afw::detection::Psf const> const& psf,
+    double noiseSigma=0.0,
+    std::shared_ptr<afw::geom::SkyWcs const> const& wcs=nullptr,
+    unsigned int seed=1,
+    int nSubsample=5,
+    double subsampleRadius=3.0
+    );
+
+/**
+ *  Draw nGalaxy random galaxies in bbox, as a crowded field
+ *
+ *  The positions and orientations are uniform; fluxes follow a Euclidean number count (N(>flux) is
+ *  proportional to flux^-1.5) between minFlux and maxFlux; sizes grow as flux^0.25 from a semi-major
+ *  axis of 1.5 pixels at minFlux, and the axis ratios are uniform in [0.3, 1].  Half the galaxies are
+ *  Gaussian and half exponential.
+ */
+std::vector<SyntheticGalaxy> makeRandomGalaxies(
+    geom::Box2I const& bbox,
+    int nGalaxy,
+    double minFlux=100.0,
+    double maxFlux=1e5,
+    unsigned int seed=1
+    );
+
 }}}} // namespace lsst::meas::extensions::photometryKron
 
 #endif // !LSST_MEAS_EXTENSIONS_PHOTOMETRY_KRON_H
@@ -20,18 +20,82 @@
 # see <http://www.lsstcorp.org/LegalNotices/>.
 #
 
-from lsst.meas.base import BasePlugin, wrapSimpleAlgorithm
-from .photometryKron import KronFluxAlgorithm, KronFluxControl, KronAperture
+import time
 
-__all__ = ["KronFluxAlgorithm", "KronFluxControl", "KronAperture", "KronFluxPlugin", "KronFluxForcedPlugin"]
+from lsst.meas.base import BasePlugin, register, wrapSimpleAlgorithm
+from .photometryKron import KronFluxAlgorithm, KronFluxControl, KronAperture, KronApertureTable, \
+    KronImagePyramid, KronStatus, KronReproduction, SyntheticGalaxy, renderGalaxies, makeSyntheticExposure, \
+    makeRandomGalaxies, getKronKernelVariant, setKronEdgeClassification
 
-KronFluxPlugin, KronFluxForcedPlugin = wrapSimpleAlgorithm(
+__all__ = ["KronFluxAlgorithm", "KronFluxControl", "KronAperture", "KronApertureTable", "KronImagePyramid",
+           "KronStatus", "KronReproduction", "KronFluxPlugin", "KronFluxForcedPlugin", "SyntheticGalaxy",
+           "renderGalaxies", "makeSyntheticExposure", "makeRandomGalaxies", "getKronKernelVariant",
+           "setKronEdgeClassification"]
+
+_KronFluxPlugin, _KronFluxForcedPlugin = wrapSimpleAlgorithm(
     KronFluxAlgorithm,
-    name = "ext_photometryKron_KronFlux",
     Control = KronFluxControl,
     executionOrder = BasePlugin.FLUX_ORDER,
-    shouldApCorr = True,
     needsMetadata = True,
+    doRegister = False,
 )
 
+
+class _StatsWriter:
+    """Write the statistics collected with doCollectStats to the metadata as a run progresses.
+
+    The measurement framework has no hook at the end of a run, and rewriting every statistic after each of
+    thousands of parents is expensive, so we write them after a parent (or isolated) source or a measureN
+    call only if `statsInterval` seconds have passed since we last wrote them; the first parent measured
+    is always written.  The metadata may thus omit the last `statsInterval` seconds of a run; call
+    `writeStats` when the run's finished for exact totals.
+    """
+
+    statsInterval = 1.0
+    """Minimum interval between writes of the statistics (seconds)."""
+
+    _statsWritten = None
+
+    def writeStats(self):
+        """Write the totals of the statistics to the metadata now (does nothing unless doCollectStats)."""
+        self.cpp.writeStats()
+        self._statsWritten = time.monotonic()
+
+    def _writeStats(self, measRecord=None):
+        if not self.config.doCollectStats or (measRecord is not None and measRecord.getParent() != 0):
+            return
+        if self._statsWritten is None or time.monotonic() - self._statsWritten >= self.statsInterval:
+            self.writeStats()
+
+
+@register("ext_photometryKron_KronFlux", shouldApCorr=True)
+class KronFluxPlugin(_StatsWriter, _KronFluxPlugin):
+    """Measure Kron fluxes in single-frame measurement."""
+
+    def measure(self, measRecord, exposure):
+        super().measure(measRecord, exposure)
+        self._writeStats(measRecord)
+
+    def measureN(self, measCat, exposure):
+        self.cpp.measureN(measCat, exposure)
+        self._writeStats()
+
+    def fail(self, measRecord, error=None):
+        super().fail(measRecord, error)
+        self._writeStats(measRecord)
+
+
+@register("ext_photometryKron_KronFlux", shouldApCorr=True)
+class KronFluxForcedPlugin(_StatsWriter, _KronFluxForcedPlugin):
+    """Measure Kron fluxes in forced measurement."""
+
+    def measure(self, measRecord, exposure, refRecord, refWcs):
+        super().measure(measRecord, exposure, refRecord, refWcs)
+        self._writeStats(measRecord)
+
+    def fail(self, measRecord, error=None):
+        super().fail(measRecord, error)
+        self._writeStats(measRecord)
+
+
 from .version import *
@@ -21,11 +21,14 @@
  */
 
 #include "pybind11/pybind11.h"
+#include "pybind11/numpy.h"
 #include "pybind11/stl.h"
+#include "ndarray/pybind11.h"
 
 #include <cstdint>
 
 #include "lsst/pex/config/python.h"  // defines LSST_DECLARE_CONTROL_FIELD
+#include "lsst/pex/exceptions.h"
 #include "lsst/geom/Point.h"
 #include "lsst/afw/geom/ellipses.h"
 #include "lsst/geom/AffineTransform.h"
@@ -52,6 +55,8 @@ void declareKronFluxControl(py::module &mod) {
     LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, fixed);
     LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, nSigmaForRadius);
     LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, nIterForRadius);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, radiusTolerance);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, momentShapeTolerance);
     LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, nRadiusForFlux);
     LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, maxSincRadius);
     LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, minimumRadius);
@@ -59,6 +64,40 @@ void declareKronFluxControl(py::module &mod) {
     LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, useFootprintRadius);
     LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, smoothingSigma);
     LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, refRadiusName);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, binFactorForRadius);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, warmStartRadiusName);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, warmStartTolerance);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, clipEdgeApertures);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, doMeasureFlux);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, doMeasureFluxErr);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, badMaskPlanes);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, replaceBadPixels);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, useHeavyFootprint);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, bandNames);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, doCollectStats);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, doRecordCost);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, slowSourceTime);
+    LSST_DECLARE_CONTROL_FIELD(cls, KronFluxControl, slowSourceDir);
+
+    cls.def("getBadPixelMask", &KronFluxControl::getBadPixelMask);
+}
+
+void declareKronStatus(py::module &mod) {
+    py::enum_<KronStatus>(mod, "KronStatus")
+            .value("OK", KronStatus::OK)
+            .value("EDGE", KronStatus::EDGE)
+            .value("BAD_INTEGRAL", KronStatus::BAD_INTEGRAL)
+            .value("RADIUS_TOO_LARGE", KronStatus::RADIUS_TOO_LARGE)
+            .value("FAILURE", KronStatus::FAILURE);
+}
+
+void declareKronImagePyramid(py::module &mod) {
+    py::class_<KronImagePyramid, std::shared_ptr<KronImagePyramid>> cls(mod, "KronImagePyramid");
+
+    cls.def(py::init<>());
+
+    cls.def("markDirty", &KronImagePyramid::markDirty, "bbox"_a);
+    cls.def("reset", &KronImagePyramid::reset);
 }
 
 void declareKronFluxAlgorithm(py::module &mod) {
@@ -80,16 +119,55 @@ void declareKronFluxAlgorithm(py::module &mod) {
 
     cls.def(py::init<KronFluxAlgorithm::Control const &, std::string const &, afw::table::Schema &,
                      daf::base::PropertySet &>(),
-            "ctrl"_a, "name"_a, "schema"_a, "metadata"_a);
+            "ctrl"_a, "name"_a, "schema"_a, "metadata"_a,
+            py::keep_alive<1, 5>());  // the statistics are written to the metadata
 
     cls.def("measure", &KronFluxAlgorithm::measure, "measRecord"_a, "exposure"_a);
+    cls.def("measureN", &KronFluxAlgorithm::measureN, "measCat"_a, "exposure"_a);
     cls.def("measureForced", &KronFluxAlgorithm::measureForced, "measRecord"_a, "exposure"_a, "refRecord"_a,
             "refWcs"_a);
+    cls.def("measureForcedBands", &KronFluxAlgorithm::measureForcedBands, "measRecord"_a, "exposures"_a,
+            "refRecord"_a, "refWcs"_a);
     cls.def("fail", &KronFluxAlgorithm::fail, "measRecord"_a, "error"_a = NULL);
+    cls.def("setWarmStartCatalog", &KronFluxAlgorithm::setWarmStartCatalog, "prior"_a);
+    cls.def("setSmoothedImage", &KronFluxAlgorithm::setSmoothedImage, "image"_a, "sigma"_a);
+    cls.def("setForcedApertureTable", &KronFluxAlgorithm::setForcedApertureTable, "table"_a);
+    cls.def("writeStats", &KronFluxAlgorithm::writeStats);
 }
 
 using PyKronAperture = py::class_<KronAperture>;
 
+/**
+ * Run KronAperture::measureBatch without the GIL, returning a structured array
+ */
+template <typename ImageT>
+py::array_t<KronBatchResult> measureBatch(ImageT const &image, ndarray::Array<double const, 1> const &x,
+                                          ndarray::Array<double const, 1> const &y,
+                                          ndarray::Array<double const, 1> const &a,
+                                          ndarray::Array<double const, 1> const &b,
+                                          ndarray::Array<double const, 1> const &theta,
+                                          KronFluxControl const &ctrl, int nThreads) {
+    std::vector<KronBatchResult> results;
+    {
+        py::gil_scoped_release release;
+        results = KronAperture::measureBatch(image, x, y, a, b, theta, ctrl, nThreads);
+    }
+    py::array_t<KronBatchResult> array(results.size());
+    std::copy(results.begin(), results.end(), array.mutable_data());
+    return array;
+}
+
+/**
+ * Make a view of a 2-d array with its origin at xy0 (without copying it)
+ */
+template <typename PixelT>
+KronPixelView<PixelT> makeView(ndarray::Array<PixelT const, 2, 0> const &array, geom::Point2I const &xy0) {
+    return KronPixelView<PixelT>(array.getData(),
+                                 geom::Box2I(xy0, geom::Extent2I(array.template getSize<1>(),
+                                                                 array.template getSize<0>())),
+                                 array.getStrides()[0], array.getStrides()[1]);
+}
+
 /**
  * Wrap templated methods of KronAperture
  *
@@ -99,9 +177,59 @@ using PyKronAperture = py::class_<KronAperture>;
 template <typename ImageT>
 void declareKronApertureTemplatedMethods(PyKronAperture &cls) {
     cls.def_static("determineRadius", &KronAperture::determineRadius<ImageT>, "image"_a, "axes"_a, "center"_a,
+                   "ctrl"_a, "pyramid"_a = nullptr);
+    cls.def_static("refineRadius", &KronAperture::refineRadius<ImageT>, "image"_a, "axes"_a, "center"_a,
                    "ctrl"_a);
+    cls.def_static("convergeRadius", &KronAperture::convergeRadius<ImageT>, "image"_a, "axes"_a,
+                   "center"_a, "ctrl"_a);
     cls.def("measureFlux", &KronAperture::measureFlux<ImageT>, "image"_a, "nRadiusForFlux"_a,
             "maxSincRadius"_a);
+    cls.def("measureFluxBands", &KronAperture::measureFluxBands<ImageT>, "images"_a, "nRadiusForFlux"_a,
+            "maxSincRadius"_a);
+    cls.def_static("measureBatch", &measureBatch<ImageT>,
+                   "image"_a, "x"_a, "y"_a, "a"_a, "b"_a, "theta"_a, "ctrl"_a, "nThreads"_a = 1);
+}
+
+/**
+ * Wrap methods of KronAperture that measure pixels in NumPy arrays, without copying them into a MaskedImage
+ *
+ * @tparam PixelT  Type of the image pixels
+ * @param cls  pybind11 class wrapping KronAperture
+ */
+template <typename PixelT>
+void declareKronApertureArrayMethods(PyKronAperture &cls) {
+    cls.def_static("measureBatch",
+                   [](ndarray::Array<PixelT const, 2, 0> const &image, py::object const &variance,
+                      geom::Point2I const &xy0, ndarray::Array<double const, 1> const &x,
+                      ndarray::Array<double const, 1> const &y, ndarray::Array<double const, 1> const &a,
+                      ndarray::Array<double const, 1> const &b, ndarray::Array<double const, 1> const &theta,
+                      KronFluxControl const &ctrl, int nThreads, py::object const &mask) {
+                       KronPixelView<afw::image::VariancePixel> varianceView(nullptr, geom::Box2I(), 0, 0);
+                       KronPixelView<afw::image::MaskPixel> maskView(nullptr, geom::Box2I(), 0, 0);
+                       ndarray::Array<afw::image::VariancePixel const, 2, 0> varianceArray;
+                       ndarray::Array<afw::image::MaskPixel const, 2, 0> maskArray;
+                       if (!variance.is_none()) {  // otherwise only the radius and flux are wanted
+                           varianceArray =
+                                   variance.cast<ndarray::Array<afw::image::VariancePixel const, 2, 0>>();
+                           if (image.getShape() != varianceArray.getShape()) {
+                               throw LSST_EXCEPT(pex::exceptions::LengthError,
+                                                 "Image and variance arrays have different shapes");
+                           }
+                           varianceView = makeView(varianceArray, xy0);
+                       }
+                       if (!mask.is_none()) {  // otherwise no pixels are rejected
+                           maskArray = mask.cast<ndarray::Array<afw::image::MaskPixel const, 2, 0>>();
+                           if (image.getShape() != maskArray.getShape()) {
+                               throw LSST_EXCEPT(pex::exceptions::LengthError,
+                                                 "Image and mask arrays have different shapes");
+                           }
+                           maskView = makeView(maskArray, xy0);
+                       }
+                       KronMaskedPixelView<PixelT> const view(makeView(image, xy0), varianceView, maskView);
+                       return measureBatch(view, x, y, a, b, theta, ctrl, nThreads);
+                   },
+                   "image"_a, "variance"_a, "xy0"_a, "x"_a, "y"_a, "a"_a, "b"_a, "theta"_a, "ctrl"_a,
+                   "nThreads"_a = 1, "mask"_a = py::none());
 }
 
 void declareKronAperture(py::module &mod) {
@@ -119,25 +247,114 @@ void declareKronAperture(py::module &mod) {
     cls.def("getX", &KronAperture::getX);
     cls.def("getY", &KronAperture::getY);
     cls.def("getRadiusForRadius", &KronAperture::getRadiusForRadius);
+    cls.def("getBinnedRadius", &KronAperture::getBinnedRadius);
+    cls.def("getNIterForRadius", &KronAperture::getNIterForRadius);
     cls.def("getCenter", &KronAperture::getCenter);
     cls.def("getAxes", (afw::geom::ellipses::Axes & (KronAperture::*)()) & KronAperture::getAxes,
             py::return_value_policy::reference_internal);
     cls.def("transform", &KronAperture::transform, "trans"_a);
 
     declareKronApertureTemplatedMethods<afw::image::MaskedImage<float>>(cls);
+    declareKronApertureTemplatedMethods<afw::image::MaskedImage<double>>(cls);
+    declareKronApertureTemplatedMethods<afw::image::MaskedImage<int>>(cls);
+    declareKronApertureTemplatedMethods<afw::image::MaskedImage<std::uint16_t>>(cls);
+    declareKronApertureArrayMethods<float>(cls);
+    declareKronApertureArrayMethods<double>(cls);
+    declareKronApertureArrayMethods<int>(cls);
+    declareKronApertureArrayMethods<std::uint16_t>(cls);
+}
+
+void declareKronApertureTable(py::module &mod) {
+    py::class_<KronApertureTable, std::shared_ptr<KronApertureTable>> cls(mod, "KronApertureTable");
+
+    cls.def(py::init<afw::table::SourceCatalog const &, KronFluxControl const &>(), "refCat"_a, "ctrl"_a);
+    // Use the records in a structured array (e.g. one that's memory-mapped) without copying them
+    cls.def(py::init([](py::array_t<KronApertureRecord, py::array::c_style | py::array::forcecast> const
+                                &records) {
+                auto *owner = new py::object(records);
+                std::shared_ptr<KronApertureRecord const> data(records.data(),
+                                                               [owner](KronApertureRecord const *) {
+                                                                   py::gil_scoped_acquire gil;
+                                                                   delete owner;
+                                                               });
+                return std::make_shared<KronApertureTable>(data, records.size());
+            }),
+            "records"_a);
+
+    cls.def("__len__", &KronApertureTable::size);
+    // A structured array viewing the records, which keeps the table alive; e.g. to save with numpy.save
+    cls.def("getRecords", [](py::object const &self) {
+        KronApertureTable const &table = self.cast<KronApertureTable const &>();
+        return py::array_t<KronApertureRecord>(table.size(), table.begin(), self);
+    });
+}
+
+void declareKronReproduction(py::module &mod) {
+    py::class_<KronReproduction, std::shared_ptr<KronReproduction>> cls(mod, "KronReproduction");
+
+    cls.def(py::init<KronFluxControl const &, std::string const &, afw::table::SourceRecord const &,
+                     afw::image::Exposure<float> const &, std::int64_t>(),
+            "ctrl"_a, "name"_a, "source"_a, "exposure"_a, "timeNs"_a = 0);
+
+    cls.def_static("readFile", &KronReproduction::readFile, "filename"_a);
+    cls.def("writeFile", &KronReproduction::writeFile, "filename"_a);
+    cls.def("replay", &KronReproduction::replay, "nRepeat"_a = 1);
+    cls.def("getControl", &KronReproduction::getControl, py::return_value_policy::copy);
+    cls.def("getName", &KronReproduction::getName);
+    cls.def("getId", &KronReproduction::getId);
+    cls.def("getTime", &KronReproduction::getTime);
+    cls.def("getBBox", &KronReproduction::getBBox);
+}
+
+void declareSyntheticGalaxies(py::module &mod) {
+    py::class_<SyntheticGalaxy> cls(mod, "SyntheticGalaxy");
+
+    cls.def(py::init([](double x, double y, double flux, double a, double b, double theta,
+                        double sersicIndex) {
+                return SyntheticGalaxy{x, y, flux, a, b, theta, sersicIndex};
+            }),
+            "x"_a, "y"_a, "flux"_a, "a"_a, "b"_a, "theta"_a = 0.0, "sersicIndex"_a = 0.0);
+    cls.def_readwrite("x", &SyntheticGalaxy::x);
+    cls.def_readwrite("y", &SyntheticGalaxy::y);
+    cls.def_readwrite("flux", &SyntheticGalaxy::flux);
+    cls.def_readwrite("a", &SyntheticGalaxy::a);
+    cls.def_readwrite("b", &SyntheticGalaxy::b);
+    cls.def_readwrite("theta", &SyntheticGalaxy::theta);
+    cls.def_readwrite("sersicIndex", &SyntheticGalaxy::sersicIndex);
+
+    mod.def("renderGalaxies", &renderGalaxies, "image"_a, "galaxies"_a, "nSubsample"_a = 5,
+            "subsampleRadius"_a = 3.0);
+    mod.def("makeSyntheticExposure", &makeSyntheticExposure, "bbox"_a, "galaxies"_a, "psf"_a,
+            "noiseSigma"_a = 0.0, "wcs"_a = nullptr, "seed"_a = 1, "nSubsample"_a = 5,
+            "subsampleRadius"_a = 3.0);
+    mod.def("makeRandomGalaxies", &makeRandomGalaxies, "bbox"_a, "nGalaxy"_a, "minFlux"_a = 100.0,
+            "maxFlux"_a = 1e5, "seed"_a = 1);
 }
 
 }  // <anonymous>
 
 PYBIND11_MODULE(photometryKron, mod) {
+    py::module::import("lsst.afw.detection");
     py::module::import("lsst.afw.geom");
     py::module::import("lsst.afw.image");
     py::module::import("lsst.afw.table");
     py::module::import("lsst.daf.base");
 
+    PYBIND11_NUMPY_DTYPE(KronBatchResult, radius, radiusForRadius, nIterForRadius, instFlux, instFluxErr,
+                         status, nBadPixels);
+    PYBIND11_NUMPY_DTYPE(KronApertureRecord, id, x, y, a, b, theta, radius);
+
     declareKronFluxControl(mod);
+    declareKronStatus(mod);
+    declareKronImagePyramid(mod);
     declareKronFluxAlgorithm(mod);
+    declareKronReproduction(mod);
     declareKronAperture(mod);
+    declareKronApertureTable(mod);
+    declareSyntheticGalaxies(mod);
+
+    mod.def("getKronKernelVariant", &getKronKernelVariant);
+    mod.def("setKronEdgeClassification", &setKronEdgeClassification, "enabled"_a);
 }
 
 }  // photometryKron
@@ -21,12 +21,28 @@
  * see <http://www.lsstcorp.org/LegalNotices/>.
  */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <cmath>
 #include <functional>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include "boost/algorithm/string.hpp"
 #include "boost/math/constants/constants.hpp"
 #include "lsst/pex/exceptions.h"
+#include "lsst/daf/base/PropertySet.h"
 #include "lsst/geom/Point.h"
 #include "lsst/geom/Box.h"
 #include "lsst/afw/geom/SpanSet.h"
@@ -35,14 +51,57 @@
 #include "lsst/afw/math/Integrate.h"
 #include "lsst/afw/math/FunctionLibrary.h"
 #include "lsst/afw/math/KernelFunctions.h"
+#include "lsst/afw/math/offsetImage.h"
 #include "lsst/afw/detection/Psf.h"
+#include "lsst/afw/detection/HeavyFootprint.h"
 #include "lsst/geom/AffineTransform.h"
 #include "lsst/afw/geom/ellipses.h"
 #include "lsst/meas/base.h"
 #include "lsst/meas/base/ApertureFlux.h"
+#include "lsst/meas/base/SincCoeffs.h"
 
 #include "lsst/meas/extensions/photometryKron.h"
 
+/*
+ * USDT (statically-defined tracing) probes for perf and bpftrace, with the provider lsst_photometryKron.
+ * They're only compiled in if LSST_KRON_USDT is defined (see lib/SConscript); each is then a nop until
+ * it's traced.  bpftrace has no floating point, so radii are in milli-pixels (-1 if NaN); pixel counts
+ * are the areas of the apertures.
+ *
+ *   measure__start(id, npix_footprint)               KronFluxAlgorithm::measure starts
+ *   measure__end(id, radius, npix_flux)              ... and succeeds
+ *   measure__fail(id, flag_bit)                      KronFluxAlgorithm::fail (flag_bit -1 if unknown)
+ *   radius__iteration(iter, radius_for_radius, radius, npix, bin_factor)
+ *                                                    each Kron radius iteration
+ *   flux__sinc(a, b)                                 the flux is measured with a sinc aperture
+ *   flux__summed(wanted_sinc, npix)                  ... by summing pixels (perhaps as the sinc's fallback)
+ *   fallback__radius(id, radius, used_psf)           the Kron radius failed; a fallback is used instead
+ *   minimum__radius(id, radius, new_radius)          the Kron radius is raised to the minimum
+ *   warm__start(id, accepted)                        a warm start was attempted
+ */
+#ifdef LSST_KRON_USDT
+#include <sys/sdt.h>
+#define KRON_PROBE(...) STAP_PROBEV(lsst_photometryKron, __VA_ARGS__)
+#else
+#define KRON_PROBE(...) do {} while (false)
+#endif
+
+/*
+ * The vectorised kernels are compiled for several instruction sets, and the best one that the CPU supports
+ * is chosen when the library's loaded (see getKronKernelVariant).  Each kernel is a struct with a static
+ * run() that's forced inline into one wrapper per instruction set, so the compiler vectorises it for that
+ * instruction set.  The kernels' lanes fix the order of the additions, and lib/SConscript compiles this file
+ * with -ffp-contract=off so that no variant fuses a*b + c into an FMA (which the AVX-512 variant would
+ * otherwise do), so all variants give the same results.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define KRON_HAVE_DISPATCH 1
+#define KRON_ALWAYS_INLINE __attribute__((always_inline)) inline
+#else
+#define KRON_HAVE_DISPATCH 0
+#define KRON_ALWAYS_INLINE inline
+#endif
+
 namespace lsst {
 namespace meas {
 namespace extensions {
@@ -50,6 +109,16 @@ namespace photometryKron {
 
 namespace {
 base::FlagDefinitionList flagDefinitions;
+
+// Convert a radius to a USDT probe argument
+inline std::int64_t probeRadius(double const radius) {
+    return std::isfinite(radius) ? std::llround(1000*radius) : -1;
+}
+
+// The number of pixels in an aperture of the given determinant radius, as a USDT probe argument
+inline std::int64_t probeArea(double const radius) {
+    return std::isfinite(radius) ? std::llround(geom::PI*radius*radius) : 0;
+}
 } // end anonymous
 
 base::FlagDefinition const KronFluxAlgorithm::FAILURE = flagDefinitions.addFailureFlag( "general failure flag, set if anything went wrong");
@@ -72,34 +141,426 @@ LSST_EXCEPTION_TYPE(BadKronException, pex::exceptions::RuntimeError,
 
 namespace {
 
-template <typename MaskedImageT>
-        class FootprintFlux {
+/*
+ * How to process pixels of each type
+ *
+ * Sums of pixel values are accumulated in Accumulator, using nLane independent partial sums so that the
+ * compiler can vectorise the loops without reordering the floating-point additions itself; nLane is
+ * the number of pixels in a 256-bit register.  Images are smoothed into images of SmoothedPixel.
+ */
+template <typename PixelT>
+struct KronPixelTraits;
+
+template <>
+struct KronPixelTraits<float> {
+    typedef double Accumulator;         // float loses precision for large apertures
+    typedef float SmoothedPixel;
+    static int const nLane = 8;
+};
+
+template <>
+struct KronPixelTraits<double> {
+    typedef double Accumulator;
+    typedef double SmoothedPixel;
+    static int const nLane = 4;
+};
+
+template <>
+struct KronPixelTraits<int> {
+    typedef std::int64_t Accumulator;   // exact
+    typedef float SmoothedPixel;
+    static int const nLane = 8;
+};
+
+template <>
+struct KronPixelTraits<std::uint16_t> {
+    typedef std::int64_t Accumulator;   // exact
+    typedef float SmoothedPixel;
+    static int const nLane = 16;
+};
+
+/*
+ * The instruction sets that the kernels are compiled for, in order of preference
+ */
+enum class KernelVariant { DEFAULT, AVX2, AVX512 };
+char const* const kernelVariantNames[] = {"default", "avx2", "avx512"};
+
+/*
+ * Choose the best variant that the CPU supports, or the one named by $LSST_KRON_KERNEL_VARIANT if the CPU
+ * supports that (an unknown or unsupported name is ignored)
+ */
+KernelVariant selectKernelVariant() {
+    KernelVariant best = KernelVariant::DEFAULT;
+#if KRON_HAVE_DISPATCH
+    __builtin_cpu_init();               // we may run before the CPU's been identified
+    if (__builtin_cpu_supports("avx2")) {
+        best = KernelVariant::AVX2;
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+            __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+            best = KernelVariant::AVX512;
+        }
+    }
+#endif
+    char const* requested = std::getenv("LSST_KRON_KERNEL_VARIANT");
+    if (requested) {
+        for (int i = 0; i <= static_cast<int>(best); ++i) {
+            if (std::strcmp(requested, kernelVariantNames[i]) == 0) {
+                return static_cast<KernelVariant>(i);
+            }
+        }
+    }
+    return best;
+}
+
+KernelVariant const kernelVariant = selectKernelVariant();
+
+#if KRON_HAVE_DISPATCH
+template <typename KernelT, typename... Args>
+__attribute__((target("avx2")))
+auto runKernelAvx2(Args&&... args) -> decltype(KernelT::run(std::forward<Args>(args)...)) {
+    return KernelT::run(std::forward<Args>(args)...);
+}
+
+template <typename KernelT, typename... Args>
+__attribute__((target("avx512f,avx512dq,avx512bw,avx512vl,prefer-vector-width=512")))
+auto runKernelAvx512(Args&&... args) -> decltype(KernelT::run(std::forward<Args>(args)...)) {
+    return KernelT::run(std::forward<Args>(args)...);
+}
+#endif
+
+/*
+ * Run KernelT::run(args...) compiled for the selected instruction set
+ */
+template <typename KernelT, typename... Args>
+auto runKernel(Args&&... args) -> decltype(KernelT::run(std::forward<Args>(args)...)) {
+#if KRON_HAVE_DISPATCH
+    switch (kernelVariant) {
+      case KernelVariant::AVX512:
+        return runKernelAvx512<KernelT>(std::forward<Args>(args)...);
+      case KernelVariant::AVX2:
+        return runKernelAvx2<KernelT>(std::forward<Args>(args)...);
+      case KernelVariant::DEFAULT:
+        break;
+    }
+#endif
+    return KernelT::run(std::forward<Args>(args)...);
+}
+
+/*
+ * Sum the image (and, if WithVariance, variance) pixels within spans (a SpanSet, or any other range of Spans)
+ */
+template <bool WithVariance, typename PixelT>
+struct SumSpans {
+    template <typename SpansT>
+    KRON_ALWAYS_INLINE static std::pair<double, double> run(
+        SpansT const& spans,                        // pixels to sum
+        KronMaskedPixelView<PixelT> const& image    // image to sum
+        );
+};
+
+template <bool WithVariance, typename PixelT>
+template <typename SpansT>
+std::pair<double, double> SumSpans<WithVariance, PixelT>::run(
+    SpansT const& spans,
+    KronMaskedPixelView<PixelT> const& image
+    )
+{
+    typedef KronPixelTraits<PixelT> Traits;
+    int const nLane = Traits::nLane;
+    typename Traits::Accumulator sum[nLane] = {};
+    double sumVar[nLane] = {};
+
+    KronPixelView<PixelT> const& pixels = image.getImage();
+    KronPixelView<afw::image::VariancePixel> const& variance = image.getVariance();
+    std::ptrdiff_t const colStride = pixels.getColStride(), varColStride = variance.getColStride();
+    for (auto const& span : spans) {
+        PixelT const* ptr = pixels.getPixel(span.getX0(), span.getY());
+        afw::image::VariancePixel const* varPtr = WithVariance ?
+            variance.getPixel(span.getX0(), span.getY()) : nullptr;
+        int const width = span.getWidth();
+        int i = 0;
+        for (; i + nLane <= width; i += nLane) {
+            for (int j = 0; j < nLane; ++j) {
+                sum[j] += ptr[(i + j)*colStride];
+                if (WithVariance) {
+                    sumVar[j] += varPtr[(i + j)*varColStride];
+                }
+            }
+        }
+        for (; i < width; ++i) {
+            sum[0] += ptr[i*colStride];
+            if (WithVariance) {
+                sumVar[0] += varPtr[i*varColStride];
+            }
+        }
+    }
+
+    return std::make_pair(static_cast<double>(std::accumulate(sum + 1, sum + nLane, sum[0])),
+                          WithVariance ? std::accumulate(sumVar + 1, sumVar + nLane, sumVar[0]) :
+                          std::numeric_limits<double>::quiet_NaN());
+}
+
+template <bool WithVariance, typename PixelT, typename SpansT>
+std::pair<double, double> sumSpans(
+    SpansT const& spans,                        // pixels to sum
+    KronMaskedPixelView<PixelT> const& image    // image to sum
+    )
+{
+    return runKernel<SumSpans<WithVariance, PixelT>>(spans, image);
+}
+
+/*
+ * The pixels to reject from a measurement, and what to do with them
+ */
+struct BadPixels {
+    KronPixelView<afw::image::MaskPixel> const* mask; // the mask plane (may be null)
+    afw::image::MaskPixel bits;                        // reject pixels with any of these bits set
+    bool replace;                                      // replace rejected pixels, rather than ignore them?
+
+    /// Are there any pixels to reject?
+    bool isActive() const { return mask && mask->getData() && bits != 0; }
+};
+
+BadPixels const NO_BAD_PIXELS = {nullptr, 0, false};
+
+/*
+ * The elliptical radius of a point:  the semi-major axis of the ellipse of the specified shape that passes
+ * through it
+ */
+class EllipticalRadius {
 public:
-    explicit FootprintFlux() : _sum(0.0), _sumVar(0.0) {}
+    EllipticalRadius(geom::Point2D const& center, // center of the ellipse
+                     double const ab,             // axis ratio
+                     double const theta           // rotation of ellipse +ve from x axis
+        ) : _xcen(center.getX()), _ycen(center.getY()), _ab(ab),
+            _cosTheta(::cos(theta)), _sinTheta(::sin(theta))
+        {}
 
-    /// @brief Reset everything for a new Footprint
+    double operator()(double const x, double const y) const {
+        double const dx = x - _xcen;
+        double const dy = y - _ycen;
+        double const du =  dx*_cosTheta + dy*_sinTheta;
+        double const dv = -dx*_sinTheta + dy*_cosTheta;
+
+        return ::hypot(du, dv*_ab);
+    }
+
+private:
+    double const _xcen;                 // center of object
+    double const _ycen;                 // center of object
+    double const _ab;                   // axis ratio
+    double const _cosTheta, _sinTheta;  // {cos,sin}(angle from x-axis)
+};
+
+/*
+ * Estimate the value of rejected pixels as the mean of the good pixels in the same unit-width elliptical
+ * annulus.
+ *
+ * Each rejected pixel i in annulus k contributes w1_i*<I>_k and w2_i*<I>_k (or w2_i*<Var>_k) to the
+ * measurement's sums, so it's enough to accumulate the weights of the rejected pixels and the sums of
+ * the good ones, which we can do in the same pass over the pixels.
+ */
+class AnnulusMeans {
+public:
+    void addGood(double const r, double const value, double const variance=0.0) {
+        Annulus & annulus = _get(r);
+        ++annulus.nGood;
+        annulus.sum += value;
+        annulus.sumVar += variance;
+    }
+
+    void addBad(double const r, double const w1, double const w2) {
+        Annulus & annulus = _get(r);
+        annulus.w1 += w1;
+        annulus.w2 += w2;
+    }
+
+    /*
+     * Return sum(w1 <I>), sum(w2 <I>) and sum(w2 <Var>) over the rejected pixels.  Annuli with no good
+     * pixels use the nearest annulus that has some, preferring the inner one
+     */
+    std::tuple<double, double, double> getReplacedSums() const {
+        double sum1 = 0, sum2 = 0, sum2Var = 0;
+        int const n = _annuli.size();
+        for (int k = 0; k < n; ++k) {
+            Annulus const& annulus = _annuli[k];
+            if (annulus.w1 == 0 && annulus.w2 == 0) {
+                continue;
+            }
+            for (int d = 0; d < n; ++d) {
+                Annulus const* good = (k - d >= 0 && _annuli[k - d].nGood > 0) ? &_annuli[k - d] :
+                    (k + d < n && _annuli[k + d].nGood > 0) ? &_annuli[k + d] : nullptr;
+                if (good) {
+                    sum1 += annulus.w1*good->sum/good->nGood;
+                    sum2 += annulus.w2*good->sum/good->nGood;
+                    sum2Var += annulus.w2*good->sumVar/good->nGood;
+                    break;
+                }
+            }
+        }
+        return std::make_tuple(sum1, sum2, sum2Var);
+    }
+
+private:
+    struct Annulus {
+        int nGood = 0;                  // number of good pixels
+        double sum = 0, sumVar = 0;     // sums of the good pixels' values and variances
+        double w1 = 0, w2 = 0;          // sums of the rejected pixels' weights
+    };
+
+    Annulus & _get(double const r) {
+        std::size_t const k = static_cast<std::size_t>(r);
+        if (k >= _annuli.size()) {
+            _annuli.resize(k + 1);
+        }
+        return _annuli[k];
+    }
+
+    std::vector<Annulus> _annuli;
+};
+
+/*
+ * Sum the (weighted) pixels of rows of an image, rejecting the pixels flagged in the mask as we go
+ */
+template <bool WithVariance, typename PixelT>
+class MaskedRowSum {
+public:
+    MaskedRowSum(KronMaskedPixelView<PixelT> const& image, // image to sum
+                 BadPixels const& bad,                      // pixels to reject
+                 afw::geom::ellipses::Ellipse const& aperture // aperture, defining the annuli for bad.replace
+        ) : _image(image), _bad(bad),
+            _radius(aperture.getCenter(), afw::geom::ellipses::Axes(aperture.getCore()).getA()/
+                    afw::geom::ellipses::Axes(aperture.getCore()).getB(),
+                    afw::geom::ellipses::Axes(aperture.getCore()).getTheta())
+        {}
+
+    /// Add width pixels starting at (x0, y), weighted by coeff[] (or 1 if coeff is null)
+    void operator()(int const x0, int const y, int const width, float const* coeff) {
+        PixelT const* ptr = _image.getImage().getPixel(x0, y);
+        afw::image::VariancePixel const* varPtr =
+            WithVariance ? _image.getVariance().getPixel(x0, y) : nullptr;
+        afw::image::MaskPixel const* maskPtr = _bad.mask->getPixel(x0, y);
+        std::ptrdiff_t const colStride = _image.getImage().getColStride();
+        std::ptrdiff_t const varColStride = _image.getVariance().getColStride();
+        std::ptrdiff_t const maskColStride = _bad.mask->getColStride();
+
+        if (_bad.replace) {             // we need the radius of every pixel, so there's no point in lanes
+            for (int i = 0; i < width; ++i) {
+                double const w = coeff ? coeff[i] : 1.0;
+                double const r = _radius(x0 + i, y);
+                if (maskPtr[i*maskColStride] & _bad.bits) {
+                    ++_nBad[0];
+                    _annuli.addBad(r, w, w*w);
+                } else {
+                    double const var = WithVariance ? varPtr[i*varColStride] : 0.0;
+                    _sum[0] += w*ptr[i*colStride];
+                    _sumVar[0] += w*w*var;
+                    _annuli.addGood(r, ptr[i*colStride], var);
+                }
+            }
+            return;
+        }
+
+        // Bad pixels are selected out rather than given zero weight, as they're often NaN (and 0*NaN is NaN)
+        int i = 0;
+        for (; i + nLane <= width; i += nLane) {
+            for (int j = 0; j < nLane; ++j) {
+                bool const isBad = maskPtr[(i + j)*maskColStride] & _bad.bits;
+                double const w = coeff ? coeff[i + j] : 1.0;
+                _sum[j] += isBad ? 0.0 : w*ptr[(i + j)*colStride];
+                if (WithVariance) {
+                    _sumVar[j] += isBad ? 0.0 : w*w*varPtr[(i + j)*varColStride];
+                }
+                _nBad[j] += isBad;
+            }
+        }
+        for (; i < width; ++i) {
+            bool const isBad = maskPtr[i*maskColStride] & _bad.bits;
+            double const w = coeff ? coeff[i] : 1.0;
+            _sum[0] += isBad ? 0.0 : w*ptr[i*colStride];
+            if (WithVariance) {
+                _sumVar[0] += isBad ? 0.0 : w*w*varPtr[i*varColStride];
+            }
+            _nBad[0] += isBad;
+        }
+    }
+
+    /// Return the sum and the sum of the variance (NaN if !WithVariance), including any replaced pixels
+    std::pair<double, double> getResult() const {
+        double sum = std::accumulate(_sum + 1, _sum + nLane, _sum[0]);
+        double sumVar = std::accumulate(_sumVar + 1, _sumVar + nLane, _sumVar[0]);
+        if (_bad.replace) {
+            double replaced, dummy, replacedVar;
+            std::tie(replaced, dummy, replacedVar) = _annuli.getReplacedSums();
+            sum += replaced;
+            sumVar += replacedVar;
+        }
+        return std::make_pair(sum, WithVariance ? sumVar : std::numeric_limits<double>::quiet_NaN());
+    }
+
+    /// Return the number of rejected pixels
+    int getNBad() const { return std::accumulate(_nBad + 1, _nBad + nLane, _nBad[0]); }
+
+    /// Forget all the pixels added so far
     void reset() {
-        _sum = _sumVar = 0.0;
+        std::fill(_sum, _sum + nLane, 0.0);
+        std::fill(_sumVar, _sumVar + nLane, 0.0);
+        std::fill(_nBad, _nBad + nLane, 0);
+        _annuli = AnnulusMeans();
     }
-    void reset(afw::detection::Footprint const&) {}
 
-    /// @brief method called for each pixel by applyFunctor
-    void operator()(geom::Point2I const & pos,
-                    typename MaskedImageT::Image::Pixel const & ival,
-                    typename MaskedImageT::Variance::Pixel const & vval) {
-        _sum += ival;
-        _sumVar += vval;
+private:
+    static int const nLane = KronPixelTraits<PixelT>::nLane;
+
+    KronMaskedPixelView<PixelT> const& _image;
+    BadPixels const& _bad;
+    EllipticalRadius const _radius;
+    double _sum[nLane] = {}, _sumVar[nLane] = {};
+    int _nBad[nLane] = {};
+    AnnulusMeans _annuli;
+};
+
+/*
+ * Policies for FootprintFindMoment's elliptical radius of a pixel at (dx, dy) from the centre of an
+ * aperture of axis ratio ab and position angle theta.  The cheaper ones are only valid for the apertures
+ * that withCheapestMoment chooses them for
+ */
+class RotatedRadius {                   // any ellipse
+public:
+    RotatedRadius(double const ab, double const theta) :
+        _ab(ab), _cosTheta(::cos(theta)), _sinTheta(::sin(theta)) {}
+
+    KRON_ALWAYS_INLINE double operator()(double const dx, double const dy) const {
+        double const du =  dx*_cosTheta + dy*_sinTheta;
+        double const dv = (-dx*_sinTheta + dy*_cosTheta)*_ab;
+        return std::sqrt(du*du + dv*dv);
     }
 
-    /// Return the Footprint's flux
-    double getSum() const { return _sum; }
+private:
+    double const _ab;                   // axis ratio
+    double const _cosTheta, _sinTheta;  // {cos,sin}(angle from x-axis)
+};
+
+class AlignedRadius {                   // an ellipse with its major axis along x (theta == 0)
+public:
+    AlignedRadius(double const ab, double const) : _ab(ab) {}
 
-    /// Return the variance of the Footprint's flux
-    double getSumVar() const { return _sumVar; }
+    KRON_ALWAYS_INLINE double operator()(double const dx, double const dy) const {
+        double const dv = dy*_ab;
+        return std::sqrt(dx*dx + dv*dv);
+    }
 
 private:
-    double _sum;
-    double _sumVar;
+    double const _ab;                   // axis ratio
+};
+
+class CircularRadius {                  // a circle (ab == 1)
+public:
+    CircularRadius(double const, double const) {}
+
+    KRON_ALWAYS_INLINE double operator()(double const dx, double const dy) const {
+        return std::sqrt(dx*dx + dy*dy);
+    }
 };
 
 /************************************************************************************************************/
@@ -113,59 +574,47 @@ private:
 /// In other words, it's the length of the major axis of the ellipse of specified shape that passes through
 /// the point
 ///
-template <typename MaskedImageT, typename WeightImageT>
+/// RadiusT computes that radius (see RotatedRadius), and CentralCorrection enables the correction to the
+/// radius of a pixel within 0.5 pixels of the centre (see getRadius); the defaults are always valid
+///
+template <typename PixelT, typename RadiusT=RotatedRadius, bool CentralCorrection=true>
 class FootprintFindMoment {
 public:
-    FootprintFindMoment(MaskedImageT const& mimage, ///< The image the source lives in
-                        geom::Point2D const& center, // center of the object
+    typedef PixelT Pixel;
+
+    FootprintFindMoment(geom::Point2D const& center, // center of the object
                         double const ab,                // axis ratio
                         double const theta // rotation of ellipse +ve from x axis
         ) : _xcen(center.getX()), _ycen(center.getY()),
-                           _ab(ab),
-                           _cosTheta(::cos(theta)),
-                           _sinTheta(::sin(theta)),
-                           _sum(0.0), _sumR(0.0),
+                           _radius(ab, theta),
 #if 0
                            _sumVar(0.0), _sumRVar(0.0),
 #endif
-                           _imageX0(mimage.getX0()), _imageY0(mimage.getY0())
+                           _sum(0.0), _sumR(0.0)
         {}
 
     /// @brief Reset everything for a new Footprint
-    void reset() {}
-    void reset(afw::detection::Footprint const& foot) {
+    void reset() {
         _sum = _sumR = 0.0;
 #if 0
         _sumVar = _sumRVar = 0.0;
 #endif
-
-        MaskedImageT const& mimage = this->getImage();
-        geom::Box2I const& bbox(foot.getBBox());
-        int const x0 = bbox.getMinX(), y0 = bbox.getMinY(), x1 = bbox.getMaxX(), y1 = bbox.getMaxY();
-
-        if (x0 < _imageX0 || y0 < _imageY0 ||
-            x1 >= _imageX0 + mimage.getWidth() || y1 >= _imageY0 + mimage.getHeight()) {
-            throw LSST_EXCEPT(lsst::pex::exceptions::OutOfRangeError,
-                              (boost::format("Footprint %d,%d--%d,%d doesn't fit in image %d,%d--%d,%d")
-                               % x0 % y0 % x1 % y1
-                               % _imageX0 % _imageY0
-                               % (_imageX0 + mimage.getWidth() - 1) % (_imageY0 + mimage.getHeight() - 1)
-                              ).str());
-        }
     }
 
     /// @brief method called for each pixel by applyFunctor
-    void operator()(geom::Point2I const & pos, typename MaskedImageT::Image::Pixel const & ival) {
+    void operator()(geom::Point2I const & pos, PixelT const & ival) {
+        add(getRadius(pos), ival);
+    }
+
+    /// Return the elliptical radius to use for the pixel at pos
+    double getRadius(geom::Point2I const & pos) const {
         double x = static_cast<double>(pos.getX());
         double y = static_cast<double>(pos.getY());
         double const dx = x - _xcen;
         double const dy = y - _ycen;
-        double const du =  dx*_cosTheta + dy*_sinTheta;
-        double const dv = -dx*_sinTheta + dy*_cosTheta;
 
-        double r = ::hypot(du, dv*_ab); // ellipsoidal radius
-#if 1
-        if (::hypot(dx, dy) < 0.5) {    // within a pixel of the centre
+        double r = _radius(dx, dy);     // ellipsoidal radius
+        if (CentralCorrection && ::hypot(dx, dy) < 0.5) { // within a pixel of the centre
             /*
              * We gain significant precision for flattened Gaussians by treating the central pixel specially
              *
@@ -180,8 +629,11 @@ public:
             double const eR = 0.38259771140356325; // <r> for a single square pixel, about the centre
             r = ::hypot(r, eR*(1 + ::hypot(dx, dy)/geom::ROOT2));
         }
-#endif
+        return r;
+    }
 
+    /// Add a pixel with value ival at elliptical radius r
+    void add(double const r, double const ival) {
         _sum += ival;
         _sumR += r*ival;
 #if 0
@@ -191,6 +643,32 @@ public:
 #endif
     }
 
+    /// Add the width pixels ptr[0], ptr[colStride], ... at (x0, y), (x0 + 1, y), ...
+    ///
+    /// Rows away from the central pixel are summed in nLane lanes, with r computed inline, so that the
+    /// loop vectorises
+    KRON_ALWAYS_INLINE void addRow(int const x0, int const y, int const width, PixelT const* ptr,
+                                   std::ptrdiff_t const colStride) {
+        _addRow<false>(x0, y, width, ptr, colStride, nullptr, 0, 0);
+    }
+
+    /// As addRow, but skip the pixels whose mask (maskPtr[0], maskPtr[maskColStride], ...) has any of bits
+    /// set; they're selected out rather than given zero weight, as they may be NaN
+    KRON_ALWAYS_INLINE void addMaskedRow(int const x0, int const y, int const width, PixelT const* ptr,
+                                         std::ptrdiff_t const colStride,
+                                         afw::image::MaskPixel const* maskPtr,
+                                         std::ptrdiff_t const maskColStride,
+                                         afw::image::MaskPixel const bits) {
+        _addRow<true>(x0, y, width, ptr, colStride, maskPtr, maskColStride, bits);
+    }
+
+
+    /// Add the contributions sum(I) and sum(r*I) of pixels that we've estimated rather than measured
+    void addSums(double const sum, double const sumR) {
+        _sum += sum;
+        _sumR += sumR;
+    }
+
     /// Return the Footprint's <r_elliptical>
     double getIr() const { return _sumR/_sum; }
 
@@ -204,163 +682,1970 @@ public:
     bool getGood() const { return _sum > 0 && _sumR > 0; }
 
 private:
+    template <bool Masked>
+    KRON_ALWAYS_INLINE void _addRow(int const x0, int const y, int const width, PixelT const* ptr,
+                                    std::ptrdiff_t const colStride, afw::image::MaskPixel const* maskPtr,
+                                    std::ptrdiff_t const maskColStride, afw::image::MaskPixel const bits) {
+        auto isBad = [&](int const i) { return Masked && (maskPtr[i*maskColStride] & bits); };
+        double const dy = y - _ycen;
+        if (CentralCorrection && ::fabs(dy) < 0.5) { // the row may contain the central pixel
+            for (int i = 0; i < width; ++i) {
+                if (!isBad(i)) {
+                    add(getRadius(geom::Point2I(x0 + i, y)), ptr[i*colStride]);
+                }
+            }
+            return;
+        }
+
+        int const nLane = KronPixelTraits<PixelT>::nLane;
+        double sum[nLane] = {}, sumR[nLane] = {};
+        double const dx0 = x0 - _xcen;
+        auto addPixel = [&](int const i, int const lane) {
+            double const r = _radius(dx0 + i, dy);
+            double const ival = ptr[i*colStride];
+            bool const bad = isBad(i);
+            sum[lane] += bad ? 0.0 : ival;
+            sumR[lane] += bad ? 0.0 : r*ival;
+        };
+        int i = 0;
+        for (; i + nLane <= width; i += nLane) {
+            for (int j = 0; j < nLane; ++j) {
+                addPixel(i + j, j);
+            }
+        }
+        for (; i < width; ++i) {
+            addPixel(i, 0);
+        }
+        _sum += std::accumulate(sum + 1, sum + nLane, sum[0]);
+        _sumR += std::accumulate(sumR + 1, sumR + nLane, sumR[0]);
+    }
+
     double const _xcen;                 // center of object
     double const _ycen;                 // center of object
-    double const _ab;                   // axis ratio
-    double const _cosTheta, _sinTheta;  // {cos,sin}(angle from x-axis)
+    RadiusT const _radius;              // elliptical radius of a pixel
     double _sum;                        // sum of I
     double _sumR;                       // sum of R*I
 #if 0
     double _sumVar;                     // sum of Var(I)
     double _sumRVar;                    // sum of R*R*Var(I)
 #endif
-    int const _imageX0, _imageY0;       // origin of image we're measuring
-
 };
-} // end anonymous namespace
-
-afw::geom::ellipses::Axes KronAperture::getKronAxes(
-    afw::geom::ellipses::Axes const& shape,
-    geom::LinearTransform const& transformation,
-    double const radius
-    )
-{
-    afw::geom::ellipses::Axes axes(shape);
-    axes.scale(radius/axes.getDeterminantRadius());
-    return axes.transform(transformation);
-}
 
-template<typename ImageT>
-std::shared_ptr<KronAperture> KronAperture::determineRadius(
-    ImageT const& image,
-    afw::geom::ellipses::Axes axes,
-    geom::Point2D const& center,
-    KronFluxControl const& ctrl
-    )
-{
-    //
-    // We might smooth the image because this is what SExtractor and Pan-STARRS do.  But I don't see much gain
-    //
-    double const sigma = ctrl.smoothingSigma; // Gaussian width of smoothing sigma to apply
-    bool const smoothImage = sigma > 0;
-    int kSize = smoothImage ? 2*int(2*sigma) + 1 : 1;
-    afw::math::GaussianFunction1<afw::math::Kernel::Pixel> gaussFunc(smoothImage ? sigma : 100);
-    afw::math::SeparableKernel kernel(kSize, kSize, gaussFunc, gaussFunc);
-    bool const doNormalize = true, doCopyEdge = false;
-    afw::math::ConvolutionControl convCtrl(doNormalize, doCopyEdge);
-    double radius0 = axes.getDeterminantRadius();
-    double radius = std::numeric_limits<double>::quiet_NaN();
-    float radiusForRadius = std::nanf("");
-    for (int i = 0; i < ctrl.nIterForRadius; ++i) {
-        axes.scale(ctrl.nSigmaForRadius);
-        radiusForRadius = axes.getDeterminantRadius(); // radius we used to estimate R_K
-        //
-        // Build an elliptical Footprint of the proper size
-        //
-        afw::detection::Footprint foot(afw::geom::SpanSet::fromShape(
-            afw::geom::ellipses::Ellipse(axes, center)));
-        geom::Box2I bbox = !smoothImage ?
-            foot.getBBox() :
-            kernel.growBBox(foot.getBBox()); // the smallest bbox needed to convolve with Kernel
-        bbox.clip(image.getBBox());
-        ImageT subImage(image, bbox, afw::image::PARENT, smoothImage);
-        if (smoothImage) {
-            afw::math::convolve(subImage, ImageT(image, bbox, afw::image::PARENT, false), kernel, convCtrl);
+/*
+ * Add the pixels within spans (a SpanSet, or any other range of Spans) to a FootprintFindMoment
+ */
+template <typename MomentT>
+struct SumMomentSpans {
+    template <typename SpansT>
+    KRON_ALWAYS_INLINE static void run(
+        SpansT const& spans,                                    // pixels to add
+        MomentT & functor,                                      // the moment to accumulate
+        KronPixelView<typename MomentT::Pixel> const& image     // image to measure
+        )
+    {
+        for (auto const& span : spans) {
+            int const y = span.getY();
+            functor.addRow(span.getX0(), y, span.getWidth(), image.getPixel(span.getX0(), y),
+                           image.getColStride());
         }
-        //
-        // Find the desired first moment of the elliptical radius, which corresponds to the major axis.
-        //
-        FootprintFindMoment<ImageT, afw::detection::Psf::Image> iRFunctor(
-            subImage, center, axes.getA()/axes.getB(), axes.getTheta()
-        );
+    }
+};
 
-        try {
-            foot.getSpans()->applyFunctor(
-                iRFunctor, *(subImage.getImage()));
-        } catch(lsst::pex::exceptions::OutOfRangeError &e) {
-            if (i == 0) {
-                LSST_EXCEPT_ADD(e, "Determining Kron aperture");
+/*
+ * Add the pixels within spans to a FootprintFindMoment, skipping those with any of bits set in mask;
+ * pixels outside mask's bbox (which is smaller than image's if image was smoothed) are taken to be good
+ */
+template <typename MomentT>
+struct SumMaskedMomentSpans {
+    template <typename SpansT>
+    KRON_ALWAYS_INLINE static void run(
+        SpansT const& spans,                                    // pixels to add
+        MomentT & functor,                                      // the moment to accumulate
+        KronPixelView<typename MomentT::Pixel> const& image,    // image to measure
+        KronPixelView<afw::image::MaskPixel> const& mask,       // mask to check
+        afw::image::MaskPixel const bits                        // reject pixels with any of these bits set
+        )
+    {
+        geom::Box2I const& maskBBox = mask.getBBox();
+        std::ptrdiff_t const colStride = image.getColStride(), maskColStride = mask.getColStride();
+        auto addRow = [&](int const x0, int const x1, int const y) { // [x0, x1], unmasked
+            if (x1 >= x0) {
+                functor.addRow(x0, y, x1 - x0 + 1, image.getPixel(x0, y), colStride);
             }
-            break;                      // use the radius we have
-        }
-
-        if (!iRFunctor.getGood()) {
-            throw LSST_EXCEPT(BadKronException, "Bad integral defining Kron radius");
-        }
-
-        radius = iRFunctor.getIr()*sqrt(axes.getB()/axes.getA());
-        if (radius <= radius0) {
-            break;
-        }
-        radius0 = radius;
-
-        axes.scale(radius/axes.getDeterminantRadius()); // set axes to our current estimate of R_K
-
-        if (radius > ctrl.maxRadius) {
-            throw LSST_EXCEPT(BadKronException, "Kron radius too large");
+        };
+        for (auto const& span : spans) {
+            int const y = span.getY();
+            if (y < maskBBox.getMinY() || y > maskBBox.getMaxY()) {
+                addRow(span.getX0(), span.getX1(), y);
+                continue;
+            }
+            int const mx0 = std::max(span.getX0(), maskBBox.getMinX());
+            int const mx1 = std::min(span.getX1(), maskBBox.getMaxX());
+            addRow(span.getX0(), std::min(span.getX1(), mx0 - 1), y);
+            if (mx1 >= mx0) {
+                functor.addMaskedRow(mx0, y, mx1 - mx0 + 1, image.getPixel(mx0, y), colStride,
+                                     mask.getPixel(mx0, y), maskColStride, bits);
+            }
+            addRow(std::max(span.getX0(), mx1 + 1), span.getX1(), y);
         }
-
-        iRFunctor.reset();
     }
+};
 
-    return std::make_shared<KronAperture>(center, axes, radiusForRadius);
+template <typename PixelT, typename RadiusT, typename FuncT>
+KronStatus withMoment(geom::Point2D const& center, double const ab, double const theta,
+                      bool const centralCorrection, FuncT const& func) {
+    if (centralCorrection) {
+        FootprintFindMoment<PixelT, RadiusT, true> moment(center, ab, theta);
+        return func(moment);
+    }
+    FootprintFindMoment<PixelT, RadiusT, false> moment(center, ab, theta);
+    return func(moment);
 }
 
-// Photometer an image with a particular aperture
-template<typename ImageT>
-std::pair<double, double> photometer(
-    ImageT const& image, // Image to measure
-    afw::geom::ellipses::Ellipse const& aperture, // Aperture in which to measure
-    double const maxSincRadius // largest radius that we use sinc apertures to measure
+/*
+ * Return the axis ratio and position angle with which to measure the moment of an aperture
+ *
+ * Measured shapes are never exactly round or aligned with the x-axis, so we round (ab, theta) to (1, 0)
+ * or (ab, 0) if that changes no pixel's elliptical radius by more than a fraction tolerance (so that, for
+ * a non-negative image, <r> is also within tolerance).  A circle's radius is within a factor ab of the
+ * ellipse's, and rotating an ellipse by dtheta changes the log of its radius by at most
+ * |ab - 1/ab|/2*|dtheta|
+ */
+std::pair<double, double> getMomentShape(
+    double const ab,                    // axis ratio
+    double const theta,                 // rotation of the aperture +ve from x axis
+    double const tolerance              // largest acceptable fractional error in a pixel's radius
     )
 {
+    if (std::fabs(ab - 1) <= tolerance) {
+        return std::make_pair(1.0, 0.0);
+    }
+    double const dtheta = std::remainder(theta, geom::PI); // theta and theta + pi are the same ellipse
+    if (0.5*std::fabs(ab - 1/ab)*std::fabs(dtheta) <= tolerance) {
+        return std::make_pair(ab, 0.0);
+    }
+    return std::make_pair(ab, theta);
+}
+
+/*
+ * Return func(moment), where moment is the cheapest FootprintFindMoment that's valid for an aperture
+ * with the shape chosen by getMomentShape
+ *
+ * Circles need neither the axis ratio nor the rotation, and ellipses with theta == 0 don't need the
+ * rotation; and the central-pixel correction is only needed if some pixel's centre lies within 0.5
+ * pixels of the aperture's centre, in which case it's the nearest pixel
+ */
+template <typename PixelT, typename FuncT>
+KronStatus withCheapestMoment(
+    geom::Point2D const& center,        // centre of the aperture
+    double const abIn,                  // axis ratio
+    double const thetaIn,               // rotation of the aperture +ve from x axis
+    double const tolerance,             // largest acceptable fractional error in a pixel's radius
+    FuncT const& func                   // called with the FootprintFindMoment
+    )
+{
+    bool const centralCorrection = ::hypot(center.getX() - std::round(center.getX()),
+                                           center.getY() - std::round(center.getY())) < 0.5;
+    double ab, theta;
+    std::tie(ab, theta) = getMomentShape(abIn, thetaIn, tolerance);
+    if (ab == 1) {
+        return withMoment<PixelT, CircularRadius>(center, ab, theta, centralCorrection, func);
+    } else if (theta == 0) {
+        return withMoment<PixelT, AlignedRadius>(center, ab, theta, centralCorrection, func);
+    }
+    return withMoment<PixelT, RotatedRadius>(center, ab, theta, centralCorrection, func);
+}
+
+/// Provide uniform access to the pixels of MaskedImages and views of them
+template <typename PixelT>
+KronMaskedPixelView<PixelT> asView(afw::image::MaskedImage<PixelT> const& mimage) {
+    return KronMaskedPixelView<PixelT>(mimage);
+}
+
+template <typename PixelT>
+KronMaskedPixelView<PixelT> const& asView(KronMaskedPixelView<PixelT> const& view) {
+    return view;
+}
+
+/// Return the binned image plane of a MaskedImage or a view of one
+template <typename PixelT>
+std::shared_ptr<KronImagePyramid::Level const> getBinnedLevel(
+    KronImagePyramid & pyramid,
+    afw::image::MaskedImage<PixelT> const& mimage,
+    int binFactor
+    )
+{
+    return pyramid.getLevel<PixelT>(mimage.getImage(), binFactor);
+}
+
+template <typename PixelT>
+std::shared_ptr<KronImagePyramid::Level const> getBinnedLevel(
+    KronImagePyramid & pyramid,
+    KronMaskedPixelView<PixelT> const& view,
+    int binFactor
+    )
+{
+    return pyramid.getLevel(view.getImage(), binFactor);
+}
+
+/*
+ * Where an elliptical aperture lies with respect to an image, as far as we can tell without rasterising it
+ */
+enum class EdgeClass {
+    INSIDE,                             // All the aperture's pixels are in the image
+    OUTSIDE,                            // Some of the aperture's pixels are off the image
+    BORDERLINE                          // We need to build the SpanSet to find out
+};
+
+/*
+ * Whether classifyAperture classifies apertures, or calls them all BORDERLINE (see setKronEdgeClassification)
+ */
+std::atomic<bool> edgeClassification(true);
+
+/*
+ * Classify an aperture with respect to bbox, using only its analytic bounding box
+ *
+ * The pixels in an aperture are those whose centres lie within the ellipse, so the aperture lies in the
+ * image if the integer points within the ellipse's bounding box do.  Conversely, the ellipse shrunk by
+ * a factor s towards its extreme point in (say) x lies within the ellipse (it's convex), and contains a
+ * circle of radius s*b about its centre; if s*b >= sqrt(1/2) that circle contains a pixel centre, which
+ * is off the image if the circle's leftmost point is.
+ */
+EdgeClass classifyAperture(
+    afw::geom::ellipses::Ellipse const& ellipse, // the aperture
+    geom::Box2I const& bbox                      // the image's bounding box
+    )
+{
+    if (!edgeClassification.load(std::memory_order_relaxed)) {
+        return EdgeClass::BORDERLINE;
+    }
+    geom::Box2D const ellipseBBox = ellipse.computeBBox();
+    double const xmin = ellipseBBox.getMinX(), xmax = ellipseBBox.getMaxX();
+    double const ymin = ellipseBBox.getMinY(), ymax = ellipseBBox.getMaxY();
+    if (std::ceil(xmin) >= bbox.getMinX() && std::floor(xmax) <= bbox.getMaxX() &&
+        std::ceil(ymin) >= bbox.getMinY() && std::floor(ymax) <= bbox.getMaxY()) {
+        return EdgeClass::INSIDE;
+    }
+
+    double const rCover = M_SQRT1_2;    // any circle this large contains a pixel centre
+    double const b = afw::geom::ellipses::Axes(ellipse.getCore()).getB();
+    if (b >= rCover) {
+        double const s = rCover/b;
+        // The centres of the shrunken ellipses are the extreme points moved inwards by (1 - s) times
+        // the bounding box's half-width, as the extreme points are (1 - s) times as far from the centre
+        double const dx = 0.5*(1 - s)*(xmax - xmin) - rCover;
+        double const dy = 0.5*(1 - s)*(ymax - ymin) - rCover;
+        double const xc = 0.5*(xmin + xmax), yc = 0.5*(ymin + ymax);
+        if (xc + dx > bbox.getMaxX() || xc - dx < bbox.getMinX() ||
+            yc + dy > bbox.getMaxY() || yc - dy < bbox.getMinY()) {
+            return EdgeClass::OUTSIDE;
+        }
+    }
+
+    return EdgeClass::BORDERLINE;
+}
+
+/*
+ * Accumulate the first moment of the elliptical radius, <r>, over spans in a FootprintFindMoment
+ */
+template <typename MomentT, typename PixelT>
+KronStatus accumulateFirstMoment(
+    afw::geom::SpanSet const& spans,            // The pixels in the aperture
+    KronPixelView<PixelT> const& image,         // Image to measure
+    MomentT & iRFunctor,                        // the moment to accumulate
+    double & iR,                                // the desired <r>
+    BadPixels const& bad                        // pixels to reject
+    )
+{
+    if (!bad.isActive()) {
+        runKernel<SumMomentSpans<MomentT>>(spans, iRFunctor, image);
+    } else if (!bad.replace) {
+        runKernel<SumMaskedMomentSpans<MomentT>>(spans, iRFunctor, image, *bad.mask, bad.bits);
+    } else {                            // we need the radius of every bad pixel, so there's no point in lanes
+        AnnulusMeans annuli;
+        geom::Box2I const& maskBBox = bad.mask->getBBox(); // may be smaller than image if it was smoothed
+        std::ptrdiff_t const colStride = image.getColStride();
+        for (auto const& span : spans) {
+            int const y = span.getY();
+            PixelT const* ptr = image.getPixel(span.getX0(), y);
+            for (int x = span.getX0(); x <= span.getX1(); ++x, ptr += colStride) {
+                geom::Point2I const pos(x, y);
+                double const r = iRFunctor.getRadius(pos);
+                if (!maskBBox.contains(pos) || !((*bad.mask)(x, y) & bad.bits)) {
+                    iRFunctor.add(r, *ptr);
+                    annuli.addGood(r, *ptr);
+                } else {
+                    annuli.addBad(r, 1.0, r);
+                }
+            }
+        }
+        double sum, sumR, dummy;
+        std::tie(sum, sumR, dummy) = annuli.getReplacedSums();
+        iRFunctor.addSums(sum, sumR);
+    }
+
+    if (!iRFunctor.getGood()) {
+        return KronStatus::BAD_INTEGRAL;
+    }
+    iR = iRFunctor.getIr();
+    return KronStatus::OK;
+}
+
+/*
+ * Compute the first moment of the elliptical radius, <r>, over spans
+ */
+template <typename PixelT>
+KronStatus computeFirstMoment(
+    afw::geom::SpanSet const& spans,            // The pixels in the aperture
+    KronPixelView<PixelT> const& image,         // Image to measure
+    afw::geom::ellipses::Axes const& axes,      // Shape of the aperture
+    geom::Point2D const& center,                // Centre of the aperture
+    double const shapeTolerance,                // see withCheapestMoment's tolerance
+    double & iR,                                // the desired <r>
+    BadPixels const& bad                        // pixels to reject
+    )
+{
+    //
+    // Find the desired first moment of the elliptical radius, which corresponds to the major axis.
+    //
+    return withCheapestMoment<PixelT>(center, axes.getA()/axes.getB(), axes.getTheta(), shapeTolerance,
+                                      [&](auto & iRFunctor) {
+                                          return accumulateFirstMoment(spans, image, iRFunctor, iR, bad);
+                                      });
+}
+
+/*
+ * Find the first moment of the elliptical radius, <r>, within an elliptical aperture, optionally smoothing
+ * the image with a N(0, sigma^2) Gaussian first.  The pixels specified by bad are rejected (or replaced)
+ * after smoothing.  Pixels within domain but not image are taken to be zero.
+ *
+ * Returns KronStatus::EDGE if the aperture doesn't fit in the domain, and KronStatus::BAD_INTEGRAL if
+ * the integral defining <r> can't be trusted.
+ */
+template <typename PixelT>
+KronStatus findFirstMoment(
+    KronPixelView<PixelT> const& image,         // Image to measure
+    geom::Box2I const& domain,                  // Bounding box of the image that image is part of
+    afw::geom::ellipses::Axes const& axes,      // Shape of the aperture
+    geom::Point2D const& center,                // Centre of the aperture
+    double const sigma,                         // Gaussian width of smoothing sigma to apply
+    double const shapeTolerance,                // see withCheapestMoment's tolerance
+    double & iR,                                // the desired <r>
+    BadPixels const& bad=NO_BAD_PIXELS          // pixels to reject (after smoothing)
+    )
+{
+    //
+    // Build an elliptical aperture of the proper size, and check that it fits
+    //
+    afw::geom::ellipses::Ellipse const ellipse(axes, center);
+    EdgeClass const edgeClass = classifyAperture(ellipse, domain);
+    if (edgeClass == EdgeClass::OUTSIDE) {
+        return KronStatus::EDGE;
+    }
+    std::shared_ptr<afw::geom::SpanSet> spans = afw::geom::SpanSet::fromShape(ellipse);
+    if (edgeClass == EdgeClass::BORDERLINE && !domain.contains(spans->getBBox())) {
+        return KronStatus::EDGE;
+    }
+    bool const smoothImage = sigma > 0;
+    if (smoothImage) {
+        int kSize = 2*int(2*sigma) + 1;
+        afw::math::GaussianFunction1<afw::math::Kernel::Pixel> gaussFunc(sigma);
+        afw::math::SeparableKernel kernel(kSize, kSize, gaussFunc, gaussFunc);
+        bool const doNormalize = true, doCopyEdge = false;
+        afw::math::ConvolutionControl convCtrl(doNormalize, doCopyEdge);
+
+        geom::Box2I bbox = kernel.growBBox(spans->getBBox()); // the smallest bbox needed to convolve
+        bbox.clip(domain);
+        // afw can only convolve its own images, so this is the one place that we copy the pixels
+        typedef typename KronPixelTraits<PixelT>::SmoothedPixel SmoothedPixel;
+        afw::image::Image<SmoothedPixel> region(bbox), smoothed(bbox);
+        geom::Box2I copied(bbox);       // the part of bbox that we have pixels for; the rest are zero
+        copied.clip(image.getBBox());
+        for (int y = copied.getMinY(); y <= copied.getMaxY(); ++y) {
+            PixelT const* ptr = image.getPixel(copied.getMinX(), y);
+            auto rptr = region.row_begin(y - bbox.getMinY()) + (copied.getMinX() - bbox.getMinX());
+            for (int i = 0; i < copied.getWidth(); ++i, ++rptr, ptr += image.getColStride()) {
+                *rptr = *ptr;
+            }
+        }
+        afw::math::convolve(smoothed, region, kernel, convCtrl);
+        return computeFirstMoment(*spans, KronPixelView<SmoothedPixel>(smoothed), axes, center,
+                                  shapeTolerance, iR, bad);
+    }
+
+    if (domain != image.getBBox()) {
+        spans = spans->clippedTo(image.getBBox()); // the other pixels are zero
+    }
+    return computeFirstMoment(*spans, image, axes, center, shapeTolerance, iR, bad);
+}
+
+/*
+ * Bin rows [y0, y1) x columns [x0, x1) of binned image from image, averaging over the pixels that exist
+ */
+template <typename PixelT>
+void binImageRegion(
+    KronPixelView<PixelT> const& image,         // full-resolution image
+    afw::image::Image<float> & binned,          // binned image
+    int const binFactor,                        // binning factor
+    geom::Box2I const& region                   // region of binned image to set
+    )
+{
+    int const width = image.getBBox().getWidth(), height = image.getBBox().getHeight();
+    int const imageX0 = image.getBBox().getMinX(), imageY0 = image.getBBox().getMinY();
+    std::ptrdiff_t const colStride = image.getColStride();
+    int const nx = region.getWidth();
+    std::vector<double> sum(nx);
+    for (int j = region.getMinY(); j <= region.getMaxY(); ++j) {
+        std::fill(sum.begin(), sum.end(), 0.0);
+        int const y0 = binFactor*j, y1 = std::min(y0 + binFactor, height);
+        int const x0 = binFactor*region.getMinX(), x1 = std::min(binFactor*(region.getMaxX() + 1), width);
+        for (int y = y0; y < y1; ++y) {
+            PixelT const* ptr = image.getPixel(imageX0 + x0, imageY0 + y);
+            for (int x = x0; x < x1; ++x, ptr += colStride) {
+                sum[x/binFactor - region.getMinX()] += *ptr;
+            }
+        }
+        auto bptr = binned.row_begin(j) + region.getMinX();
+        for (int i = 0; i < nx; ++i, ++bptr) {
+            int const xb0 = binFactor*(region.getMinX() + i);
+            int const npix = (std::min(xb0 + binFactor, width) - xb0)*(y1 - y0);
+            *bptr = sum[i]/npix;
+        }
+    }
+}
+
+} // end anonymous namespace
+
+afw::image::MaskPixel KronFluxControl::getBadPixelMask() const
+{
+    afw::image::MaskPixel bits = 0;
+    for (auto const& plane : badMaskPlanes) {
+        try {
+            bits |= afw::image::Mask<>::getPlaneBitMask(plane);
+        } catch (pex::exceptions::Exception &) {
+            // No pixel can be in a plane that doesn't exist
+        }
+    }
+    return bits;
+}
+
+afw::geom::ellipses::Axes KronAperture::getKronAxes(
+    afw::geom::ellipses::Axes const& shape,
+    geom::LinearTransform const& transformation,
+    double const radius
+    )
+{
+    afw::geom::ellipses::Axes axes(shape);
+    axes.scale(radius/axes.getDeterminantRadius());
+    return axes.transform(transformation);
+}
+
+template<typename PixelT>
+std::shared_ptr<KronImagePyramid::Level const> KronImagePyramid::getLevel(
+    std::shared_ptr<afw::image::Image<PixelT> const> const& image,
+    int binFactor
+    )
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::shared_ptr<void const> const source = _source.lock();
+    if (source != image) {
+        _sourceData = nullptr;          // force _getLevel to start again
+        _source = image;
+    }
+    return _getLevel(KronPixelView<PixelT>(*image), binFactor);
+}
+
+template<typename PixelT>
+std::shared_ptr<KronImagePyramid::Level const> KronImagePyramid::getLevel(
+    KronPixelView<PixelT> const& image,
+    int binFactor
+    )
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return _getLevel(image, binFactor);
+}
+
+template<typename PixelT>
+std::shared_ptr<KronImagePyramid::Level const> KronImagePyramid::_getLevel(
+    KronPixelView<PixelT> const& image,
+    int binFactor
+    )
+{
+    if (_sourceData != image.getData() || _sourceBBox != image.getBBox()) {
+        _levels.clear();
+        _pending = _previous = geom::Box2I();
+        _sourceData = image.getData();
+        _sourceBBox = image.getBBox();
+    }
+    //
+    // Rebin any regions that have changed since we last looked
+    //
+    if (!_pending.isEmpty()) {
+        for (auto & level : _levels) {
+            int const factor = level.first;
+            geom::Box2I region(geom::Point2I((_pending.getMinX() - _sourceBBox.getMinX())/factor,
+                                             (_pending.getMinY() - _sourceBBox.getMinY())/factor),
+                               geom::Point2I((_pending.getMaxX() - _sourceBBox.getMinX())/factor,
+                                             (_pending.getMaxY() - _sourceBBox.getMinY())/factor));
+            region.clip(level.second->getBBox());
+            if (!region.isEmpty()) {
+                binImageRegion(image, *level.second, factor, region);
+            }
+        }
+        _pending = geom::Box2I();
+    }
+
+    std::shared_ptr<Level> & level = _levels[binFactor];
+    if (!level) {
+        int const width = (_sourceBBox.getWidth() + binFactor - 1)/binFactor;
+        int const height = (_sourceBBox.getHeight() + binFactor - 1)/binFactor;
+        level = std::make_shared<Level>(width, height);
+        binImageRegion(image, *level, binFactor, level->getBBox());
+    }
+
+    return level;
+}
+
+void KronImagePyramid::markDirty(geom::Box2I const& bbox)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _pending.include(_previous);
+    _pending.include(bbox);
+    _pending.clip(_sourceBBox);
+    _previous = bbox;
+}
+
+void KronImagePyramid::reset()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _levels.clear();
+    _source.reset();
+    _sourceData = nullptr;
+    _sourceBBox = _pending = _previous = geom::Box2I();
+}
+
+namespace {
+/*
+ * Convert a KronStatus describing a failure to measure the Kron radius into the corresponding exception
+ */
+void throwBadRadius(KronStatus const status)
+{
+    switch (status) {
+      case KronStatus::BAD_INTEGRAL:
+        throw LSST_EXCEPT(BadKronException, "Bad integral defining Kron radius");
+      case KronStatus::RADIUS_TOO_LARGE:
+        throw LSST_EXCEPT(BadKronException, "Kron radius too large");
+      default:
+        break;
+    }
+}
+} // end anonymous namespace
+
+template<typename ImageT>
+KronStatus KronAperture::tryRefineRadius(
+    std::shared_ptr<KronAperture> & aperture,
+    ImageT const& image,
+    afw::geom::ellipses::Axes axes,
+    geom::Point2D const& center,
+    KronFluxControl const& ctrl
+    )
+{
+    aperture.reset();
+    axes.scale(ctrl.nSigmaForRadius);
+    float const radiusForRadius = axes.getDeterminantRadius(); // radius we used to estimate R_K
+
+    auto const& maskedView = asView(image);
+    BadPixels const bad = {&maskedView.getMask(), ctrl.getBadPixelMask(), ctrl.replaceBadPixels};
+    double iR = 0;
+    KronStatus const status = findFirstMoment(maskedView.getImage(), maskedView.getDomain(), axes, center,
+                                              ctrl.smoothingSigma, ctrl.momentShapeTolerance, iR, bad);
+    if (status != KronStatus::OK) {
+        return status;
+    }
+
+    double const radius = iR*sqrt(axes.getB()/axes.getA());
+    KRON_PROBE(radius__iteration, 0, probeRadius(radiusForRadius), probeRadius(radius),
+               probeArea(radiusForRadius), 1);
+    axes.scale(radius/axes.getDeterminantRadius()); // set axes to our estimate of R_K
+
+    if (radius > ctrl.maxRadius) {
+        return KronStatus::RADIUS_TOO_LARGE;
+    }
+
+    aperture = std::make_shared<KronAperture>(center, axes, radiusForRadius);
+    aperture->_nIterForRadius = 1;
+    return KronStatus::OK;
+}
+
+template<typename ImageT>
+std::shared_ptr<KronAperture> KronAperture::refineRadius(
+    ImageT const& image,
+    afw::geom::ellipses::Axes axes,
+    geom::Point2D const& center,
+    KronFluxControl const& ctrl
+    )
+{
+    std::shared_ptr<KronAperture> aperture;
+    throwBadRadius(tryRefineRadius(aperture, image, axes, center, ctrl));
+    return aperture;
+}
+
+template<typename ImageT>
+KronStatus KronAperture::tryDetermineRadius(
+    std::shared_ptr<KronAperture> & aperture,
+    ImageT const& image,
+    afw::geom::ellipses::Axes axes,
+    geom::Point2D const& center,
+    KronFluxControl const& ctrl,
+    KronImagePyramid * pyramid
+    )
+{
+    aperture.reset();
+    auto const& maskedView = asView(image);
+    auto const& view = maskedView.getImage();
+    BadPixels const bad = {&maskedView.getMask(), ctrl.getBadPixelMask(), ctrl.replaceBadPixels};
+    //
+    // We might smooth the image because this is what SExtractor and Pan-STARRS do.  But I don't see much gain
+    //
+    double const sigma = ctrl.smoothingSigma; // Gaussian width of smoothing sigma to apply
+    double radius0 = axes.getDeterminantRadius();
+    double radius = std::numeric_limits<double>::quiet_NaN();
+    float radiusForRadius = std::nanf("");
+    //
+    // If we're binning, carry out all but the last iteration on the binned image, and only
+    // refine the estimate at full resolution.  A single iteration is cheaper at full resolution
+    //
+    int const binFactor = (pyramid && ctrl.nIterForRadius > 1) ? ctrl.binFactorForRadius : 1;
+    if (binFactor > 1) {
+        std::shared_ptr<KronImagePyramid::Level const> binned = getBinnedLevel(*pyramid, image, binFactor);
+        KronPixelView<KronImagePyramid::Level::Pixel> const binnedView(*binned);
+        // binned pixel i is centred at full-resolution pixel x0 + f*i + (f - 1)/2
+        geom::Point2D const binnedCenter(
+            (center.getX() - view.getBBox().getMinX() - 0.5*(binFactor - 1))/binFactor,
+            (center.getY() - view.getBBox().getMinY() - 0.5*(binFactor - 1))/binFactor);
+
+        afw::geom::ellipses::Axes binnedAxes(axes); // in full-resolution pixels
+        int nIter = 0;
+        for (int i = 0; i < ctrl.nIterForRadius - 1; ++i) {
+            afw::geom::ellipses::Axes apertureAxes(binnedAxes); // in binned pixels
+            apertureAxes.scale(ctrl.nSigmaForRadius/binFactor);
+
+            double iR = 0;
+            if (findFirstMoment(binnedView, binnedView.getBBox(), apertureAxes, binnedCenter,
+                                sigma/binFactor, ctrl.momentShapeTolerance, iR) != KronStatus::OK) {
+                break;                  // use the full-resolution image
+            }
+            ++nIter;
+
+            double const forRadius = binFactor*apertureAxes.getDeterminantRadius();
+            double const r = binFactor*iR*sqrt(binnedAxes.getB()/binnedAxes.getA());
+            KRON_PROBE(radius__iteration, i, probeRadius(forRadius), probeRadius(r),
+                       probeArea(apertureAxes.getDeterminantRadius()), binFactor);
+            if (r > ctrl.maxRadius) {
+                return KronStatus::RADIUS_TOO_LARGE;
+            }
+            if (r <= radius0 && i > 0) {
+                break;                  // keep the previous estimate
+            }
+            // The first estimate is always used, so we refine it rather than starting again
+            radius = r;
+            radiusForRadius = forRadius;
+            binnedAxes.scale(r/binnedAxes.getDeterminantRadius()); // set axes to our current estimate of R_K
+            if (r <= radius0) {
+                break;
+            }
+            radius0 = r;
+        }
+
+        if (!std::isnan(radius)) {
+            KronStatus const status = tryRefineRadius(aperture, image, binnedAxes, center, ctrl);
+            if (status == KronStatus::EDGE) { // the final aperture didn't fit; use the binned estimate
+                if (radius > ctrl.maxRadius) {
+                    return KronStatus::RADIUS_TOO_LARGE;
+                }
+                aperture = std::make_shared<KronAperture>(center, binnedAxes, radiusForRadius);
+            } else if (status != KronStatus::OK) {
+                return status;
+            }
+            aperture->_binnedRadius = radius;
+            aperture->_nIterForRadius += nIter;
+            return KronStatus::OK;
+        }
+        radius0 = axes.getDeterminantRadius();
+    }
+
+    if (ctrl.radiusTolerance > 0) {
+        return tryConvergeRadius(aperture, image, axes, center, ctrl);
+    }
+
+    int nIter = 0;
+    for (int i = 0; i < ctrl.nIterForRadius; ++i) {
+        axes.scale(ctrl.nSigmaForRadius);
+        radiusForRadius = axes.getDeterminantRadius(); // radius we used to estimate R_K
+        //
+        // Find the desired first moment of the elliptical radius, which corresponds to the major axis.
+        //
+        double iR = 0;
+        KronStatus const status = findFirstMoment(view, maskedView.getDomain(), axes, center, sigma,
+                                                  ctrl.momentShapeTolerance, iR, bad);
+        if (status == KronStatus::EDGE) {
+            break;                      // use the radius we have
+        } else if (status != KronStatus::OK) {
+            return status;
+        }
+        ++nIter;
+
+        radius = iR*sqrt(axes.getB()/axes.getA());
+        KRON_PROBE(radius__iteration, i, probeRadius(radiusForRadius), probeRadius(radius),
+                   probeArea(radiusForRadius), 1);
+        if (radius <= radius0) {
+            break;
+        }
+        radius0 = radius;
+
+        axes.scale(radius/axes.getDeterminantRadius()); // set axes to our current estimate of R_K
+
+        if (radius > ctrl.maxRadius) {
+            return KronStatus::RADIUS_TOO_LARGE;
+        }
+    }
+
+    aperture = std::make_shared<KronAperture>(center, axes, radiusForRadius);
+    aperture->_nIterForRadius = nIter;
+    return KronStatus::OK;
+}
+
+template<typename ImageT>
+std::shared_ptr<KronAperture> KronAperture::determineRadius(
+    ImageT const& image,
+    afw::geom::ellipses::Axes axes,
+    geom::Point2D const& center,
+    KronFluxControl const& ctrl,
+    KronImagePyramid * pyramid
+    )
+{
+    std::shared_ptr<KronAperture> aperture;
+    throwBadRadius(tryDetermineRadius(aperture, image, axes, center, ctrl, pyramid));
+    return aperture;
+}
+
+template<typename ImageT>
+KronStatus KronAperture::tryConvergeRadius(
+    std::shared_ptr<KronAperture> & aperture,
+    ImageT const& image,
+    afw::geom::ellipses::Axes axes,
+    geom::Point2D const& center,
+    KronFluxControl const& ctrl
+    )
+{
+    aperture.reset();
+    //
+    // R_K is the fixed point of R = g(R), where g(R) is the Kron radius measured in an aperture
+    // of radius nSigmaForRadius*R.  We take one ordinary step, and then use the secant method
+    // on f(R) = g(R) - R, falling back to an ordinary step if the secant step looks unreasonable
+    //
+    auto const& maskedView = asView(image);
+    auto const& view = maskedView.getImage();
+    BadPixels const bad = {&maskedView.getMask(), ctrl.getBadPixelMask(), ctrl.replaceBadPixels};
+    float radiusForRadius = std::nanf("");
+    double x = axes.getDeterminantRadius(); // the current argument of g
+    double xPrev = std::numeric_limits<double>::quiet_NaN();
+    double fPrev = std::numeric_limits<double>::quiet_NaN();
+    int nIter = 0;
+    for (int i = 0; i < ctrl.nIterForRadius; ++i) {
+        afw::geom::ellipses::Axes apertureAxes(axes);
+        apertureAxes.scale(ctrl.nSigmaForRadius*x/apertureAxes.getDeterminantRadius());
+
+        double iR = 0;
+        KronStatus const status = findFirstMoment(view, maskedView.getDomain(), apertureAxes, center,
+                                                  ctrl.smoothingSigma, ctrl.momentShapeTolerance, iR, bad);
+        if (status == KronStatus::EDGE) {
+            if (i == 0) {
+                axes = apertureAxes;    // as returned by determineRadius's fixed iteration
+                radiusForRadius = apertureAxes.getDeterminantRadius();
+            }
+            break;                      // use the radius we have
+        } else if (status != KronStatus::OK) {
+            return status;
+        }
+        ++nIter;
+
+        radiusForRadius = apertureAxes.getDeterminantRadius(); // radius we used to estimate R_K
+        double const radius = iR*sqrt(apertureAxes.getB()/apertureAxes.getA());
+        KRON_PROBE(radius__iteration, i, probeRadius(radiusForRadius), probeRadius(radius),
+                   probeArea(radiusForRadius), 1);
+        axes.scale(radius/axes.getDeterminantRadius()); // set axes to our current estimate of R_K
+
+        if (radius > ctrl.maxRadius) {
+            return KronStatus::RADIUS_TOO_LARGE;
+        }
+
+        double const f = radius - x;
+        if (std::fabs(f) <= ctrl.radiusTolerance*radius) {
+            break;
+        }
+
+        double xNext = radius;          // an ordinary fixed-point step
+        if (!std::isnan(fPrev) && f != fPrev) {
+            double const secant = x - f*(x - xPrev)/(f - fPrev);
+            if (secant > 0.5*radius && secant < 2*radius) {
+                xNext = secant;
+            }
+        }
+        xPrev = x;
+        fPrev = f;
+        x = xNext;
+    }
+
+    aperture = std::make_shared<KronAperture>(center, axes, radiusForRadius);
+    aperture->_nIterForRadius = nIter;
+    return KronStatus::OK;
+}
+
+template<typename ImageT>
+std::shared_ptr<KronAperture> KronAperture::convergeRadius(
+    ImageT const& image,
+    afw::geom::ellipses::Axes axes,
+    geom::Point2D const& center,
+    KronFluxControl const& ctrl
+    )
+{
+    std::shared_ptr<KronAperture> aperture;
+    throwBadRadius(tryConvergeRadius(aperture, image, axes, center, ctrl));
+    return aperture;
+}
+
+/*
+ * Sum the image (and, if WithVariance, variance) pixels in bbox weighted by coeffs (and coeffs^2); bbox's
+ * first column is column cOffset of coeffs.  Returns the sum and the (unrooted) sum of the variance
+ */
+template <bool WithVariance, typename PixelT>
+struct SumWeightedRows {
+    KRON_ALWAYS_INLINE static std::pair<double, double> run(
+        KronMaskedPixelView<PixelT> const& image,   // image to sum
+        geom::Box2I const& bbox,                    // pixels to sum
+        afw::image::Image<float> const& coeffs,     // weights, covering at least bbox's rows
+        int const cOffset                           // column of coeffs corresponding to bbox.getMinX()
+        );
+};
+
+template <bool WithVariance, typename PixelT>
+std::pair<double, double> SumWeightedRows<WithVariance, PixelT>::run(
+    KronMaskedPixelView<PixelT> const& image,
+    geom::Box2I const& bbox,
+    afw::image::Image<float> const& coeffs,
+    int const cOffset
+    )
+{
+    int const nLane = KronPixelTraits<PixelT>::nLane;
+    double sum[nLane] = {}, sumVar[nLane] = {};
+
+    KronPixelView<PixelT> const& pixels = image.getImage();
+    KronPixelView<afw::image::VariancePixel> const& variance = image.getVariance();
+    std::ptrdiff_t const colStride = pixels.getColStride(), varColStride = variance.getColStride();
+    int const width = bbox.getWidth();
+    for (int y = bbox.getMinY(); y <= bbox.getMaxY(); ++y) {
+        PixelT const* ptr = pixels.getPixel(bbox.getMinX(), y);
+        afw::image::VariancePixel const* varPtr =
+            WithVariance ? variance.getPixel(bbox.getMinX(), y) : nullptr;
+        float const* cptr = &*coeffs.row_begin(y - coeffs.getY0()) + cOffset;
+        int i = 0;
+        for (; i + nLane <= width; i += nLane) {
+            for (int j = 0; j < nLane; ++j) {
+                double const coeff = cptr[i + j];
+                sum[j] += coeff*ptr[(i + j)*colStride];
+                if (WithVariance) {
+                    sumVar[j] += coeff*coeff*varPtr[(i + j)*varColStride];
+                }
+            }
+        }
+        for (; i < width; ++i) {
+            double const coeff = cptr[i];
+            sum[0] += coeff*ptr[i*colStride];
+            if (WithVariance) {
+                sumVar[0] += coeff*coeff*varPtr[i*varColStride];
+            }
+        }
+    }
+    return std::make_pair(std::accumulate(sum + 1, sum + nLane, sum[0]),
+                          std::accumulate(sumVar + 1, sumVar + nLane, sumVar[0]));
+}
+
+/*
+ * Measure the flux in a sinc aperture, as ApertureFluxAlgorithm::computeSincFlux does but without
+ * requiring an afw image.  As there, shifted coefficients that don't fit in the image are clipped to it;
+ * returns true if they were.
+ */
+template<bool WithVariance, typename PixelT>
+bool computeSincFlux(
+    std::pair<double, double> & result,             // the flux and its error
+    KronMaskedPixelView<PixelT> const& image,       // Image to measure
+    afw::geom::ellipses::Ellipse const& aperture,   // Aperture in which to measure
+    BadPixels const& bad,                           // pixels to reject
+    int & nBad                                      // number of rejected pixels
+    )
+{
+    typedef afw::image::Image<float> CoeffImage;
+    std::shared_ptr<CoeffImage const> cImage = base::SincCoeffs<float>::get(aperture.getCore(), 0.0);
+    cImage = afw::math::offsetImage(*cImage, aperture.getCenter().getX(), aperture.getCenter().getY(),
+                                    base::ApertureFluxControl().shiftKernel);
+    geom::Box2I const cBBox = cImage->getBBox();
+    bool const truncated = !image.getDomain().contains(cBBox);
+    geom::Box2I bbox(cBBox);            // the pixels with non-zero values
+    bbox.clip(image.getBBox());
+    int const cOffset = bbox.getMinX() - cBBox.getMinX(); // offset of bbox's first column in cImage
+
+    if (bad.isActive()) {
+        MaskedRowSum<WithVariance, PixelT> rowSum(image, bad, aperture);
+        for (int y = bbox.getMinY(); y <= bbox.getMaxY(); ++y) {
+            rowSum(bbox.getMinX(), y, bbox.getWidth(), &*cImage->row_begin(y - cBBox.getMinY()) + cOffset);
+        }
+        result = rowSum.getResult();
+        result.second = ::sqrt(result.second);
+        nBad = rowSum.getNBad();
+        return truncated;
+    }
+
+    result = runKernel<SumWeightedRows<WithVariance, PixelT>>(image, bbox, *cImage, cOffset);
+    result.second = WithVariance ? ::sqrt(result.second) : std::numeric_limits<double>::quiet_NaN();
+    return truncated;
+}
+
+/*
+ * Does an aperture's pixels all lie in bbox?  edgeClass is classifyAperture(aperture, bbox)
+ */
+bool apertureFits(afw::geom::ellipses::Ellipse const& aperture, EdgeClass const edgeClass,
+                  geom::Box2I const& bbox)
+{
+    switch (edgeClass) {
+      case EdgeClass::INSIDE:
+        return true;
+      case EdgeClass::OUTSIDE:
+        return false;
+      default:
+        return bbox.contains(afw::geom::SpanSet::fromShape(aperture)->getBBox());
+    }
+}
+
+// Photometer an image with a particular aperture
+//
+// If clipToImage is true, apertures that don't fit in the image are measured by summing the pixels that
+// do; the result is set, but we still return KronStatus::EDGE.  A sinc kernel that runs off the image
+// while the aperture doesn't is clipped to the image, as in ApertureFluxAlgorithm::computeSincFlux.  If
+// !WithVariance the variance plane isn't read, and the error is NaN.  The pixels specified by bad are
+// rejected (or replaced), and counted in nBad
+template<bool WithVariance, typename PixelT>
+KronStatus photometer(
+    std::pair<double, double> & result, // the flux and its error
+    KronMaskedPixelView<PixelT> const& image, // Image to measure
+    afw::geom::ellipses::Ellipse const& aperture, // Aperture in which to measure
+    double const maxSincRadius, // largest radius that we use sinc apertures to measure
+    bool const clipToImage, // measure the part of the aperture that's on the image?
+    BadPixels const& bad, // pixels to reject
+    int & nBad // number of rejected pixels
+    )
+{
+    nBad = 0;
     afw::geom::ellipses::Axes const& axes = aperture.getCore();
+    EdgeClass const edgeClass = classifyAperture(aperture, image.getDomain());
+    bool const useSinc = axes.getB() <= maxSincRadius;
+    if (useSinc && edgeClass != EdgeClass::OUTSIDE) {
+        bool const truncated = computeSincFlux<WithVariance>(result, image, aperture, bad, nBad);
+        // Only the kernel's wings are lost if the aperture itself is on the image
+        if (!truncated || apertureFits(aperture, edgeClass, image.getDomain())) {
+            KRON_PROBE(flux__sinc, probeRadius(axes.getA()), probeRadius(axes.getB()));
+            return KronStatus::OK;
+        }
+        nBad = 0;
+    }
+    if (useSinc && !clipToImage) {
+        return KronStatus::EDGE;
+    }
+    if (edgeClass == EdgeClass::OUTSIDE && !clipToImage) {
+        return KronStatus::EDGE;
+    }
+
+    auto spans = afw::geom::SpanSet::fromShape(aperture);
+    KronStatus status = KronStatus::OK;
+    if (edgeClass != EdgeClass::INSIDE && !image.getDomain().contains(spans->getBBox())) {
+        if (!clipToImage) {
+            return KronStatus::EDGE;
+        }
+        spans = spans->clippedTo(image.getDomain());
+        status = KronStatus::EDGE;
+    }
+    if (image.getDomain() != image.getBBox()) {
+        spans = spans->clippedTo(image.getBBox()); // the other pixels are zero
+    }
+    KRON_PROBE(flux__summed, static_cast<int>(useSinc), static_cast<std::int64_t>(spans->getArea()));
+    if (bad.isActive()) {
+        MaskedRowSum<WithVariance, PixelT> rowSum(image, bad, aperture);
+        for (auto const& span : *spans) {
+            rowSum(span.getX0(), span.getY(), span.getWidth(), nullptr);
+        }
+        result = rowSum.getResult();
+        nBad = rowSum.getNBad();
+    } else {
+        result = sumSpans<WithVariance>(*spans, image);
+    }
+    result.second = ::sqrt(result.second);
+    return status;
+}
+
+// Photometer several pixel-aligned images with the same aperture, as photometer
+//
+// The sinc coefficients or the aperture's spans are computed once, and each row is read from all the
+// images before moving on to the next.  Pixels with any of badPixelMask set are ignored (never replaced),
+// and counted in nBad
+template<bool WithVariance, typename PixelT>
+KronStatus photometerBands(
+    std::vector<std::pair<double, double>> & results, // the fluxes and their errors
+    std::vector<int> & nBad, // numbers of rejected pixels
+    std::vector<KronMaskedPixelView<PixelT>> const& images, // Images to measure; all have the same bbox
+    afw::geom::ellipses::Ellipse const& aperture, // Aperture in which to measure
+    double const maxSincRadius, // largest radius that we use sinc apertures to measure
+    bool const clipToImage, // measure the part of the aperture that's on the image?
+    afw::image::MaskPixel const badPixelMask // reject pixels with any of these bits set
+    )
+{
+    std::size_t const nImage = images.size();
+    std::vector<double> sum(nImage, 0.0), sumVar(nImage, 0.0);
+    nBad.assign(nImage, 0);
+    // Add the pixels [x0, x0 + width) in row y of every image, weighted by coeffs (if not null)
+    auto addRow = [&](int x0, int y, int width, float const* coeffs) {
+        for (std::size_t i = 0; i < nImage; ++i) {
+            KronMaskedPixelView<PixelT> const& image = images[i];
+            PixelT const* ptr = image.getImage().getPixel(x0, y);
+            std::ptrdiff_t const colStride = image.getImage().getColStride();
+            afw::image::VariancePixel const* varPtr = WithVariance ? image.getVariance().getPixel(x0, y) :
+                nullptr;
+            std::ptrdiff_t const varColStride = image.getVariance().getColStride();
+            afw::image::MaskPixel const* maskPtr = (badPixelMask != 0 && image.hasMask()) ?
+                image.getMask().getPixel(x0, y) : nullptr;
+            std::ptrdiff_t const maskColStride = image.getMask().getColStride();
+            for (int j = 0; j < width; ++j) {
+                if (maskPtr && (maskPtr[j*maskColStride] & badPixelMask)) {
+                    ++nBad[i];
+                    continue;
+                }
+                double const coeff = coeffs ? coeffs[j] : 1.0;
+                sum[i] += coeff*ptr[j*colStride];
+                if (WithVariance) {
+                    sumVar[i] += coeff*coeff*varPtr[j*varColStride];
+                }
+            }
+        }
+    };
+    auto setResults = [&]() {
+        results.resize(nImage);
+        for (std::size_t i = 0; i < nImage; ++i) {
+            results[i] = std::make_pair(sum[i], WithVariance ? ::sqrt(sumVar[i]) :
+                                        std::numeric_limits<double>::quiet_NaN());
+        }
+    };
+
+    KronMaskedPixelView<PixelT> const& first = images.front();
+    afw::geom::ellipses::Axes const& axes = aperture.getCore();
+    EdgeClass const edgeClass = classifyAperture(aperture, first.getDomain());
+    bool const useSinc = axes.getB() <= maxSincRadius;
+    if (useSinc && edgeClass != EdgeClass::OUTSIDE) {
+        typedef afw::image::Image<float> CoeffImage;
+        std::shared_ptr<CoeffImage const> cImage = base::SincCoeffs<float>::get(aperture.getCore(), 0.0);
+        cImage = afw::math::offsetImage(*cImage, aperture.getCenter().getX(), aperture.getCenter().getY(),
+                                        base::ApertureFluxControl().shiftKernel);
+        geom::Box2I const cBBox = cImage->getBBox();
+        if (first.getDomain().contains(cBBox) || apertureFits(aperture, edgeClass, first.getDomain())) {
+            geom::Box2I bbox(cBBox);    // clipped to the image, as in computeSincFlux
+            bbox.clip(first.getBBox());
+            int const cOffset = bbox.getMinX() - cBBox.getMinX();
+            for (int y = bbox.getMinY(); y <= bbox.getMaxY(); ++y) {
+                addRow(bbox.getMinX(), y, bbox.getWidth(),
+                       &*cImage->row_begin(y - cBBox.getMinY()) + cOffset);
+            }
+            setResults();
+            return KronStatus::OK;
+        }
+    }
+    if (useSinc && !clipToImage) {
+        return KronStatus::EDGE;
+    }
+    if (edgeClass == EdgeClass::OUTSIDE && !clipToImage) {
+        return KronStatus::EDGE;
+    }
+
+    auto spans = afw::geom::SpanSet::fromShape(aperture);
+    KronStatus status = KronStatus::OK;
+    if (edgeClass != EdgeClass::INSIDE && !first.getDomain().contains(spans->getBBox())) {
+        if (!clipToImage) {
+            return KronStatus::EDGE;
+        }
+        spans = spans->clippedTo(first.getDomain());
+        status = KronStatus::EDGE;
+    }
+    if (first.getDomain() != first.getBBox()) {
+        spans = spans->clippedTo(first.getBBox()); // the other pixels are zero
+    }
+    for (auto const& span : *spans) {
+        addRow(span.getX0(), span.getY(), span.getWidth(), nullptr);
+    }
+    setResults();
+    return status;
+}
+
+// Throw the exception appropriate to a Kron aperture that doesn't fit in the image
+void throwFluxEdge(
+    KronAperture const& aperture, // the Kron aperture
+    double const nRadiusForFlux, // Kron radius multiplier
+    double const maxSincRadius // largest radius that we use sinc apertures to measure
+    )
+{
+    afw::geom::ellipses::Axes axes(aperture.getAxes());
+    axes.scale(nRadiusForFlux);
+    std::string const msg = (boost::format("Measuring Kron flux for object at (%.3f, %.3f);"
+                                           " aperture radius %g,%g theta %g")
+                             % aperture.getX() % aperture.getY()
+                             % axes.getA() % axes.getB() % geom::radToDeg(axes.getTheta())).str();
     if (axes.getB() > maxSincRadius) {
-        FootprintFlux<ImageT> fluxFunctor;
-        auto spans = afw::geom::SpanSet::fromShape(aperture);
-        spans->applyFunctor(
-                fluxFunctor, *(image.getImage()), *(image.getVariance()));
-        return std::make_pair(fluxFunctor.getSum(), ::sqrt(fluxFunctor.getSumVar()));
+        throw LSST_EXCEPT(pex::exceptions::OutOfRangeError, msg);
+    }
+    throw LSST_EXCEPT(pex::exceptions::LengthError, msg);
+}
+
+std::string getKronKernelVariant()
+{
+    return kernelVariantNames[static_cast<int>(kernelVariant)];
+}
+
+bool setKronEdgeClassification(bool const enabled)
+{
+    return edgeClassification.exchange(enabled);
+}
+
+double calculatePsfKronRadius(
+    std::shared_ptr<afw::detection::Psf const> const& psf, // PSF to measure
+    geom::Point2D const& center, // Centroid of source on parent image
+    double smoothingSigma         // Gaussian sigma of smoothing applied
+    )
+{
+    assert(psf);
+    double const radius = psf->computeShape(center).getDeterminantRadius();
+    // For a Gaussian N(0, sigma^2), the Kron radius is sqrt(pi/2)*sigma
+    return ::sqrt(geom::PI/2)*::hypot(radius, std::max(0.0, smoothingSigma));
+}
+
+template<typename ImageT>
+KronStatus KronAperture::tryMeasureFlux(
+    std::pair<double, double> & result,
+    ImageT const& image,
+    double const nRadiusForFlux,
+    double const maxSincRadius,
+    bool const clipToImage,
+    bool const measureFluxErr,
+    afw::image::MaskPixel const badPixelMask,
+    bool const replaceBadPixels,
+    int * nBadPixels
+    ) const
+{
+    afw::geom::ellipses::Axes axes(getAxes()); // Copy of ellipse core, so we can scale
+    axes.scale(nRadiusForFlux);
+    afw::geom::ellipses::Ellipse const ellip(axes, getCenter());
+
+    auto const& view = asView(image);
+    BadPixels const bad = {&view.getMask(), badPixelMask, replaceBadPixels};
+    int nBad = 0;
+    KronStatus status;
+    if (measureFluxErr && view.hasVariance()) {
+        status = photometer<true>(result, view, ellip, maxSincRadius, clipToImage, bad, nBad);
+    } else {
+        status = photometer<false>(result, view, ellip, maxSincRadius, clipToImage, bad, nBad);
+    }
+    if (nBadPixels) {
+        *nBadPixels = nBad;
+    }
+    return status;
+}
+
+template<typename ImageT>
+std::pair<double, double> KronAperture::measureFlux(
+    ImageT const& image,
+    double const nRadiusForFlux,
+    double const maxSincRadius
+    ) const
+{
+    std::pair<double, double> result;
+    if (tryMeasureFlux(result, image, nRadiusForFlux, maxSincRadius) == KronStatus::EDGE) {
+        throwFluxEdge(*this, nRadiusForFlux, maxSincRadius);
+    }
+    return result;
+}
+
+template<typename ImageT>
+KronStatus KronAperture::tryMeasureFluxBands(
+    std::vector<std::pair<double, double>> & results,
+    std::vector<int> & nBadPixels,
+    std::vector<ImageT> const& images,
+    double const nRadiusForFlux,
+    double const maxSincRadius,
+    bool const clipToImage,
+    bool const measureFluxErr,
+    afw::image::MaskPixel const badPixelMask
+    ) const
+{
+    results.clear();
+    nBadPixels.clear();
+    if (images.empty()) {
+        return KronStatus::OK;
+    }
+    typedef typename std::decay<decltype(asView(images.front()))>::type View;
+    std::vector<View> views;
+    views.reserve(images.size());
+    bool withVariance = measureFluxErr;
+    for (auto const& image : images) {
+        views.push_back(asView(image));
+        View const& view = views.back();
+        if (view.getBBox() != views.front().getBBox() || view.getDomain() != views.front().getDomain()) {
+            throw LSST_EXCEPT(pex::exceptions::LengthError,
+                              (boost::format("Images to measure together must be pixel-aligned; "
+                                             "bounding box %s != %s")
+                               % view.getBBox() % views.front().getBBox()).str());
+        }
+        withVariance &= view.hasVariance();
+    }
+
+    afw::geom::ellipses::Axes axes(getAxes()); // Copy of ellipse core, so we can scale
+    axes.scale(nRadiusForFlux);
+    afw::geom::ellipses::Ellipse const ellip(axes, getCenter());
+    if (withVariance) {
+        return photometerBands<true>(results, nBadPixels, views, ellip, maxSincRadius, clipToImage,
+                                     badPixelMask);
+    }
+    return photometerBands<false>(results, nBadPixels, views, ellip, maxSincRadius, clipToImage,
+                                  badPixelMask);
+}
+
+template<typename ImageT>
+std::vector<std::pair<double, double>> KronAperture::measureFluxBands(
+    std::vector<ImageT> const& images,
+    double const nRadiusForFlux,
+    double const maxSincRadius
+    ) const
+{
+    std::vector<std::pair<double, double>> results;
+    std::vector<int> nBadPixels;
+    if (tryMeasureFluxBands(results, nBadPixels, images, nRadiusForFlux, maxSincRadius) == KronStatus::EDGE) {
+        throwFluxEdge(*this, nRadiusForFlux, maxSincRadius);
+    }
+    return results;
+}
+
+namespace {
+/*
+ * The part of a row of one of a set of apertures that we're measuring together
+ */
+struct JointSpan {
+    int x0, x1;                         // first and last columns
+    std::size_t index;                  // which aperture
+
+    bool operator<(JointSpan const& rhs) const { return x0 < rhs.x0; }
+};
+
+/*
+ * Call visit(x0, x1, y, active) once for each run of pixels [x0, x1] in row y of the union of a set of
+ * SpanSets that all lie in the same SpanSets, where active holds the JointSpans (and hence the indices of
+ * the SpanSets) that contain them.  Each pixel's visited once, however many SpanSets contain it, and
+ * within each SpanSet in the order of its spans; the runs are as long as possible, so the cost is set by
+ * the number of places where a span starts or ends, not by the number of pixels.
+ */
+template <typename VisitorT>
+void applyJointly(
+    // (index, pixels) for each SpanSet
+    std::vector<std::pair<std::size_t, std::shared_ptr<afw::geom::SpanSet>>> const& spanSets,
+    VisitorT & visit
+    )
+{
+    geom::Box2I bbox;
+    for (auto const& spans : spanSets) {
+        bbox.include(spans.second->getBBox());
     }
-    try {
-        base::ApertureFluxResult fluxResult = base::ApertureFluxAlgorithm::computeSincFlux<float>(image, aperture);
-        return std::make_pair(fluxResult.instFlux, fluxResult.instFluxErr);
-    } catch(pex::exceptions::LengthError &e) {
-        LSST_EXCEPT_ADD(e, (boost::format("Measuring Kron flux for object at (%.3f, %.3f);"
-                                          " aperture radius %g,%g theta %g")
-                            % aperture.getCenter().getX() % aperture.getCenter().getY()
-                            % axes.getA() % axes.getB() % geom::radToDeg(axes.getTheta())).str());
-        throw e;
+    std::vector<std::vector<JointSpan>> rows(bbox.getHeight());
+    for (auto const& spans : spanSets) {
+        for (auto const& span : *spans.second) {
+            rows[span.getY() - bbox.getMinY()].push_back(JointSpan{span.getX0(), span.getX1(), spans.first});
+        }
+    }
+
+    std::vector<JointSpan> active;
+    for (int y = bbox.getMinY(); y <= bbox.getMaxY(); ++y) {
+        std::vector<JointSpan> & row = rows[y - bbox.getMinY()];
+        std::stable_sort(row.begin(), row.end());
+        std::size_t next = 0;
+        active.clear();
+        int x = 0;
+        while (next < row.size() || !active.empty()) {
+            if (active.empty()) {
+                x = row[next].x0;       // skip the gap between spans
+            }
+            for (; next < row.size() && row[next].x0 <= x; ++next) {
+                active.push_back(row[next]);
+            }
+            int x1 = (next < row.size()) ? row[next].x0 - 1 : bbox.getMaxX(); // the end of this run
+            for (auto const& span : active) {
+                x1 = std::min(x1, span.x1);
+            }
+            visit(x, x1, y, active);
+            x = x1 + 1;
+            active.erase(std::remove_if(active.begin(), active.end(),
+                                        [x](JointSpan const& span) { return span.x1 < x; }),
+                         active.end());
+        }
     }
 }
 
+/*
+ * Build the pixels of an aperture, returning KronStatus::EDGE if it doesn't fit in image's domain, and
+ * clipping it to the pixels in the view
+ */
+template <typename PixelT>
+KronStatus makeApertureSpans(
+    std::shared_ptr<afw::geom::SpanSet> & spans, // the pixels in the aperture
+    KronMaskedPixelView<PixelT> const& image,    // image to measure
+    afw::geom::ellipses::Ellipse const& ellipse  // the aperture
+    )
+{
+    EdgeClass const edgeClass = classifyAperture(ellipse, image.getDomain());
+    if (edgeClass == EdgeClass::OUTSIDE) {
+        return KronStatus::EDGE;
+    }
+    spans = afw::geom::SpanSet::fromShape(ellipse);
+    if (edgeClass == EdgeClass::BORDERLINE && !image.getDomain().contains(spans->getBBox())) {
+        return KronStatus::EDGE;
+    }
+    if (image.getDomain() != image.getBBox()) {
+        spans = spans->clippedTo(image.getBBox()); // the other pixels are zero
+    }
+    return KronStatus::OK;
+}
 
-double calculatePsfKronRadius(
-    std::shared_ptr<afw::detection::Psf const> const& psf, // PSF to measure
-    geom::Point2D const& center, // Centroid of source on parent image
-    double smoothingSigma=0.0         // Gaussian sigma of smoothing applied
+/*
+ * The first moment of one of a set of apertures measured together, accumulated by the same kernels as
+ * computeFirstMoment uses; JointMomentImpl holds the cheapest FootprintFindMoment for its aperture
+ */
+template <typename PixelT>
+class JointMoment {
+public:
+    virtual ~JointMoment() = default;
+
+    /// Add the pixels [x0, x1] of row y of image, rejecting the pixels specified by bad (never replaced)
+    virtual void addRun(int x0, int x1, int y, KronPixelView<PixelT> const& image, BadPixels const& bad) = 0;
+
+    virtual bool getGood() const = 0;
+    virtual double getIr() const = 0;
+};
+
+template <typename MomentT>
+class JointMomentImpl : public JointMoment<typename MomentT::Pixel> {
+public:
+    explicit JointMomentImpl(MomentT const& moment) : _moment(moment) {}
+
+    void addRun(int const x0, int const x1, int const y, KronPixelView<typename MomentT::Pixel> const& image,
+                BadPixels const& bad) override {
+        std::array<afw::geom::Span, 1> const run = {{afw::geom::Span(y, x0, x1)}};
+        if (bad.isActive()) {
+            runKernel<SumMaskedMomentSpans<MomentT>>(run, _moment, image, *bad.mask, bad.bits);
+        } else {
+            runKernel<SumMomentSpans<MomentT>>(run, _moment, image);
+        }
+    }
+
+    bool getGood() const override { return _moment.getGood(); }
+    double getIr() const override { return _moment.getIr(); }
+
+private:
+    MomentT _moment;
+};
+
+/*
+ * Sum the pixels of each of a set of apertures, summing each run of pixels that lies in the same
+ * apertures once (see applyJointly) and adding it to each of them.  Pixels specified by bad are ignored
+ * (never replaced), and counted in nBad
+ */
+template <bool WithVariance, typename PixelT>
+void sumJointly(
+    std::vector<std::pair<double, double>> & results, // the fluxes and their errors, indexed as spanSets
+    std::vector<int> & nBad,                          // numbers of rejected pixels, indexed as spanSets
+    // (index, pixels) for each aperture
+    std::vector<std::pair<std::size_t, std::shared_ptr<afw::geom::SpanSet>>> const& spanSets,
+    KronMaskedPixelView<PixelT> const& image,         // image to measure
+    BadPixels const& bad                              // pixels to reject
     )
 {
-    assert(psf);
-    double const radius = psf->computeShape(center).getDeterminantRadius();
-    // For a Gaussian N(0, sigma^2), the Kron radius is sqrt(pi/2)*sigma
-    return ::sqrt(geom::PI/2)*::hypot(radius, std::max(0.0, smoothingSigma));
+    std::vector<double> sum(results.size(), 0.0), sumVar(results.size(), 0.0);
+    // The aperture only defines the annuli used to replace bad pixels, which we don't do
+    afw::geom::ellipses::Ellipse const unused(afw::geom::ellipses::Axes(1, 1, 0), geom::Point2D(0, 0));
+    std::unique_ptr<MaskedRowSum<WithVariance, PixelT>> rowSum;
+    if (bad.isActive()) {
+        rowSum.reset(new MaskedRowSum<WithVariance, PixelT>(image, bad, unused));
+    }
+    auto visit = [&](int const x0, int const x1, int const y, std::vector<JointSpan> const& active) {
+        std::pair<double, double> runSum;
+        int runBad = 0;
+        if (rowSum) {
+            rowSum->reset();
+            (*rowSum)(x0, y, x1 - x0 + 1, nullptr);
+            runSum = rowSum->getResult();
+            runBad = rowSum->getNBad();
+        } else {
+            std::array<afw::geom::Span, 1> const run = {{afw::geom::Span(y, x0, x1)}};
+            runSum = sumSpans<WithVariance>(run, image);
+        }
+        for (auto const& span : active) {
+            sum[span.index] += runSum.first;
+            if (WithVariance) {
+                sumVar[span.index] += runSum.second;
+            }
+            nBad[span.index] += runBad;
+        }
+    };
+    applyJointly(spanSets, visit);
+
+    for (auto const& spans : spanSets) {
+        std::size_t const i = spans.first;
+        results[i] = std::make_pair(sum[i], WithVariance ? ::sqrt(sumVar[i]) :
+                                    std::numeric_limits<double>::quiet_NaN());
+    }
 }
+} // end anonymous namespace
 
 template<typename ImageT>
-std::pair<double, double> KronAperture::measureFlux(
+std::vector<KronStatus> KronAperture::tryDetermineRadii(
+    std::vector<std::shared_ptr<KronAperture>> & apertures,
     ImageT const& image,
-    double const nRadiusForFlux,
-    double const maxSincRadius
+    std::vector<afw::geom::ellipses::Axes> const& axesIn,
+    std::vector<geom::Point2D> const& centers,
+    KronFluxControl const& ctrl
+    )
+{
+    if (ctrl.smoothingSigma > 0 || ctrl.binFactorForRadius > 1 || ctrl.radiusTolerance > 0 ||
+        ctrl.replaceBadPixels) {
+        throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                          "Joint Kron radii don't support smoothing, binning, convergence or replacement");
+    }
+    std::size_t const num = centers.size();
+    if (axesIn.size() != num) {
+        throw LSST_EXCEPT(pex::exceptions::LengthError,
+                          (boost::format("Inconsistent numbers of axes and centres: %d %d")
+                           % axesIn.size() % num).str());
+    }
+
+    auto const& maskedView = asView(image);
+    auto const& view = maskedView.getImage();
+    BadPixels const bad = {&maskedView.getMask(), ctrl.getBadPixelMask(), false};
+    typedef typename std::decay<decltype(view)>::type::Pixel Pixel;
+    //
+    // The state of each source's iteration, as in tryDetermineRadius
+    //
+    std::vector<afw::geom::ellipses::Axes> axes(axesIn);
+    std::vector<double> radius0(num);
+    std::vector<float> radiusForRadius(num, std::nanf(""));
+    std::vector<int> nIter(num, 0);
+    std::vector<bool> done(num, false);
+    std::vector<KronStatus> status(num, KronStatus::OK);
+    for (std::size_t i = 0; i < num; ++i) {
+        radius0[i] = axes[i].getDeterminantRadius();
+    }
+
+    for (int iter = 0; iter < ctrl.nIterForRadius; ++iter) {
+        std::vector<std::pair<std::size_t, std::shared_ptr<afw::geom::SpanSet>>> spanSets;
+        std::vector<std::unique_ptr<JointMoment<Pixel>>> moments;
+        std::vector<std::size_t> momentIndex(num);
+        for (std::size_t i = 0; i < num; ++i) {
+            if (done[i]) {
+                continue;
+            }
+            axes[i].scale(ctrl.nSigmaForRadius);
+            radiusForRadius[i] = axes[i].getDeterminantRadius(); // radius we used to estimate R_K
+
+            afw::geom::ellipses::Ellipse const ellipse(axes[i], centers[i]);
+            std::shared_ptr<afw::geom::SpanSet> spans;
+            if (makeApertureSpans(spans, maskedView, ellipse) == KronStatus::EDGE) {
+                done[i] = true;         // use the radius we have
+                continue;
+            }
+            momentIndex[i] = moments.size();
+            spanSets.emplace_back(moments.size(), spans);
+            // Use the same functor as determineRadius, so that we agree with it
+            withCheapestMoment<Pixel>(centers[i], axes[i].getA()/axes[i].getB(), axes[i].getTheta(),
+                                      ctrl.momentShapeTolerance, [&moments](auto const& moment) {
+                                          typedef typename std::decay<decltype(moment)>::type MomentT;
+                                          moments.emplace_back(new JointMomentImpl<MomentT>(moment));
+                                          return KronStatus::OK;
+                                      });
+        }
+        if (spanSets.empty()) {
+            break;
+        }
+        //
+        // Accumulate all the moments in a single pass over the pixels, a run at a time
+        //
+        auto visit = [&](int const x0, int const x1, int const y, std::vector<JointSpan> const& active) {
+            for (auto const& span : active) {
+                moments[span.index]->addRun(x0, x1, y, view, bad);
+            }
+        };
+        applyJointly(spanSets, visit);
+
+        for (std::size_t i = 0; i < num; ++i) {
+            if (done[i]) {
+                continue;
+            }
+            auto const& moment = *moments[momentIndex[i]];
+            if (!moment.getGood()) {
+                status[i] = KronStatus::BAD_INTEGRAL;
+                done[i] = true;
+                continue;
+            }
+            ++nIter[i];
+
+            double const radius = moment.getIr()*sqrt(axes[i].getB()/axes[i].getA());
+            if (radius <= radius0[i]) {
+                done[i] = true;
+                continue;
+            }
+            radius0[i] = radius;
+
+            axes[i].scale(radius/axes[i].getDeterminantRadius()); // set axes to our current estimate of R_K
+
+            if (radius > ctrl.maxRadius) {
+                status[i] = KronStatus::RADIUS_TOO_LARGE;
+                done[i] = true;
+            }
+        }
+    }
+
+    apertures.assign(num, nullptr);
+    for (std::size_t i = 0; i < num; ++i) {
+        if (status[i] == KronStatus::OK) {
+            apertures[i] = std::make_shared<KronAperture>(centers[i], axes[i], radiusForRadius[i]);
+            apertures[i]->_nIterForRadius = nIter[i];
+        }
+    }
+    return status;
+}
+
+template<typename ImageT>
+std::vector<KronStatus> KronAperture::tryMeasureFluxes(
+    std::vector<std::pair<double, double>> & results,
+    std::vector<int> & nBadPixels,
+    std::vector<std::shared_ptr<KronAperture const>> const& apertures,
+    ImageT const& image,
+    KronFluxControl const& ctrl
+    )
+{
+    std::size_t const num = apertures.size();
+    results.assign(num, std::make_pair(std::numeric_limits<double>::quiet_NaN(),
+                                       std::numeric_limits<double>::quiet_NaN()));
+    nBadPixels.assign(num, 0);
+    std::vector<KronStatus> status(num, KronStatus::OK);
+
+    auto const& view = asView(image);
+    afw::image::MaskPixel const badPixelMask = ctrl.getBadPixelMask();
+    BadPixels const bad = {&view.getMask(), badPixelMask, false};
+    bool const withVariance = ctrl.doMeasureFluxErr && view.hasVariance();
+    //
+    // Sinc apertures, apertures that don't fit in the image, and bad pixel replacement are measured one
+    // by one; we sum the rest of the apertures' pixels together
+    //
+    std::vector<std::pair<std::size_t, std::shared_ptr<afw::geom::SpanSet>>> spanSets;
+    for (std::size_t i = 0; i < num; ++i) {
+        afw::geom::ellipses::Axes axes(apertures[i]->getAxes());
+        axes.scale(ctrl.nRadiusForFlux);
+        afw::geom::ellipses::Ellipse const ellipse(axes, apertures[i]->getCenter());
+        std::shared_ptr<afw::geom::SpanSet> spans;
+        if (axes.getB() <= ctrl.maxSincRadius || ctrl.replaceBadPixels ||
+            makeApertureSpans(spans, view, ellipse) != KronStatus::OK) {
+            status[i] = apertures[i]->tryMeasureFlux(results[i], image, ctrl.nRadiusForFlux,
+                                                     ctrl.maxSincRadius, ctrl.clipEdgeApertures,
+                                                     ctrl.doMeasureFluxErr, badPixelMask,
+                                                     ctrl.replaceBadPixels, &nBadPixels[i]);
+        } else {
+            spanSets.emplace_back(i, spans);
+        }
+    }
+    if (spanSets.empty()) {
+        return status;
+    }
+
+    if (withVariance) {
+        sumJointly<true>(results, nBadPixels, spanSets, view, bad);
+    } else {
+        sumJointly<false>(results, nBadPixels, spanSets, view, bad);
+    }
+    return status;
+}
+
+template<typename ImageT>
+std::vector<KronBatchResult> KronAperture::measureBatch(
+    ImageT const& image,
+    ndarray::Array<double const, 1> const& x,
+    ndarray::Array<double const, 1> const& y,
+    ndarray::Array<double const, 1> const& a,
+    ndarray::Array<double const, 1> const& b,
+    ndarray::Array<double const, 1> const& theta,
+    KronFluxControl const& ctrl,
+    int nThreads
+    )
+{
+    std::size_t const num = x.getSize<0>();
+    if (y.getSize<0>() != num || a.getSize<0>() != num ||
+        b.getSize<0>() != num || theta.getSize<0>() != num) {
+        throw LSST_EXCEPT(pex::exceptions::LengthError,
+                          (boost::format("Inconsistent array lengths: %d %d %d %d %d")
+                           % num % y.getSize<0>() % a.getSize<0>()
+                           % b.getSize<0>() % theta.getSize<0>()).str());
+    }
+
+    std::vector<KronBatchResult> results(num);
+    afw::image::MaskPixel const badPixelMask = ctrl.getBadPixelMask();
+    std::unique_ptr<KronImagePyramid> pyramid;
+    if (ctrl.binFactorForRadius > 1) {
+        pyramid.reset(new KronImagePyramid());
+    }
+    //
+    // The threads take sources from a common counter, as the cost per source varies widely
+    //
+    std::atomic<std::size_t> next(0);
+    auto worker = [&]() {
+        for (std::size_t i = next++; i < num; i = next++) {
+            KronBatchResult & result = results[i];
+            result.radius = result.radiusForRadius = std::nanf("");
+            result.nIterForRadius = 0;
+            result.instFlux = result.instFluxErr = std::numeric_limits<double>::quiet_NaN();
+            result.nBadPixels = 0;
+
+            geom::Point2D const center(x[i], y[i]);
+            afw::geom::ellipses::Axes const axes(a[i], b[i], theta[i], true);
+            std::shared_ptr<KronAperture> aperture;
+            std::pair<double, double> flux;
+            KronStatus status;
+            try {
+                status = tryDetermineRadius(aperture, image, axes, center, ctrl, pyramid.get());
+                if (status == KronStatus::OK) {
+                    result.radius = aperture->getAxes().getDeterminantRadius();
+                    result.radiusForRadius = aperture->getRadiusForRadius();
+                    result.nIterForRadius = aperture->getNIterForRadius();
+                    if (ctrl.doMeasureFlux) {
+                        status = aperture->tryMeasureFlux(flux, image, ctrl.nRadiusForFlux, ctrl.maxSincRadius,
+                                                          ctrl.clipEdgeApertures, ctrl.doMeasureFluxErr,
+                                                          badPixelMask, ctrl.replaceBadPixels,
+                                                          &result.nBadPixels);
+                        if (status == KronStatus::OK || ctrl.clipEdgeApertures) {
+                            std::tie(result.instFlux, result.instFluxErr) = flux;
+                        }
+                    }
+                }
+            } catch (pex::exceptions::Exception &) {
+                status = KronStatus::FAILURE;
+            } catch (std::exception &) {
+                // e.g. std::bad_alloc; it mustn't escape a worker thread, which would call std::terminate
+                status = KronStatus::FAILURE;
+            }
+            result.status = static_cast<int>(status);
+        }
+    };
+
+    if (nThreads <= 0) {
+        nThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    nThreads = std::min<std::size_t>(nThreads, std::max<std::size_t>(1, num));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nThreads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    return results;
+}
+
+/************************************************************************************************************/
+/*
+ * Counters and timers for KronFluxAlgorithm (see KronFluxControl.doCollectStats)
+ *
+ * Each thread accumulates into its own Block, found through a thread_local cache, so recording never takes
+ * a lock; the Blocks are only summed by write
+ */
+class KronStats {
+public:
+    enum Counter {
+        MEASURE_CALLS, MEASURE_N_CALLS, MEASURE_FORCED_CALLS, MEASURE_FORCED_BANDS_CALLS,
+        RADIUS_CALLS, SMOOTHED_RADIUS_CALLS, RADIUS_ITERATIONS, RADIUS_PIXELS,
+        WARM_START_ACCEPTED, WARM_START_REJECTED, FALLBACK_RADIUS,
+        SINC_FLUX, SUMMED_FLUX, SINC_FALLBACK, FLUX_PIXELS,
+        EDGE_EXCEPTIONS, RADIUS_EXCEPTIONS, FAILURES,
+        N_COUNTERS
+    };
+    enum Timer {
+        PSF_RADIUS_TIME, RADIUS_TIME, SMOOTHED_RADIUS_TIME, SINC_FLUX_TIME, SUMMED_FLUX_TIME, JOINT_FLUX_TIME,
+        N_TIMERS
+    };
+
+    explicit KronStats(std::size_t nFlag) : _id(++_nextId), _nFlag(nFlag) {}
+
+    void add(Counter counter, std::int64_t n=1) { _getBlock().counters[counter] += n; }
+    void addTime(Timer timer, double seconds) { _getBlock().timers[timer] += seconds; }
+    void addFlag(std::size_t flag) { ++_getBlock().flags[flag]; }
+
+    /// Set the totals over all threads in metadata, as <PREFIX>_<STATISTIC>
+    void write(daf::base::PropertySet & metadata, std::string const& prefix,
+               meas::base::FlagDefinitionList const& flags) const;
+
+private:
+    struct Block {
+        explicit Block(std::size_t nFlag) : counters(), timers(), flags(nFlag, 0) {}
+
+        std::array<std::int64_t, N_COUNTERS> counters;
+        std::array<double, N_TIMERS> timers;
+        std::vector<std::int64_t> flags;
+    };
+
+    Block & _getBlock() {
+        // This thread's Block for each KronStats, by _id (which, unlike the address, is never reused)
+        thread_local std::unordered_map<std::uint64_t, Block *> blocks;
+        Block *& block = blocks[_id];
+        if (!block) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _blocks.emplace_back(new Block(_nFlag));
+            block = _blocks.back().get();
+        }
+        return *block;
+    }
+
+    static std::atomic<std::uint64_t> _nextId;
+
+    std::uint64_t const _id;
+    std::size_t const _nFlag;
+    mutable std::mutex _mutex;          // protects _blocks
+    std::vector<std::unique_ptr<Block>> _blocks;
+};
+
+std::atomic<std::uint64_t> KronStats::_nextId(0);
+
+void KronStats::write(
+    daf::base::PropertySet & metadata,
+    std::string const& prefix,
+    meas::base::FlagDefinitionList const& flags
     ) const
 {
-    afw::geom::ellipses::Axes axes(getAxes()); // Copy of ellipse core, so we can scale
-    axes.scale(nRadiusForFlux);
-    afw::geom::ellipses::Ellipse const ellip(axes, getCenter());
+    static char const* const counterNames[N_COUNTERS] = {
+        "MEASURE_CALLS", "MEASURE_N_CALLS", "MEASURE_FORCED_CALLS", "MEASURE_FORCED_BANDS_CALLS",
+        "RADIUS_CALLS", "SMOOTHED_RADIUS_CALLS", "RADIUS_ITERATIONS", "RADIUS_PIXELS",
+        "WARM_START_ACCEPTED", "WARM_START_REJECTED", "FALLBACK_RADIUS",
+        "SINC_FLUX", "SUMMED_FLUX", "SINC_FALLBACK", "FLUX_PIXELS",
+        "EDGE_EXCEPTIONS", "RADIUS_EXCEPTIONS", "FAILURES",
+    };
+    static char const* const timerNames[N_TIMERS] = {
+        "PSF_RADIUS_TIME", "RADIUS_TIME", "SMOOTHED_RADIUS_TIME", "SINC_FLUX_TIME", "SUMMED_FLUX_TIME",
+        "JOINT_FLUX_TIME",
+    };
+
+    Block total(_nFlag);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto const& block : _blocks) {
+            for (int i = 0; i < N_COUNTERS; ++i) {
+                total.counters[i] += block->counters[i];
+            }
+            for (int i = 0; i < N_TIMERS; ++i) {
+                total.timers[i] += block->timers[i];
+            }
+            for (std::size_t i = 0; i < _nFlag; ++i) {
+                total.flags[i] += block->flags[i];
+            }
+        }
+    }
+
+    for (int i = 0; i < N_COUNTERS; ++i) {
+        metadata.set(prefix + "_" + counterNames[i], total.counters[i]);
+    }
+    for (int i = 0; i < N_TIMERS; ++i) {
+        metadata.set(prefix + "_" + timerNames[i], total.timers[i]);
+    }
+    for (std::size_t i = 0; i < _nFlag; ++i) {
+        metadata.set(prefix + "_" + boost::to_upper_copy(flags.getDefinition(i).name), total.flags[i]);
+    }
+}
+
+namespace {
+/*
+ * Add the time between construction and destruction (or stop) to a KronStats timer; does nothing (and
+ * doesn't read the clock) if stats is null
+ */
+class StageTimer {
+public:
+    StageTimer(KronStats * stats, KronStats::Timer timer) : _stats(stats), _timer(timer) {
+        if (_stats) {
+            _start = std::chrono::steady_clock::now();
+        }
+    }
+    ~StageTimer() { stop(); }
+
+    StageTimer(StageTimer const&) = delete;
+    StageTimer& operator=(StageTimer const&) = delete;
+
+    /// Attribute the time to a different timer
+    void setTimer(KronStats::Timer timer) { _timer = timer; }
+
+    void stop() {
+        if (_stats) {
+            std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - _start;
+            _stats->addTime(_timer, elapsed.count());
+            _stats = nullptr;
+        }
+    }
+
+private:
+    KronStats * _stats;
+    KronStats::Timer _timer;
+    std::chrono::steady_clock::time_point _start;
+};
+
+/*
+ * The (approximate) number of pixels read to estimate an aperture's Kron radius: the area of the last
+ * aperture used, times the number of iterations
+ */
+std::int64_t getRadiusPixels(KronAperture const& aperture)
+{
+    int const nIter = aperture.getNIterForRadius();
+    double const radius = aperture.getRadiusForRadius();
+    return (nIter > 0 && std::isfinite(radius)) ? std::llround(nIter*geom::PI*radius*radius) : 0;
+}
+
+/*
+ * The (approximate) number of pixels read to measure the flux in an aperture: the flux aperture's area
+ */
+std::int64_t getFluxPixels(KronAperture const& aperture, double const nRadiusForFlux)
+{
+    afw::geom::ellipses::Axes const& axes = aperture.getAxes();
+    return std::llround(geom::PI*nRadiusForFlux*nRadiusForFlux*axes.getA()*axes.getB());
+}
+
+/*
+ * Count the iterations used to estimate an aperture's Kron radius, and the pixels read
+ */
+void countRadius(KronStats & stats, KronAperture const& aperture)
+{
+    stats.add(KronStats::RADIUS_ITERATIONS, aperture.getNIterForRadius());
+    stats.add(KronStats::RADIUS_PIXELS, getRadiusPixels(aperture));
+}
+
+/*
+ * Count a flux measured in an aperture with the given status, and the pixels in the aperture; return
+ * true if it was measured on the sinc path (see photometer)
+ */
+bool countFlux(KronStats & stats, KronAperture const& aperture, KronFluxControl const& ctrl,
+               KronStatus const status)
+{
+    afw::geom::ellipses::Axes const& axes = aperture.getAxes();
+    bool const wantSinc = ctrl.nRadiusForFlux*axes.getB() <= ctrl.maxSincRadius;
+    bool const sinc = wantSinc && status == KronStatus::OK;
+    stats.add(sinc ? KronStats::SINC_FLUX : KronStats::SUMMED_FLUX);
+    if (wantSinc && !sinc) {
+        stats.add(KronStats::SINC_FALLBACK);
+    }
+    stats.add(KronStats::FLUX_PIXELS, getFluxPixels(aperture, ctrl.nRadiusForFlux));
+    return sinc;
+}
 
-    return photometer(image, ellip, maxSincRadius);
+/*
+ * Count the flags set in a measured (or failed) source
+ */
+void countFlags(KronStats & stats, meas::base::FlagHandler const& flagHandler,
+                afw::table::SourceRecord const& source)
+{
+    std::size_t const nFlag = KronFluxAlgorithm::getFlagDefinitions().size();
+    for (std::size_t i = 0; i < nFlag; ++i) {
+        if (flagHandler.getValue(source, i)) {
+            stats.addFlag(i);
+        }
+    }
 }
 
+/*
+ * Set a record's field to the time (in ns) between construction and destruction, even if we're unwinding
+ * from an exception; does nothing if the key isn't valid
+ */
+class RecordTimer {
+public:
+    RecordTimer(afw::table::BaseRecord & record, afw::table::Key<std::int64_t> const& key) :
+        _record(record), _key(key) {
+        if (_key.isValid()) {
+            _start = std::chrono::steady_clock::now();
+        }
+    }
+    ~RecordTimer() {
+        if (_key.isValid()) {
+            _record.set(_key, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - _start).count());
+        }
+    }
+
+    RecordTimer(RecordTimer const&) = delete;
+    RecordTimer& operator=(RecordTimer const&) = delete;
+
+private:
+    afw::table::BaseRecord & _record;
+    afw::table::Key<std::int64_t> const& _key;
+    std::chrono::steady_clock::time_point _start;
+};
+
+/*
+ * Write a KronReproduction of a source if measuring it (successfully or not) takes longer than
+ * ctrl.slowSourceTime; does nothing if slowSourceTime <= 0
+ */
+class SlowSourceCapture {
+public:
+    SlowSourceCapture(KronFluxControl const& ctrl, std::string const& name,
+                      afw::table::SourceRecord const& source, afw::image::Exposure<float> const& exposure) :
+        _ctrl(ctrl), _name(name), _source(source), _exposure(exposure) {
+        if (_ctrl.slowSourceTime > 0) {
+            _start = std::chrono::steady_clock::now();
+        }
+    }
+    ~SlowSourceCapture() {
+        if (_ctrl.slowSourceTime <= 0) {
+            return;
+        }
+        std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - _start;
+        if (elapsed.count() <= _ctrl.slowSourceTime) {
+            return;
+        }
+        try {
+            std::int64_t const timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+            KronReproduction(_ctrl, _name, _source, _exposure, timeNs).writeFile(
+                (boost::format("%s/%s_%d.kron") % _ctrl.slowSourceDir % _name % _source.getId()).str());
+        } catch (...) {
+            ;                           // failing to capture the source mustn't affect its measurement
+        }
+    }
+
+    SlowSourceCapture(SlowSourceCapture const&) = delete;
+    SlowSourceCapture& operator=(SlowSourceCapture const&) = delete;
+
+private:
+    KronFluxControl const& _ctrl;
+    std::string const& _name;
+    afw::table::SourceRecord const& _source;
+    afw::image::Exposure<float> const& _exposure;
+    std::chrono::steady_clock::time_point _start;
+};
+} // end anonymous namespace
+
 /************************************************************************************************************/
 
 /**
@@ -382,25 +2667,163 @@ KronFluxAlgorithm::KronFluxAlgorithm(
     _radiusForRadiusKey(schema.addField<float>(name + "_radius_for_radius",
                             "radius used to estimate <radius> (sqrt(a*b))")),
     _psfRadiusKey(schema.addField<float>(name + "_psf_radius", "Radius of PSF")),
-    _centroidExtractor(schema, name, true)
+    _nIterForRadiusKey(schema.addField<int>(name + "_nIter",
+                                            "number of iterations used to estimate the Kron radius")),
+    _centroidExtractor(schema, name, true),
+    _smoothedSigma(0.0),
+    _metadata(&metadata)
 {
     _flagHandler = meas::base::FlagHandler::addFields(schema, name, getFlagDefinitions());
+    if (!ctrl.warmStartRadiusName.empty()) {
+        // The seed may already be in our input records; if not, see setWarmStartCatalog
+        try {
+            _warmStartRadiusKey = schema.find<float>(ctrl.warmStartRadiusName).key;
+            _warmStartRadiusForRadiusKey = schema.find<float>(ctrl.warmStartRadiusName + "_for_radius").key;
+        } catch (pex::exceptions::NotFoundError &) {
+        }
+    }
+    if (ctrl.binFactorForRadius > 1) {
+        _binnedRadiusKey = schema.addField<float>(name + "_radius_binned",
+                                                  "Kron radius estimated on the binned image");
+        _pyramid = std::make_shared<KronImagePyramid>();
+    }
+    if (!ctrl.badMaskPlanes.empty()) {
+        _nBadPixelsKey = schema.addField<int>(name + "_nBadPixels",
+                                              "number of masked pixels in the Kron flux aperture");
+    }
+    for (auto const& band : ctrl.bandNames) {
+        _bandFluxResultKeys.push_back(
+            meas::base::FluxResultKey::addFields(schema, name + "_" + band,
+                                                 "flux from Kron Flux algorithm in band " + band));
+    }
     auto metadataName = name + "_nRadiusForflux";
     boost::to_upper(metadataName);
     metadata.add(metadataName, ctrl.nRadiusForFlux);
+    metadata.set(boost::to_upper_copy(name + "_kernel_variant"), getKronKernelVariant());
+    if (ctrl.doCollectStats) {
+        _stats = std::make_shared<KronStats>(getFlagDefinitions().size());
+    }
+    if (ctrl.doRecordCost) {
+        _timeKey = schema.addField<std::int64_t>(name + "_time_ns", "time taken to measure the source", "ns");
+        _nPixRadiusKey = schema.addField<int>(
+            name + "_npix_radius", "approximate number of pixels read to estimate the Kron radius");
+        _nPixFluxKey = schema.addField<int>(name + "_npix_flux",
+                                            "approximate number of pixels read to measure the Kron flux");
+    }
+}
+
+void KronFluxAlgorithm::writeStats() const
+{
+    if (_stats) {
+        _stats->write(*_metadata, boost::to_upper_copy(_name + "_stats"), getFlagDefinitions());
+    }
+}
+
+void KronFluxAlgorithm::setWarmStartCatalog(afw::table::SourceCatalog const& prior)
+{
+    std::string const radiusName = _ctrl.warmStartRadiusName.empty() ?
+        _name + "_radius" : _ctrl.warmStartRadiusName;
+    afw::table::Schema const schema = prior.getSchema();
+    afw::table::Key<float> const radiusKey = schema.find<float>(radiusName).key;
+    afw::table::Key<float> radiusForRadiusKey;
+    try {
+        radiusForRadiusKey = schema.find<float>(radiusName + "_for_radius").key;
+    } catch (pex::exceptions::NotFoundError &) {
+    }
+
+    auto seeds = std::make_shared<WarmStartMap>();
+    seeds->reserve(prior.size());
+    for (auto const& record : prior) {
+        float const radiusForRadius = radiusForRadiusKey.isValid() ?
+            record.get(radiusForRadiusKey) : std::nanf("");
+        (*seeds)[record.getId()] = std::make_pair(record.get(radiusKey), radiusForRadius);
+    }
+    _warmStartSeeds = seeds;
+}
+
+void KronFluxAlgorithm::setSmoothedImage(std::shared_ptr<afw::image::Image<float> const> const& image,
+                                         double sigma)
+{
+    _smoothedImage = image;
+    _smoothedSigma = sigma;
+    _smoothedCtrl = _ctrl;
+    _smoothedCtrl.smoothingSigma = -1;  // it's already been smoothed
+}
+
+KronMaskedPixelView<float> KronFluxAlgorithm::_getSmoothedView(
+    afw::image::MaskedImage<float> const& mimage
+    ) const
+{
+    if (_smoothedImage->getBBox() != mimage.getBBox()) {
+        throw LSST_EXCEPT(pex::exceptions::LengthError,
+                          (boost::format("Smoothed image's bounding box %s doesn't match exposure's %s")
+                           % _smoothedImage->getBBox() % mimage.getBBox()).str());
+    }
+    return KronMaskedPixelView<float>(KronPixelView<float>(*_smoothedImage),
+                                      KronPixelView<afw::image::VariancePixel>(*mimage.getVariance()),
+                                      KronPixelView<afw::image::MaskPixel>(*mimage.getMask()));
+}
+
+std::shared_ptr<KronAperture> KronFluxAlgorithm::_warmStart(
+    afw::table::SourceRecord const& source,
+    KronMaskedPixelView<float> const& image,
+    Control const& ctrl,
+    afw::geom::ellipses::Axes const& axes,
+    geom::Point2D const& center
+    ) const
+{
+    float radius = std::nanf("");
+    float radiusForRadius = std::nanf("");
+    if (_warmStartRadiusKey.isValid()) {
+        radius = source.get(_warmStartRadiusKey);
+        if (_warmStartRadiusForRadiusKey.isValid()) {
+            radiusForRadius = source.get(_warmStartRadiusForRadiusKey);
+        }
+    }
+    if (!(radius > 0) && _warmStartSeeds) {
+        auto const seed = _warmStartSeeds->find(source.getId());
+        if (seed != _warmStartSeeds->end()) {
+            std::tie(radius, radiusForRadius) = seed->second;
+        }
+    }
+    if (!(radius > 0 && radius <= _ctrl.maxRadius) || !(axes.getDeterminantRadius() > 0)) {
+        return nullptr;
+    }
+    //
+    // Repeat the last iteration of the previous run:  use the aperture it used if we know it,
+    // otherwise the one corresponding to its Kron radius
+    //
+    double const seedRadius = (radiusForRadius > 0) ? radiusForRadius/_ctrl.nSigmaForRadius : radius;
+    afw::geom::ellipses::Axes seedAxes(axes);
+    seedAxes.scale(seedRadius/seedAxes.getDeterminantRadius());
+
+    std::shared_ptr<KronAperture> aperture;
+    if (KronAperture::tryRefineRadius(aperture, image, seedAxes, center, ctrl) != KronStatus::OK ||
+        std::fabs(aperture->getAxes().getDeterminantRadius()/radius - 1) > _ctrl.warmStartTolerance) {
+        return nullptr;                 // the seed is inconsistent with the data
+    }
+
+    return aperture;
 }
 
 void KronFluxAlgorithm::fail(
     afw::table::SourceRecord & measRecord,
     meas::base::MeasurementError * error
 ) const {
+    KRON_PROBE(measure__fail, measRecord.getId(),
+               error ? static_cast<std::int64_t>(error->getFlagBit()) : std::int64_t(-1));
     _flagHandler.handleFailure(measRecord, error);
+    if (_stats) {
+        _stats->add(KronStats::FAILURES);
+        countFlags(*_stats, _flagHandler, measRecord);
+    }
 }
 
 void KronFluxAlgorithm::_applyAperture(
     afw::table::SourceRecord & source,
-    afw::image::Exposure<float> const& exposure,
-    KronAperture const& aperture
+    KronMaskedPixelView<float> const& image,
+    KronAperture const& aperture,
+    FluxMeasurement const* flux
     ) const
 {
     double const rad = aperture.getAxes().getDeterminantRadius();
@@ -412,22 +2835,41 @@ void KronFluxAlgorithm::_applyAperture(
         );
     }
 
+    if (!_ctrl.doMeasureFlux) {
+        // only the radius is wanted; leave the flux as NaN
+        source.set(_radiusKey, aperture.getAxes().getDeterminantRadius());
+        return;
+    }
+
     std::pair<double, double> result;
-    try {
-        result = aperture.measureFlux(exposure.getMaskedImage(), _ctrl.nRadiusForFlux, _ctrl.maxSincRadius);
-    } catch (pex::exceptions::LengthError const& e) {
-        // We hit the edge of the image; there's no reasonable fallback or recovery
-        throw LSST_EXCEPT(
-            meas::base::MeasurementError,
-            EDGE.doc,
-            EDGE.number
-        );
-    } catch(lsst::pex::exceptions::OutOfRangeError &e) {
-	    throw LSST_EXCEPT(
+    int nBadPixels = 0;
+    KronStatus status;
+    if (flux) {
+        status = flux->status;
+        result = flux->result;
+        nBadPixels = flux->nBadPixels;
+        if (_stats) {
+            countFlux(*_stats, aperture, _ctrl, status);
+        }
+    } else {
+        StageTimer timer(_stats.get(), KronStats::SINC_FLUX_TIME);
+        status = aperture.tryMeasureFlux(result, image, _ctrl.nRadiusForFlux, _ctrl.maxSincRadius,
+                                         _ctrl.clipEdgeApertures, _ctrl.doMeasureFluxErr,
+                                         _ctrl.getBadPixelMask(), _ctrl.replaceBadPixels, &nBadPixels);
+        if (_stats && !countFlux(*_stats, aperture, _ctrl, status)) {
+            timer.setTimer(KronStats::SUMMED_FLUX_TIME);
+        }
+    }
+    if (status == KronStatus::EDGE) {
+        if (!_ctrl.clipEdgeApertures) {
+            // We hit the edge of the image; there's no reasonable fallback or recovery
+            throw LSST_EXCEPT(
                 meas::base::MeasurementError,
                 EDGE.doc,
                 EDGE.number
             );
+        }
+        _flagHandler.setValue(source, EDGE.number, true); // we only measured the part on the image
     }
 
     // set the results in the source object
@@ -436,11 +2878,32 @@ void KronFluxAlgorithm::_applyAperture(
     fluxResult.instFluxErr = result.second;
     source.set(_fluxResultKey, fluxResult);
     source.set(_radiusKey, aperture.getAxes().getDeterminantRadius());
+    if (_nBadPixelsKey.isValid()) {
+        source.set(_nBadPixelsKey, nBadPixels);
+    }
+    if (_nPixFluxKey.isValid()) {
+        source.set(_nPixFluxKey, static_cast<int>(getFluxPixels(aperture, _ctrl.nRadiusForFlux)));
+    }
     //
     //  REMINDER:  In the old code, the psfFactor is calculated using getPsfFactor,
     //  and the values set for _fluxCorrectionKeys.  See old meas_algorithms version.
 }
 
+KronAperture KronFluxAlgorithm::_getForcedAperture(
+        afw::table::SourceRecord const & reference,
+        geom::AffineTransform const & refToMeas
+    ) const
+{
+    if (_apertureTable) {
+        KronApertureRecord const* record = _apertureTable->find(reference.getId());
+        if (record) {
+            return KronApertureTable::makeAperture(*record, refToMeas);
+        }
+    }
+    float const radius = reference.get(reference.getSchema().find<float>(_ctrl.refRadiusName).key);
+    return KronAperture(reference, refToMeas, radius);
+}
+
 void KronFluxAlgorithm::_applyForced(
         afw::table::SourceRecord & source,
         afw::image::Exposure<float> const & exposure,
@@ -449,31 +2912,20 @@ void KronFluxAlgorithm::_applyForced(
         geom::AffineTransform const & refToMeas
     ) const
 {
-    float const radius = reference.get(reference.getSchema().find<float>(_ctrl.refRadiusName).key);
-    KronAperture const aperture(reference, refToMeas, radius);
-    _applyAperture(source, exposure, aperture);
+    KronAperture const aperture = _getForcedAperture(reference, refToMeas);
+    _applyAperture(source, KronMaskedPixelView<float>(exposure.getMaskedImage()), aperture);
     if (exposure.getPsf()) {
+        StageTimer timer(_stats.get(), KronStats::PSF_RADIUS_TIME);
         source.set(_psfRadiusKey, calculatePsfKronRadius(exposure.getPsf(), center, _ctrl.smoothingSigma));
     }
 }
 
-void KronFluxAlgorithm::measure(
-                      afw::table::SourceRecord & source,
-                      afw::image::Exposure<float> const& exposure
-                     ) const {
-    geom::Point2D center = _centroidExtractor(source, _flagHandler);
-
-    // Did we hit a condition that fundamentally prevented measuring the Kron flux?
-    // Such conditions include hitting the edge of the image and bad input shape, but not low signal-to-noise.
-    bool bad = false;
-
-    afw::image::MaskedImage<float> const& mimage = exposure.getMaskedImage();
-
-    double R_K_psf = -1;
-    if (exposure.getPsf()) {
-        R_K_psf = calculatePsfKronRadius(exposure.getPsf(), center, _ctrl.smoothingSigma);
-    }
-
+afw::geom::ellipses::Axes KronFluxAlgorithm::_getInitialAxes(
+    afw::table::SourceRecord & source,
+    afw::image::Exposure<float> const& exposure,
+    bool & bad
+    ) const
+{
     //
     // Get the shape of the desired aperture
     //
@@ -506,36 +2958,23 @@ void KronFluxAlgorithm::measure(
             axes.scale(radius0/axes.getDeterminantRadius());
         }
     }
+    return axes;
+}
 
-    std::shared_ptr<KronAperture> aperture;
-    if (_ctrl.fixed) {
-        aperture.reset(new KronAperture(source));
-    } else {
-        try {
-            aperture = KronAperture::determineRadius(mimage, axes, center, _ctrl);
-        } catch (pex::exceptions::OutOfRangeError& e) {
-            // We hit the edge of the image: no reasonable fallback or recovery possible
-            throw LSST_EXCEPT(
-                meas::base::MeasurementError,
-                EDGE.doc,
-                EDGE.number
-            );
-        } catch (BadKronException& e) {
-            // Not setting bad=true because we only failed due to low S/N
-            aperture = _fallbackRadius(source, R_K_psf, e);
-        } catch(pex::exceptions::Exception& e) {
-            bad = true; // There's something fundamental keeping us from measuring the Kron aperture
-            aperture = _fallbackRadius(source, R_K_psf, e);
-        }
-    }
-
+void KronFluxAlgorithm::_enforceMinimumRadius(
+    afw::table::SourceRecord & source,
+    afw::image::Exposure<float> const& exposure,
+    KronAperture & aperture,
+    double const R_K_psf
+    ) const
+{
     /*
      * Estimate the minimum acceptable Kron radius as the Kron radius of the PSF or the
      * provided minimum radius
      */
 
     // Enforce constraints on minimum radius
-    double rad = aperture->getAxes().getDeterminantRadius();
+    double rad = aperture.getAxes().getDeterminantRadius();
     if (_ctrl.enforceMinimumRadius) {
         double newRadius = rad;
         if (_ctrl.minimumRadius > 0.0) {
@@ -554,35 +2993,440 @@ void KronFluxAlgorithm::measure(
             _flagHandler.setValue(source, USED_PSF_RADIUS.number, true);
         }
         if (newRadius != rad) {
-            aperture->getAxes().scale(newRadius/rad);
+            KRON_PROBE(minimum__radius, source.getId(), probeRadius(rad), probeRadius(newRadius));
+            aperture.getAxes().scale(newRadius/rad);
             _flagHandler.setValue(source, SMALL_RADIUS.number, true); // guilty after all
         }
     }
+}
 
-    _applyAperture(source, exposure, *aperture);
-    source.set(_radiusForRadiusKey, aperture->getRadiusForRadius());
+void KronFluxAlgorithm::_setResults(
+    afw::table::SourceRecord & source,
+    KronMaskedPixelView<float> const& image,
+    KronAperture const& aperture,
+    double const R_K_psf,
+    bool const bad,
+    FluxMeasurement const* flux
+    ) const
+{
+    _applyAperture(source, image, aperture, flux);
+    source.set(_radiusForRadiusKey, aperture.getRadiusForRadius());
     source.set(_psfRadiusKey, R_K_psf);
+    source.set(_nIterForRadiusKey, aperture.getNIterForRadius());
+    if (_binnedRadiusKey.isValid()) {
+        source.set(_binnedRadiusKey, aperture.getBinnedRadius());
+    }
+    if (_nPixRadiusKey.isValid()) {
+        source.set(_nPixRadiusKey, static_cast<int>(getRadiusPixels(aperture)));
+    }
     if (bad) _flagHandler.setValue(source, FAILURE.number, true);
 }
 
+void KronFluxAlgorithm::measure(
+                      afw::table::SourceRecord & source,
+                      afw::image::Exposure<float> const& exposure
+                     ) const {
+    SlowSourceCapture const capture(_ctrl, _name, source, exposure);
+    RecordTimer const recordTimer(source, _timeKey);
+    KRON_PROBE(measure__start, source.getId(),
+               static_cast<std::int64_t>(source.getFootprint() ? source.getFootprint()->getArea() : 0));
+    if (_stats) {
+        _stats->add(KronStats::MEASURE_CALLS);
+    }
+    geom::Point2D center = _centroidExtractor(source, _flagHandler);
+
+    // Did we hit a condition that fundamentally prevented measuring the Kron flux?
+    // Such conditions include hitting the edge of the image and bad input shape, but not low signal-to-noise.
+    bool bad = false;
+
+    afw::image::MaskedImage<float> const& mimage = exposure.getMaskedImage();
+    //
+    // If we're measuring a deblended child, we may use the pixels in its HeavyFootprint rather than
+    // the exposure, which the NoiseReplacer would otherwise have to modify
+    //
+    std::shared_ptr<afw::detection::HeavyFootprint<float> const> heavy;
+    if (_ctrl.useHeavyFootprint) {
+        heavy = std::dynamic_pointer_cast<afw::detection::HeavyFootprint<float> const>(source.getFootprint());
+    }
+    std::unique_ptr<afw::image::MaskedImage<float>> child; // the child's pixels; zero outside its Footprint
+    if (heavy) {
+        child.reset(new afw::image::MaskedImage<float>(heavy->getBBox()));
+        heavy->insert(*child);
+    }
+    KronMaskedPixelView<float> const image = heavy ? KronMaskedPixelView<float>(*child, mimage.getBBox()) :
+        KronMaskedPixelView<float>(mimage);
+    // The image and configuration to use to estimate the Kron radius
+    bool const useSmoothedImage = _smoothedImage && !heavy;
+    KronMaskedPixelView<float> const radiusImage = useSmoothedImage ? _getSmoothedView(mimage) : image;
+    Control const& radiusCtrl = useSmoothedImage ? _smoothedCtrl : _ctrl;
+
+    double R_K_psf = -1;
+    if (exposure.getPsf()) {
+        StageTimer timer(_stats.get(), KronStats::PSF_RADIUS_TIME);
+        R_K_psf = calculatePsfKronRadius(exposure.getPsf(), center,
+                                         useSmoothedImage ? _smoothedSigma : _ctrl.smoothingSigma);
+    }
+
+    afw::geom::ellipses::Axes axes = _getInitialAxes(source, exposure, bad);
+
+    std::shared_ptr<KronAperture> aperture;
+    if (_ctrl.fixed) {
+        aperture.reset(new KronAperture(source));
+    } else {
+        if (_pyramid && !heavy && source.getFootprint()) {
+            // The pixels in the source's Footprint may have changed (e.g. the NoiseReplacer inserted it)
+            _pyramid->markDirty(source.getFootprint()->getBBox());
+        }
+        KronStatus status = KronStatus::OK;
+        bool const smoothed = useSmoothedImage || radiusCtrl.smoothingSigma > 0;
+        if (_stats) {
+            _stats->add(smoothed ? KronStats::SMOOTHED_RADIUS_CALLS : KronStats::RADIUS_CALLS);
+        }
+        StageTimer timer(_stats.get(), smoothed ? KronStats::SMOOTHED_RADIUS_TIME : KronStats::RADIUS_TIME);
+        try {
+            if (_warmStartRadiusKey.isValid() || _warmStartSeeds) {
+                aperture = _warmStart(source, radiusImage, radiusCtrl, axes, center);
+                KRON_PROBE(warm__start, source.getId(), static_cast<int>(aperture != nullptr));
+                if (_stats) {
+                    _stats->add(aperture ? KronStats::WARM_START_ACCEPTED : KronStats::WARM_START_REJECTED);
+                }
+            }
+            if (!aperture) {
+                // The pyramid is built from the exposure, so it's no use for a HeavyFootprint
+                // or a pre-smoothed image
+                status = KronAperture::tryDetermineRadius(aperture, radiusImage, axes, center, radiusCtrl,
+                                                          (heavy || useSmoothedImage) ? nullptr :
+                                                          _pyramid.get());
+            }
+        } catch (pex::exceptions::OutOfRangeError& e) {
+            // We hit the edge of the image: no reasonable fallback or recovery possible
+            if (_stats) {
+                _stats->add(KronStats::EDGE_EXCEPTIONS);
+            }
+            throw LSST_EXCEPT(
+                meas::base::MeasurementError,
+                EDGE.doc,
+                EDGE.number
+            );
+        } catch(pex::exceptions::Exception& e) {
+            if (_stats) {
+                _stats->add(KronStats::RADIUS_EXCEPTIONS);
+            }
+            bad = true; // There's something fundamental keeping us from measuring the Kron aperture
+            aperture = _fallbackRadius(source, R_K_psf);
+        }
+        timer.stop();
+        if (status != KronStatus::OK) {
+            // Not setting bad=true because we only failed due to low S/N
+            aperture = _fallbackRadius(source, R_K_psf);
+        } else if (_stats) {
+            countRadius(*_stats, *aperture);
+        }
+    }
+
+    _enforceMinimumRadius(source, exposure, *aperture, R_K_psf);
+    _setResults(source, image, *aperture, R_K_psf, bad);
+    KRON_PROBE(measure__end, source.getId(), probeRadius(aperture->getAxes().getDeterminantRadius()),
+               probeArea(_ctrl.nRadiusForFlux*aperture->getAxes().getDeterminantRadius()));
+    if (_stats) {
+        countFlags(*_stats, _flagHandler, source);
+    }
+}
+
+void KronFluxAlgorithm::measureN(
+    afw::table::SourceCatalog const& measCat,
+    afw::image::Exposure<float> const& exposure
+    ) const
+{
+    //
+    // Measure each source on its own, failing just that source if there's a problem
+    //
+    auto measureOne = [this](afw::table::SourceRecord & source, std::function<void()> const& func) {
+        try {
+            func();
+        } catch (meas::base::MeasurementError & e) {
+            fail(source, &e);
+        } catch (pex::exceptions::Exception &) {
+            fail(source);
+        }
+    };
+
+    if (_stats) {
+        _stats->add(KronStats::MEASURE_N_CALLS);
+    }
+    Control const& radiusCtrl = _smoothedImage ? _smoothedCtrl : _ctrl;
+    if (_ctrl.fixed || radiusCtrl.smoothingSigma > 0 || _ctrl.binFactorForRadius > 1 ||
+        _ctrl.radiusTolerance > 0 || _ctrl.replaceBadPixels || _ctrl.useHeavyFootprint ||
+        _warmStartRadiusKey.isValid() || _warmStartSeeds) {
+        for (auto & source : measCat) {
+            measureOne(source, [&]() { measure(source, exposure); });
+        }
+        return;
+    }
+
+    KronMaskedPixelView<float> const image(exposure.getMaskedImage());
+    KronMaskedPixelView<float> const radiusImage = _smoothedImage ?
+        _getSmoothedView(exposure.getMaskedImage()) : image;
+    //
+    // Find the initial apertures of the sources that we can measure
+    //
+    std::vector<std::shared_ptr<afw::table::SourceRecord>> sources;
+    std::vector<geom::Point2D> centers;
+    std::vector<afw::geom::ellipses::Axes> axes;
+    std::vector<double> psfRadii;
+    std::vector<char> bad;
+    for (std::size_t i = 0; i < measCat.size(); ++i) {
+        std::shared_ptr<afw::table::SourceRecord> const source = measCat.get(i);
+        measureOne(*source, [&]() {
+            geom::Point2D const center = _centroidExtractor(*source, _flagHandler);
+            double R_K_psf = -1;
+            if (exposure.getPsf()) {
+                StageTimer timer(_stats.get(), KronStats::PSF_RADIUS_TIME);
+                R_K_psf = calculatePsfKronRadius(exposure.getPsf(), center,
+                                                 _smoothedImage ? _smoothedSigma : _ctrl.smoothingSigma);
+            }
+            bool isBad = false;
+            afw::geom::ellipses::Axes const sourceAxes = _getInitialAxes(*source, exposure, isBad);
+
+            sources.push_back(source);
+            centers.push_back(center);
+            axes.push_back(sourceAxes);
+            psfRadii.push_back(R_K_psf);
+            bad.push_back(isBad);
+        });
+    }
+    //
+    // Find all the Kron radii together
+    //
+    std::vector<std::shared_ptr<KronAperture>> apertures;
+    std::vector<KronStatus> status;
+    if (_stats) {
+        _stats->add(_smoothedImage ? KronStats::SMOOTHED_RADIUS_CALLS : KronStats::RADIUS_CALLS,
+                    sources.size());
+    }
+    try {
+        StageTimer timer(_stats.get(), _smoothedImage ? KronStats::SMOOTHED_RADIUS_TIME :
+                         KronStats::RADIUS_TIME);
+        status = KronAperture::tryDetermineRadii(apertures, radiusImage, axes, centers, radiusCtrl);
+    } catch (pex::exceptions::Exception &) {
+        if (_stats) {
+            _stats->add(KronStats::RADIUS_EXCEPTIONS);
+        }
+        status.assign(sources.size(), KronStatus::FAILURE);
+        apertures.assign(sources.size(), nullptr);
+    }
+
+    std::vector<bool> measured(sources.size(), false);
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        measureOne(*sources[i], [&]() {
+            if (status[i] == KronStatus::FAILURE) {
+                bad[i] = true; // There's something fundamental keeping us from measuring the Kron aperture
+                apertures[i] = _fallbackRadius(*sources[i], psfRadii[i]);
+            } else if (status[i] != KronStatus::OK) {
+                // Not setting bad=true because we only failed due to low S/N
+                apertures[i] = _fallbackRadius(*sources[i], psfRadii[i]);
+            } else if (_stats) {
+                countRadius(*_stats, *apertures[i]);
+            }
+            _enforceMinimumRadius(*sources[i], exposure, *apertures[i], psfRadii[i]);
+            measured[i] = true;
+        });
+    }
+    //
+    // Measure all the fluxes together
+    //
+    std::vector<std::shared_ptr<KronAperture const>> fluxApertures;
+    std::vector<std::size_t> fluxIndex;
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        if (measured[i] && apertures[i]->getAxes().getDeterminantRadius() >=
+            std::numeric_limits<double>::epsilon()) { // _applyAperture will reject the rest
+            fluxApertures.push_back(apertures[i]);
+            fluxIndex.push_back(i);
+        }
+    }
+    std::vector<FluxMeasurement> fluxes(sources.size());
+    if (_ctrl.doMeasureFlux) {
+        std::vector<std::pair<double, double>> results;
+        std::vector<int> nBadPixels;
+        StageTimer timer(_stats.get(), KronStats::JOINT_FLUX_TIME);
+        std::vector<KronStatus> fluxStatus =
+            KronAperture::tryMeasureFluxes(results, nBadPixels, fluxApertures, image, _ctrl);
+        timer.stop();
+        for (std::size_t j = 0; j < fluxIndex.size(); ++j) {
+            fluxes[fluxIndex[j]] = FluxMeasurement{fluxStatus[j], results[j], nBadPixels[j]};
+        }
+    }
+
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        if (measured[i]) {
+            measureOne(*sources[i], [&]() {
+                _setResults(*sources[i], image, *apertures[i], psfRadii[i], bad[i], &fluxes[i]);
+                if (_stats) {
+                    countFlags(*_stats, _flagHandler, *sources[i]);
+                }
+            });
+        }
+    }
+}
+
 void KronFluxAlgorithm::measureForced(
         afw::table::SourceRecord & measRecord,
         afw::image::Exposure<float> const & exposure,
         afw::table::SourceRecord const & refRecord,
         afw::geom::SkyWcs const & refWcs
     ) const {
+    RecordTimer const recordTimer(measRecord, _timeKey);
+    if (_stats) {
+        _stats->add(KronStats::MEASURE_FORCED_CALLS);
+    }
     geom::Point2D center = _centroidExtractor(measRecord, _flagHandler);
     auto xytransform = afw::geom::makeWcsPairTransform(refWcs, *exposure.getWcs());
     _applyForced(measRecord, exposure, center, refRecord,
                     linearizeTransform(*xytransform, refRecord.getCentroid())
                 );
+    if (_stats) {
+        countFlags(*_stats, _flagHandler, measRecord);
+    }
+}
+
+void KronFluxAlgorithm::measureForcedBands(
+        afw::table::SourceRecord & measRecord,
+        std::vector<std::shared_ptr<afw::image::Exposure<float> const>> const & exposures,
+        afw::table::SourceRecord const & refRecord,
+        afw::geom::SkyWcs const & refWcs
+    ) const {
+    RecordTimer const recordTimer(measRecord, _timeKey);
+    if (_stats) {
+        _stats->add(KronStats::MEASURE_FORCED_BANDS_CALLS);
+    }
+    if (exposures.size() != _bandFluxResultKeys.size()) {
+        throw LSST_EXCEPT(pex::exceptions::LengthError,
+                          (boost::format("Expected %d exposures (one per bandNames); saw %d")
+                           % _bandFluxResultKeys.size() % exposures.size()).str());
+    }
+    if (exposures.empty()) {
+        return;
+    }
+    afw::image::Exposure<float> const& exposure = *exposures.front();
+    geom::Point2D center = _centroidExtractor(measRecord, _flagHandler);
+    auto xytransform = afw::geom::makeWcsPairTransform(refWcs, *exposure.getWcs());
+    KronAperture const aperture =
+        _getForcedAperture(refRecord, linearizeTransform(*xytransform, refRecord.getCentroid()));
+    if (aperture.getAxes().getDeterminantRadius() < std::numeric_limits<double>::epsilon()) {
+        throw LSST_EXCEPT(
+            meas::base::MeasurementError,
+            BAD_RADIUS.doc,
+            BAD_RADIUS.number
+        );
+    }
+
+    std::vector<KronMaskedPixelView<float>> images;
+    images.reserve(exposures.size());
+    for (auto const& exp : exposures) {
+        images.emplace_back(exp->getMaskedImage());
+    }
+    std::vector<std::pair<double, double>> results;
+    std::vector<int> nBadPixels;
+    StageTimer timer(_stats.get(), KronStats::SINC_FLUX_TIME);
+    KronStatus const status = aperture.tryMeasureFluxBands(results, nBadPixels, images, _ctrl.nRadiusForFlux,
+                                                           _ctrl.maxSincRadius, _ctrl.clipEdgeApertures,
+                                                           _ctrl.doMeasureFluxErr, _ctrl.getBadPixelMask());
+    if (_stats && !countFlux(*_stats, aperture, _ctrl, status)) {
+        timer.setTimer(KronStats::SUMMED_FLUX_TIME);
+    }
+    timer.stop();
+    if (status == KronStatus::EDGE) {
+        if (!_ctrl.clipEdgeApertures) {
+            throw LSST_EXCEPT(
+                meas::base::MeasurementError,
+                EDGE.doc,
+                EDGE.number
+            );
+        }
+        _flagHandler.setValue(measRecord, EDGE.number, true); // we only measured the part on the image
+    }
+
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        meas::base::FluxResult fluxResult;
+        fluxResult.instFlux = results[i].first;
+        fluxResult.instFluxErr = results[i].second;
+        measRecord.set(_bandFluxResultKeys[i], fluxResult);
+    }
+    measRecord.set(_radiusKey, aperture.getAxes().getDeterminantRadius());
+    if (_nPixFluxKey.isValid()) {
+        std::int64_t const nPix = images.size()*getFluxPixels(aperture, _ctrl.nRadiusForFlux);
+        measRecord.set(_nPixFluxKey, static_cast<int>(nPix));
+    }
+    if (exposure.getPsf()) {
+        StageTimer psfTimer(_stats.get(), KronStats::PSF_RADIUS_TIME);
+        measRecord.set(_psfRadiusKey,
+                       calculatePsfKronRadius(exposure.getPsf(), center, _ctrl.smoothingSigma));
+    }
+    if (_stats) {
+        countFlags(*_stats, _flagHandler, measRecord);
+    }
+}
 
+
+KronApertureTable::KronApertureTable(afw::table::SourceCatalog const& refCat, KronFluxControl const& ctrl) :
+    _size(refCat.size())
+{
+    auto const radiusKey = refCat.getSchema().find<float>(ctrl.refRadiusName).key;
+    std::shared_ptr<KronApertureRecord> data(new KronApertureRecord[_size],
+                                             std::default_delete<KronApertureRecord[]>());
+    for (std::size_t i = 0; i < _size; ++i) {
+        afw::table::SourceRecord const& reference = refCat[i];
+        double const radius = reference.get(radiusKey);
+        geom::Point2D const center = reference.getCentroid();
+        // As KronAperture::getKronAxes, but without transforming the axes to another frame
+        afw::geom::ellipses::Axes axes(reference.getShape());
+        axes.scale(radius/axes.getDeterminantRadius());
+        data.get()[i] = {reference.getId(), center.getX(), center.getY(),
+                         axes.getA(), axes.getB(), axes.getTheta(), radius};
+    }
+    std::sort(data.get(), data.get() + _size,
+              [](KronApertureRecord const& r1, KronApertureRecord const& r2) { return r1.id < r2.id; });
+    _data = data;
+}
+
+KronApertureTable::KronApertureTable(
+    std::shared_ptr<KronApertureRecord const> const& data,
+    std::size_t size
+    ) :
+    _data(data), _size(size)
+{
+    for (std::size_t i = 1; i < _size; ++i) {
+        if (_data.get()[i].id < _data.get()[i - 1].id) {
+            throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                              (boost::format("Kron aperture records aren't sorted by id (record %d)")
+                               % i).str());
+        }
+    }
 }
 
+KronApertureRecord const* KronApertureTable::find(afw::table::RecordId id) const
+{
+    KronApertureRecord const* record = std::lower_bound(begin(), end(), id,
+        [](KronApertureRecord const& rec, afw::table::RecordId id) { return rec.id < id; });
+    return (record != end() && record->id == id) ? record : nullptr;
+}
+
+KronAperture KronApertureTable::makeAperture(
+    KronApertureRecord const& record,
+    geom::AffineTransform const& refToMeas
+    )
+{
+    afw::geom::ellipses::Axes const axes(record.a, record.b, record.theta);
+    afw::geom::ellipses::Axes const measAxes = axes.transform(refToMeas.getLinear());
+    return KronAperture(refToMeas(geom::Point2D(record.x, record.y)), measAxes);
+}
 
-std::shared_ptr<KronAperture> KronFluxAlgorithm::_fallbackRadius(afw::table::SourceRecord& source, double const R_K_psf,
-                                            pex::exceptions::Exception& exc) const
+std::shared_ptr<KronAperture> KronFluxAlgorithm::_fallbackRadius(afw::table::SourceRecord& source,
+                                                                 double const R_K_psf) const
 {
+    if (_stats) {
+        _stats->add(KronStats::FALLBACK_RADIUS);
+    }
     _flagHandler.setValue(source, BAD_RADIUS.number, true);
     double newRadius;
     if (_ctrl.minimumRadius > 0) {
@@ -598,25 +3442,127 @@ std::shared_ptr<KronAperture> KronFluxAlgorithm::_fallbackRadius(afw::table::Sou
             NO_FALLBACK_RADIUS.number
         );
     }
+    KRON_PROBE(fallback__radius, source.getId(), probeRadius(newRadius),
+               static_cast<int>(_ctrl.minimumRadius <= 0));
     std::shared_ptr<KronAperture> aperture(new KronAperture(source));
     aperture->getAxes().scale(newRadius/aperture->getAxes().getDeterminantRadius());
     return aperture;
 }
 
 
-#define INSTANTIATE(TYPE) \
-template std::shared_ptr<KronAperture> KronAperture::determineRadius<afw::image::MaskedImage<TYPE> >( \
-    afw::image::MaskedImage<TYPE> const&, \
+#define INSTANTIATE_IMAGE(IMAGE) \
+template KronStatus KronAperture::tryRefineRadius<IMAGE >( \
+    std::shared_ptr<KronAperture> &, \
+    IMAGE const&, \
     afw::geom::ellipses::Axes, \
     geom::Point2D const&, \
     KronFluxControl const& \
     ); \
-template std::pair<double, double> KronAperture::measureFlux<afw::image::MaskedImage<TYPE> >( \
-    afw::image::MaskedImage<TYPE> const&, \
+template std::shared_ptr<KronAperture> KronAperture::refineRadius<IMAGE >( \
+    IMAGE const&, \
+    afw::geom::ellipses::Axes, \
+    geom::Point2D const&, \
+    KronFluxControl const& \
+    ); \
+template KronStatus KronAperture::tryConvergeRadius<IMAGE >( \
+    std::shared_ptr<KronAperture> &, \
+    IMAGE const&, \
+    afw::geom::ellipses::Axes, \
+    geom::Point2D const&, \
+    KronFluxControl const& \
+    ); \
+template std::shared_ptr<KronAperture> KronAperture::convergeRadius<IMAGE >( \
+    IMAGE const&, \
+    afw::geom::ellipses::Axes, \
+    geom::Point2D const&, \
+    KronFluxControl const& \
+    ); \
+template KronStatus KronAperture::tryDetermineRadius<IMAGE >( \
+    std::shared_ptr<KronAperture> &, \
+    IMAGE const&, \
+    afw::geom::ellipses::Axes, \
+    geom::Point2D const&, \
+    KronFluxControl const&, \
+    KronImagePyramid * \
+    ); \
+template std::shared_ptr<KronAperture> KronAperture::determineRadius<IMAGE >( \
+    IMAGE const&, \
+    afw::geom::ellipses::Axes, \
+    geom::Point2D const&, \
+    KronFluxControl const&, \
+    KronImagePyramid * \
+    ); \
+template KronStatus KronAperture::tryMeasureFlux<IMAGE >( \
+    std::pair<double, double> &, \
+    IMAGE const&, \
+    double const, \
+    double const, \
+    bool const, \
+    bool const, \
+    afw::image::MaskPixel const, \
+    bool const, \
+    int * \
+    ) const; \
+template std::vector<KronStatus> KronAperture::tryDetermineRadii<IMAGE >( \
+    std::vector<std::shared_ptr<KronAperture>> &, \
+    IMAGE const&, \
+    std::vector<afw::geom::ellipses::Axes> const&, \
+    std::vector<geom::Point2D> const&, \
+    KronFluxControl const& \
+    ); \
+template std::vector<KronStatus> KronAperture::tryMeasureFluxes<IMAGE >( \
+    std::vector<std::pair<double, double>> &, \
+    std::vector<int> &, \
+    std::vector<std::shared_ptr<KronAperture const>> const&, \
+    IMAGE const&, \
+    KronFluxControl const& \
+    ); \
+template std::pair<double, double> KronAperture::measureFlux<IMAGE >( \
+    IMAGE const&, \
     double const, \
     double const \
-    ) const;
+    ) const; \
+template KronStatus KronAperture::tryMeasureFluxBands<IMAGE >( \
+    std::vector<std::pair<double, double>> &, \
+    std::vector<int> &, \
+    std::vector<IMAGE > const&, \
+    double const, \
+    double const, \
+    bool const, \
+    bool const, \
+    afw::image::MaskPixel const \
+    ) const; \
+template std::vector<std::pair<double, double>> KronAperture::measureFluxBands<IMAGE >( \
+    std::vector<IMAGE > const&, \
+    double const, \
+    double const \
+    ) const; \
+template std::vector<KronBatchResult> KronAperture::measureBatch<IMAGE >( \
+    IMAGE const&, \
+    ndarray::Array<double const, 1> const&, \
+    ndarray::Array<double const, 1> const&, \
+    ndarray::Array<double const, 1> const&, \
+    ndarray::Array<double const, 1> const&, \
+    ndarray::Array<double const, 1> const&, \
+    KronFluxControl const&, \
+    int \
+    );
+
+#define INSTANTIATE(TYPE) \
+template std::shared_ptr<KronImagePyramid::Level const> KronImagePyramid::getLevel<TYPE>( \
+    std::shared_ptr<afw::image::Image<TYPE> const> const&, \
+    int \
+    ); \
+template std::shared_ptr<KronImagePyramid::Level const> KronImagePyramid::getLevel<TYPE>( \
+    KronPixelView<TYPE> const&, \
+    int \
+    ); \
+INSTANTIATE_IMAGE(afw::image::MaskedImage<TYPE>) \
+INSTANTIATE_IMAGE(KronMaskedPixelView<TYPE>)
 
 INSTANTIATE(float);
+INSTANTIATE(double);
+INSTANTIATE(int);
+INSTANTIATE(std::uint16_t);
 
 }}}} // namespace lsst::meas::extensions::photometryKron
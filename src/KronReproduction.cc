@@ -0,0 +1,575 @@
+// -*- LSST-C++ -*-
+/*
+ * LSST Data Management System
+ * Copyright 2008-2015 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include "lsst/pex/exceptions.h"
+#include "lsst/daf/base/PropertyList.h"
+#include "lsst/afw/geom/SpanSet.h"
+#include "lsst/afw/geom/ellipses.h"
+#include "lsst/afw/image/Exposure.h"
+#include "lsst/afw/detection/Footprint.h"
+#include "lsst/afw/detection/Psf.h"
+#include "lsst/afw/table/Source.h"
+#include "lsst/afw/table/aggregates.h"
+#include "lsst/meas/base/exceptions.h"
+
+#include "lsst/meas/extensions/photometryKron.h"
+
+namespace lsst {
+namespace meas {
+namespace extensions {
+namespace photometryKron {
+
+namespace {
+
+char const MAGIC[8] = {'K', 'R', 'O', 'N', 'R', 'E', 'P', 'R'};
+std::int32_t const VERSION = 2;
+
+int const STAMP_BORDER = 10;            // pixels around the apertures, for the sinc kernel and rounding
+
+/*
+ * Read and write values, strings and vectors in native byte order
+ */
+template <typename T>
+void writeValue(std::ostream & os, T const& value)
+{
+    os.write(reinterpret_cast<char const*>(&value), sizeof(T));
+}
+
+void writeValue(std::ostream & os, std::string const& value)
+{
+    writeValue(os, static_cast<std::uint32_t>(value.size()));
+    os.write(value.data(), value.size());
+}
+
+void writeValue(std::ostream & os, std::vector<std::string> const& value)
+{
+    writeValue(os, static_cast<std::uint32_t>(value.size()));
+    for (auto const& str : value) {
+        writeValue(os, str);
+    }
+}
+
+template <typename T>
+void readValue(std::istream & is, T & value)
+{
+    is.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+/*
+ * Return the number of bytes left to read from is (0 if it's failed)
+ */
+std::uint64_t getRemaining(std::istream & is)
+{
+    std::streampos const pos = is.tellg();
+    if (!is || pos < 0) {
+        return 0;
+    }
+    is.seekg(0, std::ios::end);
+    std::streampos const end = is.tellg();
+    is.seekg(pos);
+    return (end > pos) ? static_cast<std::uint64_t>(end - pos) : 0;
+}
+
+/*
+ * Read the number of items that follow, each at least itemSize bytes long, failing the stream (and
+ * returning 0) if the rest of the file's too short to hold them; this keeps a corrupt count from making
+ * us allocate an arbitrary amount of memory
+ */
+std::uint32_t readCount(std::istream & is, std::size_t const itemSize)
+{
+    std::uint32_t count = 0;
+    readValue(is, count);
+    if (is && static_cast<std::uint64_t>(count)*itemSize > getRemaining(is)) {
+        is.setstate(std::ios::failbit);
+        return 0;
+    }
+    return count;
+}
+
+void readValue(std::istream & is, std::string & value)
+{
+    std::uint32_t const size = readCount(is, 1);
+    if (!is) {
+        return;
+    }
+    value.resize(size);
+    is.read(&value[0], size);
+}
+
+void readValue(std::istream & is, std::vector<std::string> & value)
+{
+    std::uint32_t const size = readCount(is, sizeof(std::uint32_t)); // each string has a size
+    value.clear();
+    for (std::uint32_t i = 0; i < size && is; ++i) {
+        std::string str;
+        readValue(is, str);
+        value.push_back(str);
+    }
+}
+
+/*
+ * Read or write every field of a KronFluxControl; Stream is std::ostream (with IO = writeValue)
+ * or std::istream (with IO = readValue)
+ */
+template <typename Stream, typename Control, typename IO>
+void transferControl(Stream & stream, Control & ctrl, IO const& io)
+{
+    io(stream, ctrl.fixed);
+    io(stream, ctrl.nSigmaForRadius);
+    io(stream, ctrl.nIterForRadius);
+    io(stream, ctrl.radiusTolerance);
+    io(stream, ctrl.nRadiusForFlux);
+    io(stream, ctrl.maxSincRadius);
+    io(stream, ctrl.minimumRadius);
+    io(stream, ctrl.enforceMinimumRadius);
+    io(stream, ctrl.useFootprintRadius);
+    io(stream, ctrl.smoothingSigma);
+    io(stream, ctrl.refRadiusName);
+    io(stream, ctrl.maxRadius);
+    io(stream, ctrl.binFactorForRadius);
+    io(stream, ctrl.warmStartRadiusName);
+    io(stream, ctrl.warmStartTolerance);
+    io(stream, ctrl.clipEdgeApertures);
+    io(stream, ctrl.doMeasureFlux);
+    io(stream, ctrl.doMeasureFluxErr);
+    io(stream, ctrl.badMaskPlanes);
+    io(stream, ctrl.replaceBadPixels);
+    io(stream, ctrl.useHeavyFootprint);
+    io(stream, ctrl.bandNames);
+    io(stream, ctrl.doCollectStats);
+    io(stream, ctrl.doRecordCost);
+    io(stream, ctrl.slowSourceTime);
+    io(stream, ctrl.slowSourceDir);
+    io(stream, ctrl.momentShapeTolerance);
+}
+
+/*
+ * A spatially constant elliptical Gaussian PSF with a captured PSF's second moments, which is all that
+ * the measurement uses (afw's GaussianPsf is round)
+ */
+class CapturedPsf : public afw::detection::Psf {
+public:
+    CapturedPsf(afw::geom::ellipses::Quadrupole const& shape, // the PSF's second moments
+                geom::Point2D const& position                 // where the moments were measured
+               ) : Psf(true), _shape(shape), _position(position) {
+        int const halfSize = static_cast<int>(std::ceil(5*afw::geom::ellipses::Axes(shape).getA()));
+        _bbox = geom::Box2I(geom::Point2I(-halfSize, -halfSize), geom::Extent2I(2*halfSize + 1));
+    }
+
+    std::shared_ptr<afw::detection::Psf> clone() const override {
+        return std::make_shared<CapturedPsf>(*this);
+    }
+
+    std::shared_ptr<afw::detection::Psf> resized(int width, int height) const override {
+        auto psf = std::make_shared<CapturedPsf>(*this);
+        psf->_bbox = geom::Box2I(geom::Point2I(-width/2, -height/2), geom::Extent2I(width, height));
+        return psf;
+    }
+
+    geom::Point2D getAveragePosition() const override { return _position; }
+
+private:
+    std::shared_ptr<Image> doComputeKernelImage(geom::Point2D const&,
+                                                afw::image::Color const&) const override {
+        afw::image::Image<float> image(_bbox);
+        afw::geom::ellipses::Axes const axes(_shape);
+        renderGalaxies(image, {{0.0, 0.0, 1.0, axes.getA(), axes.getB(), axes.getTheta(), 0}});
+        auto kernelImage = std::make_shared<Image>(image, true);
+        *kernelImage /= getSum(*kernelImage, std::numeric_limits<double>::infinity());
+        return kernelImage;
+    }
+
+    double doComputeApertureFlux(double radius, geom::Point2D const& position,
+                                 afw::image::Color const& color) const override {
+        return getSum(*doComputeKernelImage(position, color), radius);
+    }
+
+    afw::geom::ellipses::Quadrupole doComputeShape(geom::Point2D const&,
+                                                   afw::image::Color const&) const override {
+        return _shape;
+    }
+
+    geom::Box2I doComputeBBox(geom::Point2D const&, afw::image::Color const&) const override {
+        return _bbox;
+    }
+
+    // Return the sum of the pixels of image within radius of its origin
+    static double getSum(Image const& image, double const radius) {
+        double sum = 0;
+        for (int y = 0; y < image.getHeight(); ++y) {
+            int const dy = y + image.getY0();
+            auto ptr = image.row_begin(y);
+            for (int x = image.getX0(); x < image.getX0() + image.getWidth(); ++x, ++ptr) {
+                if (std::hypot(x, dy) <= radius) {
+                    sum += *ptr;
+                }
+            }
+        }
+        return sum;
+    }
+
+    afw::geom::ellipses::Quadrupole _shape;
+    geom::Point2D _position;
+    geom::Box2I _bbox;
+};
+
+struct Writer {
+    template <typename T>
+    void operator()(std::ostream & os, T const& value) const { writeValue(os, value); }
+};
+
+struct Reader {
+    template <typename T>
+    void operator()(std::istream & is, T & value) const { readValue(is, value); }
+};
+
+/*
+ * Return a float field of source, or NaN if there's no such field
+ */
+double getField(afw::table::SourceRecord const& source, std::string const& name)
+{
+    try {
+        return source.get(source.getSchema().find<float>(name).key);
+    } catch (pex::exceptions::NotFoundError &) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+/*
+ * Return the bounding box of the pixels that measuring source may have read: the largest of the first
+ * and last apertures used to estimate the Kron radius and the flux aperture, elongated like the initial
+ * shape, and the source's Footprint
+ */
+geom::Box2I getStampBBox(
+    KronFluxControl const& ctrl,
+    std::string const& name,
+    afw::table::SourceRecord const& source,
+    afw::image::Exposure<float> const& exposure,
+    afw::geom::ellipses::Axes const& axes
+    )
+{
+    double const initialRadius = ctrl.nSigmaForRadius*axes.getDeterminantRadius();
+    double const radiusForRadius = getField(source, name + "_radius_for_radius");
+    double const fluxRadius = ctrl.nRadiusForFlux*getField(source, name + "_radius");
+
+    double radius = 0;
+    for (double r : {initialRadius, radiusForRadius, fluxRadius}) {
+        if (std::isfinite(r)) {
+            radius = std::max(radius, r);
+        }
+    }
+    radius = std::min(radius, ctrl.nRadiusForFlux*ctrl.maxRadius);
+    double const elongation = (axes.getB() > 0) ? std::sqrt(axes.getA()/axes.getB()) : 1.0;
+    double const halfWidth = radius*std::min(elongation, 10.0) + STAMP_BORDER;
+
+    geom::Point2D const center = source.getCentroid();
+    geom::Box2I bbox;
+    if (std::isfinite(center.getX()) && std::isfinite(center.getY())) {
+        bbox = geom::Box2I(geom::Box2D(center - geom::Extent2D(halfWidth, halfWidth),
+                                       center + geom::Extent2D(halfWidth, halfWidth)));
+    }
+    if (source.getFootprint()) {
+        geom::Box2I footprintBBox = source.getFootprint()->getBBox();
+        footprintBBox.grow(STAMP_BORDER);
+        bbox.include(footprintBBox);
+    }
+    bbox.clip(exposure.getBBox());
+    if (bbox.isEmpty()) {
+        throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                          (boost::format("Source %d has no pixels to capture") % source.getId()).str());
+    }
+    return bbox;
+}
+
+} // end anonymous namespace
+
+KronReproduction::KronReproduction(
+    KronFluxControl const& ctrl,
+    std::string const& name,
+    afw::table::SourceRecord const& source,
+    afw::image::Exposure<float> const& exposure,
+    std::int64_t const timeNs
+    ) : _ctrl(ctrl),
+        _name(name),
+        _id(source.getId()),
+        _timeNs(timeNs),
+        _centroid(source.getCentroid()),
+        _centroidFlag(source.getCentroidFlag()),
+        _shape(source.getShape()),
+        _shapeFlag(source.getShapeFlag()),
+        _hasPsf(static_cast<bool>(exposure.getPsf()))
+{
+    if (_hasPsf) {
+        _psfShape = exposure.getPsf()->computeShape(_centroid);
+    }
+    if (source.getFootprint()) {
+        _footprint = source.getFootprint()->getSpans();
+        for (auto const& peak : source.getFootprint()->getPeaks()) {
+            _peaks.push_back(peak.getF());
+        }
+    }
+
+    afw::geom::ellipses::Axes const axes = (_shapeFlag && _hasPsf) ? afw::geom::ellipses::Axes(_psfShape) :
+        afw::geom::ellipses::Axes(_shape);
+    geom::Box2I const bbox = getStampBBox(ctrl, name, source, exposure, axes);
+    afw::image::MaskedImage<float> const& mimage = exposure.getMaskedImage();
+    _image = std::make_shared<afw::image::MaskedImage<float>>(
+        afw::image::MaskedImage<float>(mimage, bbox, afw::image::PARENT, true));
+    //
+    // The measurement only uses the mask to find pixels in badMaskPlanes
+    //
+    afw::image::MaskPixel const badPixelMask = ctrl.getBadPixelMask();
+    afw::image::Mask<> & mask = *_image->getMask();
+    for (int y = 0; y < mask.getHeight(); ++y) {
+        for (auto ptr = mask.row_begin(y), end = mask.row_end(y); ptr != end; ++ptr) {
+            *ptr = (*ptr & badPixelMask) ? 1 : 0;
+        }
+    }
+}
+
+void KronReproduction::writeFile(std::string const& filename) const
+{
+    std::ofstream os(filename, std::ios::binary);
+    if (!os) {
+        throw LSST_EXCEPT(pex::exceptions::IoError, "Unable to open " + filename + " for writing");
+    }
+    os.write(MAGIC, sizeof(MAGIC));
+    writeValue(os, VERSION);
+    transferControl(os, _ctrl, Writer());
+    writeValue(os, _name);
+    writeValue(os, static_cast<std::int64_t>(_id));
+    writeValue(os, _timeNs);
+    writeValue(os, _centroid.getX());
+    writeValue(os, _centroid.getY());
+    writeValue(os, static_cast<std::uint8_t>(_centroidFlag));
+    writeValue(os, _shape.getIxx());
+    writeValue(os, _shape.getIyy());
+    writeValue(os, _shape.getIxy());
+    writeValue(os, static_cast<std::uint8_t>(_shapeFlag));
+    writeValue(os, static_cast<std::uint8_t>(_hasPsf));
+    writeValue(os, _psfShape.getIxx());
+    writeValue(os, _psfShape.getIyy());
+    writeValue(os, _psfShape.getIxy());
+
+    writeValue(os, static_cast<std::uint32_t>(_footprint ? _footprint->size() : 0));
+    if (_footprint) {
+        for (auto const& span : *_footprint) {
+            writeValue(os, static_cast<std::int32_t>(span.getY()));
+            writeValue(os, static_cast<std::int32_t>(span.getX0()));
+            writeValue(os, static_cast<std::int32_t>(span.getX1()));
+        }
+    }
+    writeValue(os, static_cast<std::uint32_t>(_peaks.size()));
+    for (auto const& peak : _peaks) {
+        writeValue(os, peak.getX());
+        writeValue(os, peak.getY());
+    }
+
+    geom::Box2I const bbox = _image->getBBox();
+    writeValue(os, static_cast<std::int32_t>(bbox.getMinX()));
+    writeValue(os, static_cast<std::int32_t>(bbox.getMinY()));
+    writeValue(os, static_cast<std::int32_t>(bbox.getWidth()));
+    writeValue(os, static_cast<std::int32_t>(bbox.getHeight()));
+    for (int y = 0; y < bbox.getHeight(); ++y) {
+        os.write(reinterpret_cast<char const*>(_image->getImage()->row_begin(y)),
+                 bbox.getWidth()*sizeof(float));
+    }
+    for (int y = 0; y < bbox.getHeight(); ++y) {
+        os.write(reinterpret_cast<char const*>(_image->getVariance()->row_begin(y)),
+                 bbox.getWidth()*sizeof(float));
+    }
+    std::vector<std::uint8_t> row(bbox.getWidth());
+    for (int y = 0; y < bbox.getHeight(); ++y) {
+        std::copy(_image->getMask()->row_begin(y), _image->getMask()->row_end(y), row.begin());
+        os.write(reinterpret_cast<char const*>(row.data()), row.size());
+    }
+
+    if (!os) {
+        throw LSST_EXCEPT(pex::exceptions::IoError, "Error writing " + filename);
+    }
+}
+
+KronReproduction KronReproduction::readFile(std::string const& filename)
+{
+    std::ifstream is(filename, std::ios::binary);
+    if (!is) {
+        throw LSST_EXCEPT(pex::exceptions::IoError, "Unable to open " + filename);
+    }
+    char magic[sizeof(MAGIC)];
+    std::int32_t version = 0;
+    is.read(magic, sizeof(magic));
+    readValue(is, version);
+    if (!is || !std::equal(magic, magic + sizeof(magic), MAGIC) || version != VERSION) {
+        throw LSST_EXCEPT(pex::exceptions::IoError,
+                          filename + " isn't a version " + std::to_string(VERSION) + " Kron reproduction");
+    }
+
+    KronReproduction repro;
+    transferControl(is, repro._ctrl, Reader());
+    readValue(is, repro._name);
+    std::int64_t id = 0;
+    readValue(is, id);
+    repro._id = id;
+    readValue(is, repro._timeNs);
+    double x = 0, y = 0, ixx = 0, iyy = 0, ixy = 0;
+    std::uint8_t flag = 0;
+    readValue(is, x);
+    readValue(is, y);
+    repro._centroid = geom::Point2D(x, y);
+    readValue(is, flag);
+    repro._centroidFlag = flag;
+    readValue(is, ixx);
+    readValue(is, iyy);
+    readValue(is, ixy);
+    repro._shape = afw::geom::ellipses::Quadrupole(ixx, iyy, ixy);
+    readValue(is, flag);
+    repro._shapeFlag = flag;
+    readValue(is, flag);
+    repro._hasPsf = flag;
+    readValue(is, ixx);
+    readValue(is, iyy);
+    readValue(is, ixy);
+    repro._psfShape = afw::geom::ellipses::Quadrupole(ixx, iyy, ixy);
+
+    std::uint32_t const nSpan = readCount(is, 3*sizeof(std::int32_t));
+    if (nSpan > 0) {
+        std::vector<afw::geom::Span> spans;
+        for (std::uint32_t i = 0; i < nSpan && is; ++i) {
+            std::int32_t spanY = 0, x0 = 0, x1 = 0;
+            readValue(is, spanY);
+            readValue(is, x0);
+            readValue(is, x1);
+            spans.emplace_back(spanY, x0, x1);
+        }
+        repro._footprint = std::make_shared<afw::geom::SpanSet>(spans);
+    }
+    std::uint32_t const nPeak = readCount(is, 2*sizeof(double));
+    for (std::uint32_t i = 0; i < nPeak && is; ++i) {
+        readValue(is, x);
+        readValue(is, y);
+        repro._peaks.emplace_back(x, y);
+    }
+
+    std::int32_t x0 = 0, y0 = 0, width = 0, height = 0;
+    readValue(is, x0);
+    readValue(is, y0);
+    readValue(is, width);
+    readValue(is, height);
+    // the image and variance (float) and mask (uint8) pixels follow
+    std::uint64_t const imageSize = static_cast<std::uint64_t>(width)*height*(2*sizeof(float) + 1);
+    if (!is || width <= 0 || height <= 0 || imageSize > getRemaining(is)) {
+        throw LSST_EXCEPT(pex::exceptions::IoError, "Corrupt Kron reproduction " + filename);
+    }
+    repro._image = std::make_shared<afw::image::MaskedImage<float>>(
+        geom::Box2I(geom::Point2I(x0, y0), geom::Extent2I(width, height)));
+    for (int y = 0; y < height; ++y) {
+        is.read(reinterpret_cast<char *>(repro._image->getImage()->row_begin(y)), width*sizeof(float));
+    }
+    for (int y = 0; y < height; ++y) {
+        is.read(reinterpret_cast<char *>(repro._image->getVariance()->row_begin(y)), width*sizeof(float));
+    }
+    std::vector<std::uint8_t> row(width);
+    for (int y = 0; y < height; ++y) {
+        is.read(reinterpret_cast<char *>(row.data()), row.size());
+        std::copy(row.begin(), row.end(), repro._image->getMask()->row_begin(y));
+    }
+    if (!is) {
+        throw LSST_EXCEPT(pex::exceptions::IoError, "Truncated Kron reproduction " + filename);
+    }
+    return repro;
+}
+
+std::shared_ptr<afw::table::SourceRecord> KronReproduction::replay(int const nRepeat) const
+{
+    //
+    // Put the captured centroid and shape in the slots, as measure expects
+    //
+    afw::table::Schema schema = afw::table::SourceTable::makeMinimalSchema();
+    auto const centroidKey = afw::table::PointKey<double>::addFields(schema, "centroid", "captured centroid",
+                                                                     "pixel");
+    auto const centroidFlagKey = schema.addField<afw::table::Flag>("centroid_flag", "captured centroid flag");
+    auto const shapeKey = afw::table::QuadrupoleKey::addFields(schema, "shape", "captured shape",
+                                                               afw::table::CoordinateType::PIXEL);
+    auto const shapeFlagKey = schema.addField<afw::table::Flag>("shape_flag", "captured shape flag");
+    schema.getAliasMap()->set("slot_Centroid", "centroid");
+    schema.getAliasMap()->set("slot_Shape", "shape");
+
+    KronFluxControl ctrl = _ctrl;
+    ctrl.warmStartRadiusName = "";      // we didn't capture the seeds
+    ctrl.doCollectStats = false;
+    ctrl.slowSourceTime = 0.0;          // don't capture the replay
+    daf::base::PropertyList metadata;
+    KronFluxAlgorithm const algorithm(ctrl, _name, schema, metadata);
+    auto table = afw::table::SourceTable::make(schema);
+
+    afw::image::Exposure<float> exposure(_image->getBBox());
+    afw::image::MaskedImage<float> & mimage = exposure.getMaskedImage();
+    *mimage.getImage() <<= *_image->getImage();
+    *mimage.getVariance() <<= *_image->getVariance();
+    afw::image::MaskPixel const badPixelMask = ctrl.getBadPixelMask();
+    for (int y = 0; y < mimage.getHeight(); ++y) {
+        auto in = _image->getMask()->row_begin(y);
+        for (auto ptr = mimage.getMask()->row_begin(y), end = mimage.getMask()->row_end(y); ptr != end;
+             ++ptr, ++in) {
+            *ptr = *in ? badPixelMask : 0;
+        }
+    }
+    if (_hasPsf) {
+        exposure.setPsf(std::make_shared<CapturedPsf>(_psfShape, _centroid));
+    }
+
+    std::shared_ptr<afw::table::SourceRecord> source;
+    for (int i = 0; i < std::max(1, nRepeat); ++i) {
+        source = table->makeRecord();
+        source->setId(_id);
+        source->set(centroidKey, _centroid);
+        source->set(centroidFlagKey, _centroidFlag);
+        source->set(shapeKey, _shape);
+        source->set(shapeFlagKey, _shapeFlag);
+        if (_footprint) {
+            auto footprint = std::make_shared<afw::detection::Footprint>(_footprint);
+            for (auto const& peak : _peaks) {
+                footprint->addPeak(peak.getX(), peak.getY(), 0.0);
+            }
+            source->setFootprint(footprint);
+        }
+        try {
+            algorithm.measure(*source, exposure);
+        } catch (meas::base::MeasurementError & e) {
+            algorithm.fail(*source, &e);
+        } catch (pex::exceptions::Exception &) {
+            algorithm.fail(*source);
+        }
+    }
+    return source;
+}
+
+}}}} // namespace lsst::meas::extensions::photometryKron
@@ -0,0 +1,254 @@
+// -*- LSST-C++ -*-
+/*
+ * LSST Data Management System
+ * Copyright 2008-2015 LSST Corporation.
+ *
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the LSST License Statement and
+ * the GNU General Public License along with this program.  If not,
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "lsst/pex/exceptions.h"
+#include "lsst/afw/image/Exposure.h"
+#include "lsst/afw/detection/Psf.h"
+#include "lsst/afw/geom/ellipses.h"
+#include "lsst/afw/math/Kernel.h"
+#include "lsst/afw/math/ConvolveImage.h"
+
+#include "lsst/meas/extensions/photometryKron.h"
+
+namespace lsst {
+namespace meas {
+namespace extensions {
+namespace photometryKron {
+
+namespace {
+
+double const GAUSSIAN_TRUNCATION = 6.0; // draw Gaussians out to this many sigma
+double const SERSIC_TRUNCATION = 8.0;   // draw Sersic profiles out to this many half-light radii
+
+/*
+ * The surface brightness of a galaxy as a function of r2, the square of the elliptical radius in units
+ * of its axes
+ */
+class Profile {
+public:
+    explicit Profile(SyntheticGalaxy const& galaxy) : _n(galaxy.sersicIndex) {
+        if (galaxy.a <= 0 || galaxy.b <= 0 || galaxy.sersicIndex < 0) {
+            throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                              (boost::format("Invalid galaxy: axes %g,%g Sersic index %g")
+                               % galaxy.a % galaxy.b % galaxy.sersicIndex).str());
+        }
+        if (_n == 0) {
+            _I0 = galaxy.flux/(2*geom::PI*galaxy.a*galaxy.b);
+            _truncation = GAUSSIAN_TRUNCATION;
+        } else {
+            // Ciotti & Bertin's (1999) expansion of b_n, such that r_e encloses half the light
+            _bn = 2*_n - 1.0/3 + 4/(405*_n) + 46/(25515*_n*_n);
+            double const total = 2*geom::PI*_n*std::exp(_bn)*std::pow(_bn, -2*_n)*std::tgamma(2*_n);
+            _I0 = galaxy.flux/(total*galaxy.a*galaxy.b); // the surface brightness at r_e
+            _truncation = SERSIC_TRUNCATION;
+        }
+    }
+
+    double getTruncation() const { return _truncation; }
+
+    double operator()(double r2) const {
+        if (_n == 0) {
+            return _I0*std::exp(-0.5*r2);
+        }
+        return _I0*std::exp(-_bn*(std::pow(r2, 0.5/_n) - 1));
+    }
+
+private:
+    double _n;                          // Sersic index; 0 for a Gaussian
+    double _bn = 0;                     // Sersic b_n
+    double _I0 = 0;                     // central (Gaussian) or half-light (Sersic) surface brightness
+    double _truncation = 0;             // largest elliptical radius to draw
+};
+
+/*
+ * Add one galaxy to an image
+ */
+void renderGalaxy(
+    afw::image::Image<float> & image,
+    SyntheticGalaxy const& galaxy,
+    int const nSubsample,
+    double const subsampleRadius
+    )
+{
+    Profile const profile(galaxy);
+    double const c = std::cos(galaxy.theta), s = std::sin(galaxy.theta);
+    // Elliptical radius^2 is (u/a)^2 + (v/b)^2 with (u, v) the offset rotated into the galaxy's frame;
+    // expand it as a quadratic form in (dx, dy)
+    double const ia2 = 1/(galaxy.a*galaxy.a), ib2 = 1/(galaxy.b*galaxy.b);
+    double const qxx = c*c*ia2 + s*s*ib2, qyy = s*s*ia2 + c*c*ib2, qxy = 2*c*s*(ia2 - ib2);
+    auto radius2 = [qxx, qyy, qxy](double dx, double dy) { return qxx*dx*dx + qxy*dx*dy + qyy*dy*dy; };
+
+    // The bounding box of the truncated ellipse
+    double const ra = profile.getTruncation()*galaxy.a, rb = profile.getTruncation()*galaxy.b;
+    double const halfWidth = std::hypot(ra*c, rb*s), halfHeight = std::hypot(ra*s, rb*c);
+    geom::Box2I bbox(geom::Box2D(geom::Point2D(galaxy.x - halfWidth, galaxy.y - halfHeight),
+                                 geom::Point2D(galaxy.x + halfWidth, galaxy.y + halfHeight)));
+    bbox.clip(image.getBBox());
+    if (bbox.isEmpty()) {
+        return;
+    }
+
+    double const truncation2 = profile.getTruncation()*profile.getTruncation();
+    double const subsample2 = subsampleRadius*subsampleRadius;
+    std::vector<double> offsets(std::max(1, nSubsample));
+    for (std::size_t i = 0; i < offsets.size(); ++i) {
+        offsets[i] = (i + 0.5)/offsets.size() - 0.5;
+    }
+    double const weight = 1.0/(offsets.size()*offsets.size());
+
+    for (int y = bbox.getMinY(); y <= bbox.getMaxY(); ++y) {
+        auto ptr = image.row_begin(y - image.getY0()) + (bbox.getMinX() - image.getX0());
+        double const dy = y - galaxy.y;
+        for (int x = bbox.getMinX(); x <= bbox.getMaxX(); ++x, ++ptr) {
+            double const dx = x - galaxy.x;
+            double const r2 = radius2(dx, dy);
+            if (r2 < subsample2 && offsets.size() > 1) {
+                double sum = 0;
+                for (double sy : offsets) {
+                    for (double sx : offsets) {
+                        sum += profile(radius2(dx + sx, dy + sy));
+                    }
+                }
+                *ptr += weight*sum;
+            } else if (r2 < truncation2) {
+                *ptr += profile(r2);
+            }
+        }
+    }
+}
+
+} // end anonymous namespace
+
+void renderGalaxies(
+    afw::image::Image<float> & image,
+    std::vector<SyntheticGalaxy> const& galaxies,
+    int const nSubsample,
+    double const subsampleRadius
+    )
+{
+    for (auto const& galaxy : galaxies) {
+        renderGalaxy(image, galaxy, nSubsample, subsampleRadius);
+    }
+}
+
+std::shared_ptr<afw::image::Exposure<float>> makeSyntheticExposure(
+    geom::Box2I const& bbox,
+    std::vector<SyntheticGalaxy> const& galaxies,
+    std::shared_ptr<afw::detection::Psf const> const& psf,
+    double const noiseSigma,
+    std::shared_ptr<afw::geom::SkyWcs const> const& wcs,
+    unsigned int const seed,
+    int const nSubsample,
+    double const subsampleRadius
+    )
+{
+    auto exposure = std::make_shared<afw::image::Exposure<float>>(bbox, wcs);
+    afw::image::MaskedImage<float> & mimage = exposure->getMaskedImage();
+    afw::image::Image<float> & image = *mimage.getImage();
+    //
+    // Gaussians are convolved with the PSF analytically, by adding its second moments; the Sersic
+    // profiles are drawn onto their own image, which we convolve with the PSF's kernel image
+    //
+    std::vector<SyntheticGalaxy> gaussians, sersics;
+    for (auto const& galaxy : galaxies) {
+        (galaxy.sersicIndex == 0 ? gaussians : sersics).push_back(galaxy);
+    }
+    if (psf) {
+        geom::Point2D const center = geom::Box2D(bbox).getCenter();
+        afw::geom::ellipses::Quadrupole const psfShape = psf->computeShape(center);
+        for (auto & galaxy : gaussians) {
+            afw::geom::ellipses::Quadrupole const shape(afw::geom::ellipses::Axes(galaxy.a, galaxy.b,
+                                                                                  galaxy.theta));
+            afw::geom::ellipses::Axes const convolved(
+                afw::geom::ellipses::Quadrupole(shape.getIxx() + psfShape.getIxx(),
+                                                shape.getIyy() + psfShape.getIyy(),
+                                                shape.getIxy() + psfShape.getIxy()));
+            galaxy.a = convolved.getA();
+            galaxy.b = convolved.getB();
+            galaxy.theta = convolved.getTheta();
+        }
+        if (!sersics.empty()) {
+            afw::image::Image<float> unconvolved(bbox);
+            renderGalaxies(unconvolved, sersics, nSubsample, subsampleRadius);
+            afw::math::FixedKernel const kernel(*psf->computeKernelImage(center));
+            // copy the unconvolved pixels near the edge, rather than setting them to NaN
+            afw::math::convolve(image, unconvolved, kernel, afw::math::ConvolutionControl(true, true));
+            sersics.clear();
+        }
+    }
+    renderGalaxies(image, gaussians, nSubsample, subsampleRadius);
+    renderGalaxies(image, sersics, nSubsample, subsampleRadius);
+
+    if (noiseSigma > 0) {
+        std::mt19937 rng(seed);
+        std::normal_distribution<float> noise(0.0, noiseSigma);
+        for (int y = 0; y < image.getHeight(); ++y) {
+            for (auto ptr = image.row_begin(y), end = image.row_end(y); ptr != end; ++ptr) {
+                *ptr += noise(rng);
+            }
+        }
+    }
+    *mimage.getVariance() = (noiseSigma > 0) ? noiseSigma*noiseSigma : 1.0;
+    exposure->setPsf(psf);
+    return exposure;
+}
+
+std::vector<SyntheticGalaxy> makeRandomGalaxies(
+    geom::Box2I const& bbox,
+    int const nGalaxy,
+    double const minFlux,
+    double const maxFlux,
+    unsigned int const seed
+    )
+{
+    if (minFlux <= 0 || maxFlux < minFlux) {
+        throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,
+                          (boost::format("Invalid flux range %g..%g") % minFlux % maxFlux).str());
+    }
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    geom::Box2D const box(bbox);
+    // Invert N(>F) ~ F^-1.5 between minFlux and maxFlux
+    double const cMin = std::pow(minFlux, -1.5), cMax = std::pow(maxFlux, -1.5);
+
+    std::vector<SyntheticGalaxy> galaxies;
+    galaxies.reserve(std::max(0, nGalaxy));
+    for (int i = 0; i < nGalaxy; ++i) {
+        SyntheticGalaxy galaxy;
+        galaxy.x = box.getMinX() + uniform(rng)*box.getWidth();
+        galaxy.y = box.getMinY() + uniform(rng)*box.getHeight();
+        galaxy.flux = std::pow(cMin + uniform(rng)*(cMax - cMin), -1/1.5);
+        galaxy.a = 1.5*std::pow(galaxy.flux/minFlux, 0.25);
+        galaxy.b = galaxy.a*(0.3 + 0.7*uniform(rng));
+        galaxy.theta = geom::PI*uniform(rng);
+        galaxy.sersicIndex = (uniform(rng) < 0.5) ? 0.0 : 1.0;
+        galaxies.push_back(galaxy);
+    }
+    return galaxies;
+}
+
+}}}} // namespace lsst::meas::extensions::photometryKron
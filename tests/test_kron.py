@@ -21,8 +21,11 @@
 # see <https://www.lsstcorp.org/LegalNotices/>.
 #
 import math
+import os
+import subprocess
 import unittest
 import sys
+import tempfile
 
 import numpy as np
 import itertools
@@ -37,6 +40,7 @@ import lsst.afw.math as afwMath
 import lsst.afw.table as afwTable
 import lsst.meas.algorithms as measAlg
 import lsst.meas.base as measBase
+import lsst.pex.exceptions
 # importing this package registers essential code
 import lsst.meas.extensions.photometryKron
 from lsst.daf.base import PropertyList
@@ -134,12 +138,16 @@ def makeMeasurementConfig(forced=False, nsigma=6.0, nIterForRadius=1, kfac=2.5):
     return msConfig
 
 
-def measureFree(exposure, center, msConfig):
+def measureFree(exposure, center, msConfig, warmStartCatalog=None, smoothedImage=None, smoothingSigma=0):
     """Unforced measurement.
     """
     schema = afwTable.SourceTable.makeMinimalSchema()
     algMeta = PropertyList()
     task = measBase.SingleFrameMeasurementTask(schema, config=msConfig, algMetadata=algMeta)
+    if warmStartCatalog is not None:
+        task.plugins["ext_photometryKron_KronFlux"].cpp.setWarmStartCatalog(warmStartCatalog)
+    if smoothedImage is not None:
+        task.plugins["ext_photometryKron_KronFlux"].cpp.setSmoothedImage(smoothedImage, smoothingSigma)
     measCat = afwTable.SourceCatalog(schema)
     source = measCat.addNew()
     source.getTable().setMetadata(algMeta)
@@ -461,6 +469,768 @@ class KronPhotometryTestCase(lsst.utils.tests.TestCase):
                 else:
                     self.assertFalse(flags_K, msg)
 
+    def testBinnedRadius(self):
+        """Check that estimating R_K on a binned image agrees with the full-resolution estimate.
+        """
+        nIterForRadius = 3
+        a, b, theta = 12, 6, 30.0
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        exposure = makeGalaxy(self.width, self.height, self.flux, a, b, theta)
+
+        results = {}
+        for binFactor in (1, 2, 4):
+            msConfig = makeMeasurementConfig(nIterForRadius=nIterForRadius)
+            msConfig.plugins["ext_photometryKron_KronFlux"].binFactorForRadius = binFactor
+            source = measureFree(exposure, center, msConfig)
+            self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+            results[binFactor] = source.get("ext_photometryKron_KronFlux_radius")
+            if binFactor > 1:
+                binnedRadius = source.get("ext_photometryKron_KronFlux_radius_binned")
+                self.assertFloatsAlmostEqual(binnedRadius, results[1], rtol=5e-2)
+
+        for binFactor in (2, 4):
+            self.assertFloatsAlmostEqual(results[binFactor], results[1], rtol=1e-2)
+
+        # An initial shape so large that the first binned estimate is smaller than it: we refine the
+        # binned estimate rather than starting again
+        photKron = lsst.meas.extensions.photometryKron
+        mimage = makeGalaxy(self.width, self.height, self.flux, 4, 4, 0.0).getMaskedImage()
+        ctrl = makeMeasurementConfig(nIterForRadius=2).plugins["ext_photometryKron_KronFlux"].makeControl()
+        ctrl.binFactorForRadius = 2
+        axes = afwEllipses.Axes(8, 8, 0.0)
+        aperture = photKron.KronAperture.determineRadius(mimage, axes, center, ctrl,
+                                                         photKron.KronImagePyramid())
+        self.assertTrue(np.isfinite(aperture.getBinnedRadius()))
+        self.assertLess(aperture.getBinnedRadius(), axes.getDeterminantRadius())
+        self.assertEqual(aperture.getNIterForRadius(), 2)
+
+        # A single iteration isn't binned
+        ctrl.nIterForRadius = 1
+        aperture = photKron.KronAperture.determineRadius(mimage, axes, center, ctrl,
+                                                         photKron.KronImagePyramid())
+        self.assertTrue(np.isnan(aperture.getBinnedRadius()))
+        self.assertEqual(aperture.getNIterForRadius(), 1)
+
+    def testWarmStart(self):
+        """Check that seeding R_K from a previous run reproduces the full iteration.
+        """
+        nIterForRadius = 3
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        exposure = makeGalaxy(self.width, self.height, self.flux, 8, 5, 30.0)
+        msConfig = makeMeasurementConfig(nIterForRadius=nIterForRadius)
+        prior = measureFree(exposure, center, msConfig)
+        self.assertFalse(prior.get("ext_photometryKron_KronFlux_flag"))
+        radius = prior.get("ext_photometryKron_KronFlux_radius")
+
+        # A consistent seed, and one that's so far off that we fall back to the full iteration
+        for seedScale in (1.0, 3.0):
+            priorCat = afwTable.SourceCatalog(prior.table)
+            priorCat.append(prior.table.copyRecord(prior))
+            priorCat[0].set("ext_photometryKron_KronFlux_radius", seedScale*radius)
+            source = measureFree(exposure, center, msConfig, warmStartCatalog=priorCat)
+            self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+            self.assertFloatsAlmostEqual(source.get("ext_photometryKron_KronFlux_radius"), radius, rtol=1e-3)
+
+    def testSmoothedImage(self):
+        """Check that estimating R_K from a supplied smoothed image agrees with smoothing internally.
+        """
+        sigma = 2.0
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        exposure = makeGalaxy(self.width, self.height, self.flux, 8, 5, 30.0)
+
+        msConfig = makeMeasurementConfig(nIterForRadius=3)
+        msConfig.plugins["ext_photometryKron_KronFlux"].smoothingSigma = sigma
+        expected = measureFree(exposure, center, msConfig)
+        self.assertFalse(expected.get("ext_photometryKron_KronFlux_flag"))
+
+        kSize = 2*int(2*sigma) + 1
+        gaussFunc = afwMath.GaussianFunction1D(sigma)
+        kernel = afwMath.SeparableKernel(kSize, kSize, gaussFunc, gaussFunc)
+        smoothed = afwImage.ImageF(exposure.getBBox())
+        afwMath.convolve(smoothed, exposure.image, kernel, afwMath.ConvolutionControl())
+
+        msConfig.plugins["ext_photometryKron_KronFlux"].smoothingSigma = -1
+        source = measureFree(exposure, center, msConfig, smoothedImage=smoothed, smoothingSigma=sigma)
+        self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+        for field in ("radius", "psf_radius", "instFlux"):
+            field = "ext_photometryKron_KronFlux_" + field
+            self.assertFloatsAlmostEqual(source.get(field), expected.get(field), rtol=1e-4)
+
+    def testRadiusConvergence(self):
+        """Check that iterating to convergence agrees with the fixed iteration, using fewer passes.
+        """
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        exposure = makeGalaxy(self.width, self.height, self.flux, 8, 5, 30.0)
+
+        msConfig = makeMeasurementConfig(nIterForRadius=3)
+        fixed = measureFree(exposure, center, msConfig)
+        self.assertEqual(fixed.get("ext_photometryKron_KronFlux_nIter"), 3)
+
+        msConfig = makeMeasurementConfig(nIterForRadius=10)
+        msConfig.plugins["ext_photometryKron_KronFlux"].radiusTolerance = 1e-2
+        converged = measureFree(exposure, center, msConfig)
+        self.assertFalse(converged.get("ext_photometryKron_KronFlux_flag"))
+        self.assertLess(converged.get("ext_photometryKron_KronFlux_nIter"), 3)
+        self.assertFloatsAlmostEqual(converged.get("ext_photometryKron_KronFlux_radius"),
+                                     fixed.get("ext_photometryKron_KronFlux_radius"), rtol=1e-2)
+
+    def testMomentShapeTolerance(self):
+        """Check that measuring nearly-round sources as round changes R_K by at most momentShapeTolerance.
+        """
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        for b, theta in [(4.99, 30.0), (3, 0.01)]:
+            exposure = makeGalaxy(self.width, self.height, self.flux, 5, b, theta)
+            results = {}
+            for tolerance in (0.0, 1e-2):
+                msConfig = makeMeasurementConfig(nIterForRadius=3)
+                msConfig.plugins["ext_photometryKron_KronFlux"].momentShapeTolerance = tolerance
+                source = measureFree(exposure, center, msConfig)
+                self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+                results[tolerance] = source.get("ext_photometryKron_KronFlux_radius")
+            self.assertFloatsAlmostEqual(results[1e-2], results[0.0], rtol=3e-2)
+
+    def testClipEdgeApertures(self):
+        """Check that apertures that fall off the image can be measured by clipping them.
+        """
+        a, b, theta = 5, 3, 20.0
+        xcen, ycen = 12, 0.5*self.height
+        exposure = makeGalaxy(self.width, self.height, self.flux, a, b, theta, xcen=xcen, ycen=ycen)
+        center = geom.Point2D(xcen, ycen)
+
+        for clipEdgeApertures in (False, True):
+            msConfig = makeMeasurementConfig(kfac=5)
+            msConfig.plugins["ext_photometryKron_KronFlux"].clipEdgeApertures = clipEdgeApertures
+            source = measureFree(exposure, center, msConfig)
+            self.assertTrue(source.get("ext_photometryKron_KronFlux_flag_edge"))
+            flux = source.get("ext_photometryKron_KronFlux_instFlux")
+            if clipEdgeApertures:
+                self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+                # all of the galaxy is on the image, although the aperture isn't
+                self.assertFloatsAlmostEqual(flux, self.flux, rtol=5e-2)
+            else:
+                self.assertTrue(source.get("ext_photometryKron_KronFlux_flag"))
+
+            # Rasterising every aperture gives the same results as classifying them analytically
+            photKron = lsst.meas.extensions.photometryKron
+            self.assertTrue(photKron.setKronEdgeClassification(False))
+            try:
+                rasterised = measureFree(exposure, center, msConfig)
+            finally:
+                photKron.setKronEdgeClassification(True)
+            for field in ("flag", "flag_edge", "radius", "instFlux"):
+                field = "ext_photometryKron_KronFlux_" + field
+                np.testing.assert_equal(rasterised.get(field), source.get(field), field)  # NaN == NaN
+
+    def testSincApertureNearEdge(self):
+        """Check that a sinc aperture whose kernel, but not itself, runs off the image is measured as
+        ApertureFluxAlgorithm.computeSincFlux measures it, by clipping the kernel.
+        """
+        a, b, theta = 3, 2, 20.0
+        nRadiusForFlux, maxSincRadius = 2.5, 10.0
+        # The aperture extends 7.25 pixels in x, so it just fits in the image
+        xcen, ycen = 8.2, 0.5*self.height
+        exposure = makeGalaxy(self.width, self.height, self.flux, a, b, theta, xcen=xcen, ycen=ycen)
+        mimage = exposure.getMaskedImage()
+        center = geom.Point2D(xcen, ycen)
+        axes = afwEllipses.Axes(a, b, math.radians(theta))
+
+        aperture = lsst.meas.extensions.photometryKron.KronAperture(center, axes, a)
+        flux, fluxErr = aperture.measureFlux(mimage, nRadiusForFlux, maxSincRadius)
+
+        apertureAxes = afwEllipses.Axes(axes)
+        apertureAxes.scale(nRadiusForFlux)
+        expected = measBase.ApertureFluxAlgorithm.computeSincFlux(mimage,
+                                                                  afwEllipses.Ellipse(apertureAxes, center))
+        self.assertTrue(expected.getFlag(measBase.ApertureFluxAlgorithm.APERTURE_TRUNCATED.number))
+        self.assertFloatsAlmostEqual(flux, expected.instFlux, rtol=1e-6)
+        self.assertFloatsAlmostEqual(fluxErr, expected.instFluxErr, rtol=1e-6)
+
+    def testMeasureBatch(self):
+        """Check that measuring arrays of sources agrees with measuring them one by one.
+        """
+        a, b, theta = 6, 4, 30.0
+        exposure = makeGalaxy(self.width, self.height, self.flux, a, b, theta)
+        mimage = exposure.getMaskedImage()
+        ctrl = makeMeasurementConfig(nIterForRadius=2).plugins["ext_photometryKron_KronFlux"].makeControl()
+
+        # The galaxy, offset a little, and a source too close to the edge to measure
+        x = np.array([0.5*self.width, 0.5*self.width + 0.3, 2.0])
+        y = np.array([0.5*self.height, 0.5*self.height - 0.2, 0.5*self.height])
+        aa = np.full(len(x), float(a))
+        bb = np.full(len(x), float(b))
+        tt = np.full(len(x), math.radians(theta))
+
+        for nThreads in (1, 2):
+            results = lsst.meas.extensions.photometryKron.KronAperture.measureBatch(
+                mimage, x, y, aa, bb, tt, ctrl, nThreads=nThreads)
+            self.assertEqual(len(results), len(x))
+            for i in range(2):
+                aperture = lsst.meas.extensions.photometryKron.KronAperture.determineRadius(
+                    mimage, afwEllipses.Axes(aa[i], bb[i], tt[i]), geom.Point2D(x[i], y[i]), ctrl)
+                flux, fluxErr = aperture.measureFlux(mimage, ctrl.nRadiusForFlux, ctrl.maxSincRadius)
+                self.assertEqual(results["status"][i], 0)
+                self.assertFloatsAlmostEqual(results["radius"][i], aperture.getAxes().getDeterminantRadius(),
+                                             rtol=1e-6)
+                self.assertFloatsAlmostEqual(results["instFlux"][i], flux, rtol=1e-10)
+                self.assertFloatsAlmostEqual(results["instFluxErr"][i], fluxErr, rtol=1e-10)
+            self.assertEqual(results["status"][2],
+                             int(lsst.meas.extensions.photometryKron.KronStatus.EDGE))
+            self.assertTrue(np.isnan(results["instFlux"][2]))
+
+    def testMeasureBatchArrays(self):
+        """Check that measuring pixels in NumPy arrays agrees with measuring a MaskedImage.
+        """
+        a, b, theta = 6, 4, 30.0
+        exposure = makeGalaxy(self.width, self.height, self.flux, a, b, theta, xy0=geom.Point2I(10, 20))
+        mimage = exposure.getMaskedImage()
+        ctrl = makeMeasurementConfig(nIterForRadius=2).plugins["ext_photometryKron_KronFlux"].makeControl()
+        ctrl.maxSincRadius = 5          # use both the sinc and summed apertures
+
+        x = np.array([10 + 0.5*self.width, 10 + 0.5*self.width + 0.3])
+        y = np.array([20 + 0.5*self.height, 20 + 0.5*self.height - 0.2])
+        aa = np.array([float(a), 2.0])
+        bb = np.array([float(b), 1.5])
+        tt = np.full(len(x), math.radians(theta))
+
+        KronAperture = lsst.meas.extensions.photometryKron.KronAperture
+        expected = KronAperture.measureBatch(mimage, x, y, aa, bb, tt, ctrl)
+        # Embed the pixels in a larger array, so the view isn't contiguous
+        for name, plane in (("image", mimage.getImage()), ("variance", mimage.getVariance())):
+            padded = np.zeros((self.height + 10, self.width + 10), dtype=np.float32)
+            padded[5:-5, 5:-5] = plane.getArray()
+            if name == "image":
+                image = padded[5:-5, 5:-5]
+            else:
+                variance = padded[5:-5, 5:-5]
+        self.assertFalse(image.flags["C_CONTIGUOUS"])
+        results = KronAperture.measureBatch(image, variance, mimage.getXY0(), x, y, aa, bb, tt, ctrl)
+        for field in ("status", "radius", "instFlux", "instFluxErr"):
+            np.testing.assert_array_equal(results[field], expected[field])
+
+    def testPixelTypes(self):
+        """Check that we get consistent results for images of double and integer pixels.
+        """
+        a, b, theta = 6, 4, 30.0
+        exposure = makeGalaxy(self.width, self.height, self.flux, a, b, theta)
+        mimage = exposure.getMaskedImage()
+        ctrl = makeMeasurementConfig(nIterForRadius=2).plugins["ext_photometryKron_KronFlux"].makeControl()
+        axes = afwEllipses.Axes(a, b, math.radians(theta))
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+
+        KronAperture = lsst.meas.extensions.photometryKron.KronAperture
+        expected = KronAperture.determineRadius(mimage, axes, center, ctrl)
+        expectedFlux = expected.measureFlux(mimage, ctrl.nRadiusForFlux, ctrl.maxSincRadius)
+
+        for ImageClass, dtype, rtol in ((afwImage.ImageD, np.float64, 1e-6),
+                                        (afwImage.ImageI, np.int32, 1e-2),
+                                        (afwImage.ImageU, np.uint16, 1e-2)):
+            image = ImageClass(np.round(mimage.getImage().getArray()).astype(dtype)
+                               if dtype != np.float64 else mimage.getImage().getArray().astype(dtype))
+            converted = afwImage.makeMaskedImage(image, mimage.getMask(), mimage.getVariance())
+            aperture = KronAperture.determineRadius(converted, axes, center, ctrl)
+            self.assertFloatsAlmostEqual(aperture.getAxes().getDeterminantRadius(),
+                                         expected.getAxes().getDeterminantRadius(), rtol=rtol)
+            flux = aperture.measureFlux(converted, ctrl.nRadiusForFlux, ctrl.maxSincRadius)
+            self.assertFloatsAlmostEqual(flux[0], expectedFlux[0], rtol=rtol)
+            self.assertFloatsAlmostEqual(flux[1], expectedFlux[1], rtol=rtol)
+
+    def testMeasureOnlyWhatIsRequested(self):
+        """Check that we can measure just the radius, or the radius and flux but not its error.
+        """
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        exposure = makeGalaxy(self.width, self.height, self.flux, 6, 4, 30.0)
+        expected = measureFree(exposure, center, makeMeasurementConfig())
+
+        for doMeasureFlux, doMeasureFluxErr in ((False, True), (True, False)):
+            msConfig = makeMeasurementConfig()
+            msConfig.plugins["ext_photometryKron_KronFlux"].doMeasureFlux = doMeasureFlux
+            msConfig.plugins["ext_photometryKron_KronFlux"].doMeasureFluxErr = doMeasureFluxErr
+            source = measureFree(exposure, center, msConfig)
+            self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+            self.assertEqual(source.get("ext_photometryKron_KronFlux_radius"),
+                             expected.get("ext_photometryKron_KronFlux_radius"))
+            if doMeasureFlux:
+                self.assertEqual(source.get("ext_photometryKron_KronFlux_instFlux"),
+                                 expected.get("ext_photometryKron_KronFlux_instFlux"))
+            else:
+                self.assertTrue(np.isnan(source.get("ext_photometryKron_KronFlux_instFlux")))
+            self.assertTrue(np.isnan(source.get("ext_photometryKron_KronFlux_instFluxErr")))
+
+        # Without a variance plane
+        mimage = exposure.getMaskedImage()
+        ctrl = makeMeasurementConfig().plugins["ext_photometryKron_KronFlux"].makeControl()
+        args = [np.array([v]) for v in (center.getX(), center.getY(), 6.0, 4.0, math.radians(30.0))]
+        KronAperture = lsst.meas.extensions.photometryKron.KronAperture
+        withVariance = KronAperture.measureBatch(mimage, *args, ctrl=ctrl)
+        results = KronAperture.measureBatch(mimage.getImage().getArray(), None, mimage.getXY0(), *args,
+                                            ctrl=ctrl)
+        self.assertEqual(results["radius"][0], withVariance["radius"][0])
+        self.assertEqual(results["instFlux"][0], withVariance["instFlux"][0])
+        self.assertTrue(np.isnan(results["instFluxErr"][0]))
+
+    def testBadMaskPlanes(self):
+        """Check that masked pixels can be ignored or replaced, and are counted.
+        """
+        a, b, theta = 6, 4, 30.0
+        exposure = makeGalaxy(self.width, self.height, self.flux, a, b, theta)
+        mimage = exposure.getMaskedImage()
+        ctrl = makeMeasurementConfig(nIterForRadius=2).plugins["ext_photometryKron_KronFlux"].makeControl()
+        args = [np.array([v]) for v in (0.5*self.width, 0.5*self.height, a, b, math.radians(theta))]
+
+        KronAperture = lsst.meas.extensions.photometryKron.KronAperture
+        expected = KronAperture.measureBatch(mimage, *args, ctrl=ctrl)
+        # Add a cosmic ray near the centre of the galaxy
+        crBox = geom.Box2I(geom.Point2I(self.width//2 + 3, self.height//2 + 2), geom.Extent2I(2, 2))
+        mimage.image[crBox] = self.flux
+        mimage.mask[crBox] = afwImage.Mask.getPlaneBitMask("CR")
+
+        corrupted = KronAperture.measureBatch(mimage, *args, ctrl=ctrl)
+        self.assertGreater(corrupted["instFlux"][0], 2*expected["instFlux"][0])
+        self.assertEqual(corrupted["nBadPixels"][0], 0)
+
+        ctrl.badMaskPlanes = ["CR", "NO_SUCH_PLANE"]
+        self.assertEqual(ctrl.getBadPixelMask(), afwImage.Mask.getPlaneBitMask("CR"))
+        for replaceBadPixels, rtol in ((False, 5e-2), (True, 1e-2)):
+            ctrl.replaceBadPixels = replaceBadPixels
+            results = KronAperture.measureBatch(mimage, *args, ctrl=ctrl)
+            self.assertEqual(results["status"][0], 0)
+            self.assertEqual(results["nBadPixels"][0], crBox.getArea())
+            for field in ("radius", "instFlux"):
+                self.assertFloatsAlmostEqual(results[field][0], expected[field][0], rtol=rtol)
+
+        # Masked pixels are often NaN; they mustn't contaminate the radius, flux or error, on either the
+        # summed or the sinc path
+        mimage.image[crBox] = np.nan
+        mimage.variance[crBox] = np.nan
+        for maxSincRadius in (0.0, 20.0):
+            ctrl.maxSincRadius = maxSincRadius
+            for replaceBadPixels in (False, True):
+                ctrl.replaceBadPixels = replaceBadPixels
+                results = KronAperture.measureBatch(mimage, *args, ctrl=ctrl)
+                self.assertEqual(results["status"][0], 0)
+                self.assertEqual(results["nBadPixels"][0], crBox.getArea())
+                for field in ("radius", "instFlux", "instFluxErr"):
+                    self.assertTrue(np.isfinite(results[field][0]), field)
+                self.assertFloatsAlmostEqual(results["instFlux"][0], expected["instFlux"][0], rtol=5e-2)
+
+    def testHeavyFootprint(self):
+        """Check that we can measure a source using only the pixels in its HeavyFootprint.
+        """
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        exposure = makeGalaxy(self.width, self.height, self.flux, 6, 4, 30.0)
+        mimage = exposure.getMaskedImage()
+
+        msConfig = makeMeasurementConfig()
+        msConfig.doReplaceWithNoise = False
+        msConfig.plugins["ext_photometryKron_KronFlux"].useHeavyFootprint = True
+        schema = afwTable.SourceTable.makeMinimalSchema()
+        task = measBase.SingleFrameMeasurementTask(schema, config=msConfig, algMetadata=PropertyList())
+        measCat = afwTable.SourceCatalog(schema)
+        source = measCat.addNew()
+        fp = afwDetection.FootprintSet(mimage, afwDetection.Threshold(0.1)).getFootprints()[0]
+        source.setFootprint(fp)
+        task.run(measCat, exposure)
+        expected = {field: source.get("ext_photometryKron_KronFlux_" + field)
+                    for field in ("radius", "instFlux", "instFluxErr")}
+        self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+        # Measure the child from its HeavyFootprint, with the exposure's pixels replaced by garbage
+        source.setFootprint(afwDetection.makeHeavyFootprint(fp, mimage))
+        mimage.image.set(1000.0)
+        task.plugins["ext_photometryKron_KronFlux"].cpp.measure(source, exposure)
+        for field, value in expected.items():
+            self.assertFloatsAlmostEqual(source.get("ext_photometryKron_KronFlux_" + field), value,
+                                         rtol=2e-3)
+        self.assertTrue(np.all(mimage.image.array == 1000.0))
+
+    def testMeasureN(self):
+        """Check that measuring a blend's sources together agrees with measuring them one by one.
+        """
+        centers = [geom.Point2D(0.5*self.width - 15, 0.5*self.height),
+                   geom.Point2D(0.5*self.width + 15, 0.5*self.height + 3)]
+        exposure = makeGalaxy(self.width, self.height, self.flux, 6, 4, 30.0,
+                              xcen=centers[0].getX(), ycen=centers[0].getY())
+        other = makeGalaxy(self.width, self.height, 0.5*self.flux, 5, 3, -20.0,
+                           xcen=centers[1].getX(), ycen=centers[1].getY())
+        exposure.image += other.image
+
+        msConfig = makeMeasurementConfig(nIterForRadius=2)
+        msConfig.doReplaceWithNoise = False
+        schema = afwTable.SourceTable.makeMinimalSchema()
+        task = measBase.SingleFrameMeasurementTask(schema, config=msConfig, algMetadata=PropertyList())
+        measCat = afwTable.SourceCatalog(schema)
+        for center in centers:
+            source = measCat.addNew()
+            fp = afwDetection.Footprint(afwGeom.SpanSet.fromShape(20, offset=geom.Point2I(center)))
+            fp.addPeak(center.getX(), center.getY(), 1.0)
+            source.setFootprint(fp)
+        task.run(measCat, exposure)
+
+        fields = ["ext_photometryKron_KronFlux_" + field for field in
+                  ("radius", "radius_for_radius", "nIter", "instFlux", "instFluxErr")]
+        expected = [[source.get(field) for field in fields] for source in measCat]
+        for source in measCat:
+            self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+            source.set("ext_photometryKron_KronFlux_instFlux", np.nan)
+            source.set("ext_photometryKron_KronFlux_radius", np.nan)
+
+        task.plugins["ext_photometryKron_KronFlux"].cpp.measureN(measCat, exposure)
+        for source, values in zip(measCat, expected):
+            self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+            for field, value in zip(fields, values):
+                self.assertFloatsAlmostEqual(source.get(field), value, rtol=1e-6)
+
+    def testStats(self):
+        """Check the statistics collected with doCollectStats, and that none are collected without it.
+        """
+        exposure = makeGalaxy(self.width, self.height, self.flux, 6, 4, 30.0)
+        for doCollectStats in (False, True):
+            msConfig = makeMeasurementConfig(nIterForRadius=2)
+            msConfig.plugins["ext_photometryKron_KronFlux"].doCollectStats = doCollectStats
+            schema = afwTable.SourceTable.makeMinimalSchema()
+            algMeta = PropertyList()
+            task = measBase.SingleFrameMeasurementTask(schema, config=msConfig, algMetadata=algMeta)
+            measCat = afwTable.SourceCatalog(schema)
+            source = measCat.addNew()
+            ss = afwDetection.FootprintSet(exposure.getMaskedImage(), afwDetection.Threshold(0.1))
+            source.setFootprint(ss.getFootprints()[0])
+            # The plugin writes the statistics itself, after measuring each parent
+            task.run(measCat, exposure)
+
+            prefix = "EXT_PHOTOMETRYKRON_KRONFLUX_STATS_"
+            if not doCollectStats:
+                self.assertFalse(algMeta.exists(prefix + "MEASURE_CALLS"))
+                continue
+            self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+            self.assertEqual(algMeta.getScalar(prefix + "MEASURE_CALLS"), 1)
+            self.assertEqual(algMeta.getScalar(prefix + "RADIUS_CALLS"), 1)
+            self.assertEqual(algMeta.getScalar(prefix + "RADIUS_ITERATIONS"),
+                             source.get("ext_photometryKron_KronFlux_nIter"))
+            self.assertGreater(algMeta.getScalar(prefix + "RADIUS_PIXELS"), 0)
+            nFlux = algMeta.getScalar(prefix + "SINC_FLUX") + algMeta.getScalar(prefix + "SUMMED_FLUX")
+            self.assertEqual(nFlux, 1)
+            self.assertGreater(algMeta.getScalar(prefix + "FLUX_PIXELS"), 0)
+            self.assertEqual(algMeta.getScalar(prefix + "FAILURES"), 0)
+            self.assertEqual(algMeta.getScalar(prefix + "FLAG"), 0)
+            self.assertGreaterEqual(algMeta.getScalar(prefix + "RADIUS_TIME"), 0.0)
+
+        # Statistics counted by measureN are written too, once we ask for the final totals
+        msConfig = makeMeasurementConfig(nIterForRadius=2)
+        msConfig.doReplaceWithNoise = False
+        msConfig.plugins["ext_photometryKron_KronFlux"].doCollectStats = True
+        msConfig.plugins["ext_photometryKron_KronFlux"].doMeasureN = True
+        schema = afwTable.SourceTable.makeMinimalSchema()
+        algMeta = PropertyList()
+        task = measBase.SingleFrameMeasurementTask(schema, config=msConfig, algMetadata=algMeta)
+        plugin = task.plugins["ext_photometryKron_KronFlux"]
+        plugin.statsInterval = 1e6      # so that only the first parent is written as we measure
+        measCat = afwTable.SourceCatalog(schema)
+        for source in (measCat.addNew(), measCat.addNew()):
+            source.setFootprint(ss.getFootprints()[0])
+        task.run(measCat, exposure)
+        self.assertEqual(algMeta.getScalar(prefix + "MEASURE_CALLS"), 1)
+        plugin.writeStats()
+        self.assertEqual(algMeta.getScalar(prefix + "MEASURE_CALLS"), 2)
+        self.assertGreater(algMeta.getScalar(prefix + "MEASURE_N_CALLS"), 0)
+
+    def testRecordCost(self):
+        """Check the per-source time and pixel counts added by doRecordCost.
+        """
+        exposure = makeGalaxy(self.width, self.height, self.flux, 6, 4, 30.0)
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        msConfig = makeMeasurementConfig(nIterForRadius=2)
+        msConfig.plugins["ext_photometryKron_KronFlux"].doRecordCost = True
+        source = measureFree(exposure, center, msConfig)
+        self.assertGreater(source.get("ext_photometryKron_KronFlux_time_ns"), 0)
+        radius = source.get("ext_photometryKron_KronFlux_radius_for_radius")
+        nIter = source.get("ext_photometryKron_KronFlux_nIter")
+        self.assertAlmostEqual(source.get("ext_photometryKron_KronFlux_npix_radius"),
+                               nIter*math.pi*radius**2, delta=1)
+        radius = source.get("ext_photometryKron_KronFlux_radius")
+        self.assertAlmostEqual(source.get("ext_photometryKron_KronFlux_npix_flux"),
+                               math.pi*(2.5*radius)**2, delta=0.01*math.pi*(2.5*radius)**2)
+
+        msConfig = makeMeasurementConfig(forced=True)
+        msConfig.plugins["ext_photometryKron_KronFlux"].doRecordCost = True
+        forced = measureForced(exposure, source, exposure.getWcs(), msConfig)
+        self.assertGreater(forced.get("ext_photometryKron_KronFlux_time_ns"), 0)
+        self.assertEqual(forced.get("ext_photometryKron_KronFlux_npix_radius"), 0)
+        self.assertAlmostEqual(forced.get("ext_photometryKron_KronFlux_npix_flux"),
+                               source.get("ext_photometryKron_KronFlux_npix_flux"), delta=1)
+
+        self.assertNotIn("ext_photometryKron_KronFlux_time_ns", measureFree(exposure, center,
+                                                                            makeMeasurementConfig()).schema)
+
+    def testSlowSourceCapture(self):
+        """Check that a slow source is captured, and that replaying it reproduces its measurement.
+        """
+        exposure = makeGalaxy(self.width, self.height, self.flux, 6, 4, 30.0)
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        name = "ext_photometryKron_KronFlux"
+        with tempfile.TemporaryDirectory() as dirname:
+            msConfig = makeMeasurementConfig(nIterForRadius=2)
+            msConfig.plugins[name].slowSourceTime = 1e-9  # capture everything
+            msConfig.plugins[name].slowSourceDir = dirname
+            source = measureFree(exposure, center, msConfig)
+            filename = os.path.join(dirname, "%s_%d.kron" % (name, source.getId()))
+            self.assertTrue(os.path.exists(filename))
+            self.assertLess(os.path.getsize(filename), 12*exposure.getBBox().getArea())
+
+            repro = lsst.meas.extensions.photometryKron.KronReproduction.readFile(filename)
+
+            # A corrupt size (here, refRadiusName's) is rejected rather than allocated
+            with open(filename, "rb") as fd:
+                contents = fd.read()
+            refRadiusName = msConfig.plugins[name].refRadiusName.encode()
+            sizedName = len(refRadiusName).to_bytes(4, sys.byteorder) + refRadiusName
+            self.assertIn(sizedName, contents)
+            with open(filename, "wb") as fd:
+                fd.write(contents.replace(sizedName, b"\xff"*4 + refRadiusName, 1))
+            with self.assertRaises(lsst.pex.exceptions.IoError):
+                lsst.meas.extensions.photometryKron.KronReproduction.readFile(filename)
+        self.assertEqual(repro.getId(), source.getId())
+        self.assertEqual(repro.getName(), name)
+        self.assertGreater(repro.getTime(), 0)
+        self.assertEqual(repro.getControl().nIterForRadius, 2)
+        self.assertTrue(exposure.getBBox().contains(repro.getBBox()))
+
+        replayed = repro.replay(nRepeat=2)
+        for field in ("radius", "radius_for_radius", "psf_radius", "nIter", "instFlux", "instFluxErr"):
+            field = name + "_" + field
+            self.assertFloatsAlmostEqual(replayed.get(field), source.get(field), rtol=1e-6)
+        self.assertEqual(replayed.get(name + "_flag"), source.get(name + "_flag"))
+
+        msConfig = makeMeasurementConfig()
+        msConfig.plugins[name].slowSourceDir = "/nonexistent"  # slowSourceTime is 0: nothing's written
+        measureFree(exposure, center, msConfig)
+
+    def testReplayFlaggedShape(self):
+        """Check that a source whose shape is flagged, so its aperture is the PSF's, replays faithfully
+        when the PSF isn't round.
+        """
+        exposure = makeGalaxy(self.width, self.height, self.flux, 6, 4, 30.0)
+        exposure.setPsf(measAlg.KernelPsf(afwMath.AnalyticKernel(
+            25, 25, afwMath.GaussianFunction2D(3.0, 1.5, math.radians(30)))))
+        name = "ext_photometryKron_KronFlux"
+        msConfig = makeMeasurementConfig(nIterForRadius=2)
+        schema = afwTable.SourceTable.makeMinimalSchema()
+        task = measBase.SingleFrameMeasurementTask(schema, config=msConfig, algMetadata=PropertyList())
+        measCat = afwTable.SourceCatalog(schema)
+        source = measCat.addNew()
+        ss = afwDetection.FootprintSet(exposure.getMaskedImage(), afwDetection.Threshold(0.1))
+        source.setFootprint(ss.getFootprints()[0])
+        task.run(measCat, exposure)
+        source.set("base_SdssShape_flag", True)
+        task.plugins[name].cpp.measure(source, exposure)
+
+        ctrl = msConfig.plugins[name].makeControl()
+        with tempfile.TemporaryDirectory() as dirname:
+            filename = os.path.join(dirname, "flaggedShape.kron")
+            KronReproduction = lsst.meas.extensions.photometryKron.KronReproduction
+            KronReproduction(ctrl, name, source, exposure).writeFile(filename)
+            replayed = KronReproduction.readFile(filename).replay()
+        for field in ("radius", "radius_for_radius", "psf_radius", "nIter", "instFlux", "instFluxErr"):
+            field = name + "_" + field
+            self.assertFloatsAlmostEqual(replayed.get(field), source.get(field), rtol=1e-6)
+        self.assertEqual(replayed.get(name + "_flag"), source.get(name + "_flag"))
+
+    def testForcedBands(self):
+        """Check that measuring several bands together agrees with forced measurement in each band.
+        """
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        reference = makeGalaxy(self.width, self.height, self.flux, 8, 5, 30.0)
+        msConfig = makeMeasurementConfig(nIterForRadius=2)
+        source = measureFree(reference, center, msConfig)
+        self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+        refWcs = reference.getWcs()
+
+        bands = ["g", "r", "i"]
+        exposures = []
+        expected = []
+        for i, band in enumerate(bands):
+            exposure = makeGalaxy(self.width, self.height, (i + 1)*self.flux, 8 - i, 5, 30.0 + 10*i)
+            exposure.setWcs(refWcs)
+            exposures.append(exposure)
+            forced = measureForced(exposure, source, refWcs, makeMeasurementConfig(forced=True))
+            self.assertFalse(forced.get("ext_photometryKron_KronFlux_flag"))
+            expected.append((forced.get("ext_photometryKron_KronFlux_instFlux"),
+                             forced.get("ext_photometryKron_KronFlux_instFluxErr")))
+
+        msConfig = makeMeasurementConfig(forced=True)
+        msConfig.plugins["ext_photometryKron_KronFlux"].bandNames = bands
+        refCat = afwTable.SourceCatalog(source.table)
+        refCat.append(source)
+        schema = afwTable.SourceTable.makeMinimalSchema()
+        task = measBase.ForcedMeasurementTask(schema, config=msConfig, algMetadata=PropertyList())
+        measCat = task.generateMeasCat(exposures[0], refCat, refWcs)
+        task.attachTransformedFootprints(measCat, refCat, exposures[0], refWcs)
+        task.run(measCat, exposures[0], refCat, refWcs)
+        task.plugins["ext_photometryKron_KronFlux"].cpp.measureForcedBands(measCat[0], exposures, refCat[0],
+                                                                           refWcs)
+        for band, (instFlux, instFluxErr) in zip(bands, expected):
+            prefix = "ext_photometryKron_KronFlux_" + band
+            self.assertFloatsAlmostEqual(measCat[0].get(prefix + "_instFlux"), instFlux, rtol=1e-6)
+            self.assertFloatsAlmostEqual(measCat[0].get(prefix + "_instFluxErr"), instFluxErr, rtol=1e-6)
+
+        with self.assertRaises(lsst.pex.exceptions.LengthError):
+            task.plugins["ext_photometryKron_KronFlux"].cpp.measureForcedBands(measCat[0], exposures[:2],
+                                                                               refCat[0], refWcs)
+
+    def testForcedApertureTable(self):
+        """Check that forced measurement with a saved table of reference apertures agrees with using
+        the reference catalog.
+        """
+        center = geom.Point2D(0.5*self.width, 0.5*self.height)
+        reference = makeGalaxy(self.width, self.height, self.flux, 8, 5, 30.0)
+        source = measureFree(reference, center, makeMeasurementConfig(nIterForRadius=2))
+        self.assertFalse(source.get("ext_photometryKron_KronFlux_flag"))
+        refCat = afwTable.SourceCatalog(source.table)
+        refCat.append(source)
+
+        exposure = makeGalaxy(self.width, self.height, 2*self.flux, 7, 5, 40.0)
+        cdMatrix = afwGeom.makeCdMatrix(scale=0.5*reference.getWcs().getPixelScale(),
+                                        orientation=30*geom.degrees, flipX=True)
+        exposure.setWcs(afwGeom.makeSkyWcs(crpix=geom.Point2D(1.23, 4.56),
+                                           crval=geom.SpherePoint(0.0, 0.0, geom.degrees),
+                                           cdMatrix=cdMatrix))
+        expected = measureForced(exposure, source, reference.getWcs(), makeMeasurementConfig(forced=True))
+
+        msConfig = makeMeasurementConfig(forced=True)
+        ctrl = msConfig.plugins["ext_photometryKron_KronFlux"].makeControl()
+        table = lsst.meas.extensions.photometryKron.KronApertureTable(refCat, ctrl)
+        self.assertEqual(len(table), 1)
+        with lsst.utils.tests.getTempFilePath(".npy") as filename:
+            np.save(filename, table.getRecords())
+            table = lsst.meas.extensions.photometryKron.KronApertureTable(np.load(filename, mmap_mode="r"))
+
+            schema = afwTable.SourceTable.makeMinimalSchema()
+            task = measBase.ForcedMeasurementTask(schema, config=msConfig, algMetadata=PropertyList())
+            task.plugins["ext_photometryKron_KronFlux"].cpp.setForcedApertureTable(table)
+            measCat = task.generateMeasCat(exposure, refCat, reference.getWcs())
+            task.attachTransformedFootprints(measCat, refCat, exposure, reference.getWcs())
+            task.run(measCat, exposure, refCat, reference.getWcs())
+        for field in ("radius", "instFlux", "instFluxErr"):
+            field = "ext_photometryKron_KronFlux_" + field
+            self.assertFloatsAlmostEqual(measCat[0].get(field), expected.get(field), rtol=1e-12)
+
+    def testSyntheticGalaxies(self):
+        """Check the C++ galaxy renderer against makeGalaxy, and its total fluxes and noise.
+        """
+        photKron = lsst.meas.extensions.photometryKron
+        a, b, theta = 4, 2, 30.0
+        size = 60
+        expected = makeGalaxy(size, size, self.flux, a, b, theta).image.array
+        image = afwImage.ImageF(size, size)
+        photKron.renderGalaxies(image, [photKron.SyntheticGalaxy(0.5*size, 0.5*size, self.flux, a, b,
+                                                                 math.radians(theta))])
+        self.assertFloatsAlmostEqual(image.array, expected, atol=2e-3*expected.max())
+        self.assertFloatsAlmostEqual(image.array.sum(), self.flux, rtol=1e-3)
+
+        image = afwImage.ImageF(200, 200)
+        photKron.renderGalaxies(image, [photKron.SyntheticGalaxy(100, 100, self.flux, 5, 3, 0.3, 1.0)])
+        self.assertFloatsAlmostEqual(image.array.sum(), self.flux, rtol=2e-3)
+
+        # A Gaussian galaxy convolved with a Gaussian PSF has the sum of their second moments
+        bbox = geom.Box2I(geom.Point2I(0, 0), geom.Extent2I(200, 200))
+        psfSigma, noiseSigma = 2.0, 3.0
+        galaxy = photKron.SyntheticGalaxy(100, 100, self.flux, a, a, 0.0)
+        psf = afwDetection.GaussianPsf(41, 41, psfSigma)
+        exposure = photKron.makeSyntheticExposure(bbox, [galaxy], psf)
+        array = exposure.image.array
+        x = np.arange(array.shape[1]) - 100
+        self.assertFloatsAlmostEqual(array.sum(), self.flux, rtol=1e-3)
+        self.assertFloatsAlmostEqual((array.sum(axis=0)*x**2).sum()/array.sum(), a**2 + psfSigma**2,
+                                     rtol=1e-2)
+
+        exposure = photKron.makeSyntheticExposure(bbox, [], psf, noiseSigma=noiseSigma, seed=2)
+        self.assertFloatsAlmostEqual(exposure.image.array.std(), noiseSigma, rtol=2e-2)
+        self.assertFloatsAlmostEqual(exposure.variance.array, noiseSigma**2)
+        self.assertIsNotNone(exposure.getPsf())
+
+        galaxies = photKron.makeRandomGalaxies(bbox, 10000, minFlux=100, maxFlux=1e4, seed=3)
+        self.assertEqual(len(galaxies), 10000)
+        fluxes = np.array([galaxy.flux for galaxy in galaxies])
+        self.assertGreaterEqual(fluxes.min(), 100)
+        self.assertLessEqual(fluxes.max(), 1e4)
+        self.assertEqual([galaxy.x for galaxy in galaxies[:10]],
+                         [galaxy.x for galaxy in photKron.makeRandomGalaxies(bbox, 10, 100, 1e4, seed=3)])
+
+    def testMomentPolicies(self):
+        """Check that the specialised moments for round and axis-aligned apertures agree with the general one.
+        """
+        KronAperture = lsst.meas.extensions.photometryKron.KronAperture
+        ctrl = makeMeasurementConfig(nIterForRadius=2).plugins["ext_photometryKron_KronFlux"].makeControl()
+        for a, b, theta in ((5, 5, 0.0), (6, 3, 0.0)):
+            exposure = makeGalaxy(self.width, self.height, self.flux, a, b, theta)
+            for offset in (0.0, 0.5):   # centred on a pixel, which needs the central-pixel correction, or not
+                center = geom.Point2D(0.5*self.width + offset, 0.5*self.height + offset)
+                special = KronAperture.determineRadius(exposure.getMaskedImage(),
+                                                       afwEllipses.Axes(a, b, math.radians(theta)),
+                                                       center, ctrl)
+                # A slightly flattened and rotated aperture uses the general moment
+                general = KronAperture.determineRadius(exposure.getMaskedImage(),
+                                                       afwEllipses.Axes(a, b*(1 - 1e-12), 1e-12),
+                                                       center, ctrl)
+                self.assertFloatsAlmostEqual(special.getAxes().getDeterminantRadius(),
+                                             general.getAxes().getDeterminantRadius(), rtol=1e-9)
+
+    def testKernelVariant(self):
+        """Check that the kernel variant is reported in the metadata, and can be overridden.
+        """
+        photKron = lsst.meas.extensions.photometryKron
+        variant = photKron.getKronKernelVariant()
+        self.assertIn(variant, ("default", "avx2", "avx512"))
+
+        schema = afwTable.SourceTable.makeMinimalSchema()
+        algMeta = PropertyList()
+        measBase.SingleFrameMeasurementTask(schema, config=makeMeasurementConfig(), algMetadata=algMeta)
+        self.assertEqual(algMeta.getScalar("EXT_PHOTOMETRYKRON_KRONFLUX_KERNEL_VARIANT"), variant)
+
+        # Every CPU supports the default variant; unknown names are ignored
+        for requested, expected in (("default", "default"), ("nonsense", variant)):
+            env = dict(os.environ, LSST_KRON_KERNEL_VARIANT=requested)
+            output = subprocess.check_output(
+                [sys.executable, "-c",
+                 "import lsst.meas.extensions.photometryKron as k; print(k.getKronKernelVariant())"], env=env)
+            self.assertEqual(output.decode().strip(), expected)
+
+    def testKernelVariantsAgree(self):
+        """Check that the default and best kernel variants give bit-identical measurements.
+        """
+        variant = lsst.meas.extensions.photometryKron.getKronKernelVariant()
+        if variant == "default":
+            self.skipTest("This CPU only supports the default kernel variant")
+
+        # Measure a field (with the moment, sinc and summed kernels) in a fresh process, as the variant's
+        # chosen when the library's loaded
+        script = """
+import numpy as np
+import lsst.afw.detection as afwDetection
+import lsst.geom as geom
+import lsst.meas.extensions.photometryKron as photKron
+
+bbox = geom.Box2I(geom.Point2I(0, 0), geom.Extent2I(256, 256))
+galaxies = photKron.makeRandomGalaxies(bbox, 30, minFlux=500, maxFlux=1e5, seed=4)
+psf = afwDetection.GaussianPsf(21, 21, 2.0)
+exposure = photKron.makeSyntheticExposure(bbox, galaxies, psf, noiseSigma=3.0, seed=5)
+ctrl = photKron.KronFluxControl()
+ctrl.nIterForRadius = 3
+ctrl.maxSincRadius = 5
+x, y, a, b, theta = (np.array([getattr(galaxy, name) for galaxy in galaxies])
+                     for name in ("x", "y", "a", "b", "theta"))
+results = photKron.KronAperture.measureBatch(exposure.getMaskedImage(), x, y, a, b, theta, ctrl)
+print(photKron.getKronKernelVariant())
+for field in ("status", "radius", "radiusForRadius", "instFlux", "instFluxErr"):
+    print(field, " ".join(float(value).hex() for value in results[field]))
+"""
+        outputs = {}
+        for requested in ("default", variant):
+            env = dict(os.environ, LSST_KRON_KERNEL_VARIANT=requested)
+            output = subprocess.check_output([sys.executable, "-c", script], env=env).decode().splitlines()
+            self.assertEqual(output[0], requested)
+            outputs[requested] = output[1:]
+        for default, best in zip(outputs["default"], outputs[variant]):
+            self.assertEqual(default, best)
+
     def getTolRad(self, a, b):
         """Return R_K tolerance in hundredths of a pixel.
         """